@@ -80,6 +80,16 @@ public:
         return aabb(new_x, new_y, new_z);
     }
 
+    double surface_area() const {
+        auto dx = x.size(), dy = y.size(), dz = z.size();
+        return 2 * (dx*dy + dy*dz + dz*dx);
+    }
+
+    // False for boxes of infinite extent, like an infinite plane's
+    bool bounded() const {
+        return x.size() < infinity && y.size() < infinity && z.size() < infinity;
+    }
+
     int longest_axis() const {
         if (x.size() > y.size())
             return x.size() > z.size() ? 0 : 2;
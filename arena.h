@@ -0,0 +1,202 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "wicked.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+
+class bvh_node;
+class material;
+class texture;
+
+
+// What scene memory is spent on, for the run report's breakdown
+enum class memory_category { geometry, bvh, textures, materials };
+constexpr int memory_category_count = 4;
+
+inline const char* memory_category_name(memory_category category) {
+    switch (category) {
+        case memory_category::geometry:  return "geometry";
+        case memory_category::bvh:       return "bvh";
+        case memory_category::textures:  return "textures";
+        default:                         return "materials";
+    }
+}
+
+// Bytes of scene data built since the last reset(), per category: objects allocated in
+// a scene_arena, plus what large objects keep on the heap next to them (mesh and particle
+// storage, decoded image pixels, BVH primitive arrays). BVH nodes are in bvh_memory().
+// Scene loads reset it, so it covers the current scene rather than the whole process.
+struct scene_memory_tally {
+    std::atomic<std::uint64_t> bytes[memory_category_count] = {};
+
+    void add(memory_category category, std::uint64_t count) { bytes[int(category)] += count; }
+    void reset() {
+        for (auto& category_bytes : bytes)
+            category_bytes = 0;
+    }
+    std::uint64_t operator[](memory_category category) const { return bytes[int(category)].load(); }
+};
+
+inline scene_memory_tally& scene_memory() {
+    static scene_memory_tally tally;
+    return tally;
+}
+
+
+
+
+
+// Bump allocator for the objects of one scene. make<T>() returns an ordinary shared_ptr,
+// so the hittable graph keeps its ownership model, but the object and its control block
+// come from large chunks in creation order instead of one heap allocation each: objects
+// built together (a group's primitives, a material and its texture) end up next to each
+// other. Releasing an object frees nothing; the chunks go all at once when the arena and
+// the last object made from it are gone (every object holds a reference to the chunks).
+// Construction is single-threaded, so allocation takes no lock.
+class scene_arena {
+public:
+    template <typename T, typename... Args>
+    shared_ptr<T> make(Args&&... args) {
+        return std::allocate_shared<T>(allocator<T>(chunks, category_of<T>()), std::forward<Args>(args)...);
+    }
+
+    // Like make(), but an object made earlier by intern<T>() from equal arguments is
+    // returned instead of a new one, so identical materials and textures exist once.
+    // Arguments compare by value, shared_ptrs by address (intern what they point to
+    // first). Only for types whose construction has no side effects, e.g. no RNG draws.
+    template <typename T, typename... Args>
+    shared_ptr<T> intern(const Args&... args) {
+        std::string key = typeid(T).name();
+        (append_key(key, args), ...);
+
+        auto found = interned.find(key);
+        if (found != interned.end()) {
+            interned_hits++;
+            return std::static_pointer_cast<T>(found->second);
+        }
+        auto object = make<T>(args...);
+        interned.emplace(std::move(key), object);
+        return object;
+    }
+
+    // Chunk bytes reserved, and objects allocated so far
+    std::uint64_t reserved_bytes() const { return chunks->reserved; }
+    std::uint64_t object_count() const { return chunks->objects; }
+
+    // intern() calls answered with an existing object
+    std::uint64_t interned_count() const { return interned_hits; }
+
+
+
+private:
+    struct chunk_list {
+        static constexpr size_t chunk_bytes = 64 * 1024;
+
+        std::vector<std::unique_ptr<unsigned char[]>> chunks;
+        unsigned char* next = nullptr;
+        size_t left = 0;
+        std::uint64_t reserved = 0;
+        std::uint64_t objects = 0;
+
+        void* allocate(size_t bytes, size_t alignment, memory_category category) {
+            objects++;
+            scene_memory().add(category, bytes);
+
+            // Big objects get a chunk of their own, the current one keeps its room
+            if (bytes + alignment > chunk_bytes / 4) {
+                unsigned char* own = new_chunk(bytes + alignment);
+                return own + padding(own, alignment);
+            }
+
+            if (next == nullptr || padding(next, alignment) + bytes > left) {
+                next = new_chunk(chunk_bytes);
+                left = chunk_bytes;
+            }
+            size_t skip = padding(next, alignment);
+            void* result = next + skip;
+            next += skip + bytes;
+            left -= skip + bytes;
+            return result;
+        }
+
+        unsigned char* new_chunk(size_t size) {
+            chunks.emplace_back(new unsigned char[size]);
+            reserved += size;
+            return chunks.back().get();
+        }
+
+        static size_t padding(const unsigned char* p, size_t alignment) {
+            return (alignment - reinterpret_cast<std::uintptr_t>(p) % alignment) % alignment;
+        }
+    };
+
+    // Allocator for std::allocate_shared: hands out arena memory, never frees it
+    template <typename T>
+    struct allocator {
+        using value_type = T;
+
+        shared_ptr<chunk_list> chunks;
+        memory_category category;
+
+        allocator(shared_ptr<chunk_list> chunks, memory_category category)
+            : chunks(std::move(chunks)), category(category) {}
+
+        template <typename U>
+        allocator(const allocator<U>& other) : chunks(other.chunks), category(other.category) {}
+
+        T* allocate(size_t n) {
+            return static_cast<T*>(chunks->allocate(n * sizeof(T), alignof(T), category));
+        }
+
+        void deallocate(T*, size_t) {}
+
+        template <typename U>
+        bool operator==(const allocator<U>& other) const { return chunks == other.chunks; }
+        template <typename U>
+        bool operator!=(const allocator<U>& other) const { return chunks != other.chunks; }
+    };
+
+    // BVH nodes, materials and textures by base class, everything else is geometry
+    template <typename T>
+    static constexpr memory_category category_of() {
+        if constexpr (std::is_base_of_v<bvh_node, T>) return memory_category::bvh;
+        else if constexpr (std::is_base_of_v<material, T>) return memory_category::materials;
+        else if constexpr (std::is_base_of_v<texture, T>) return memory_category::textures;
+        else return memory_category::geometry;
+    }
+
+    template <typename A>
+    static void append_key(std::string& key, const A& arg) {
+        key += typeid(A).name();
+        key += '|';
+        if constexpr (std::is_same_v<A, std::string>) {
+            key.append(arg.c_str(), arg.size() + 1);
+        } else if constexpr (std::is_convertible_v<const A&, const char*>) {
+            key.append(arg, std::strlen(arg) + 1);
+        } else if constexpr (is_shared_ptr<A>::value) {
+            const void* address = arg.get();
+            key.append(reinterpret_cast<const char*>(&address), sizeof(address));
+        } else {
+            static_assert(std::is_trivially_copyable_v<A>, "intern() keys need plain value arguments");
+            key.append(reinterpret_cast<const char*>(&arg), sizeof(arg));
+        }
+    }
+
+    template <typename A> struct is_shared_ptr : std::false_type {};
+    template <typename A> struct is_shared_ptr<shared_ptr<A>> : std::true_type {};
+
+    shared_ptr<chunk_list> chunks = make_shared<chunk_list>();
+    std::unordered_map<std::string, shared_ptr<void>> interned;
+    std::uint64_t interned_hits = 0;
+};
+
+#endif
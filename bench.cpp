@@ -0,0 +1,898 @@
+#include "wicked.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "scenes.h"
+#include "scene_parser.h"
+#include "fast_math.h"
+
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+
+// Benchmark suite: microbenchmarks for the intersectors, box test, textures and noise,
+// the fast-math approximations against libm, BVH build/traversal on synthetic scenes,
+// and end-to-end renders of the Wicked scene. --compare prints the difference between
+// two renders instead (e.g. the raytracer and raytracer_fast builds, see the Makefile).
+//
+//   ./wicked_bench [--quick] [--filter <substring>] [--json <file>]
+//   ./wicked_bench --compare <a.ppm> <b.ppm>
+
+
+struct bench_result {
+    std::string name;
+    std::string group;
+    std::uint64_t ops = 0;     // operations (or rays) timed
+    double seconds = 0;
+    bool counts_rays = false;  // Report Mrays/s for this benchmark
+    std::uint64_t bytes = 0;   // Memory held by the structure under test, 0 = not measured
+    double max_error = -1;     // Worst-case absolute error against libm, < 0 = not measured
+
+    double ns_per_op() const { return ops ? 1e9 * seconds / ops : 0; }
+    double mrays_per_s() const { return (counts_rays && seconds > 0) ? ops / seconds / 1e6 : 0; }
+};
+
+
+struct bench_options {
+    bool quick = false;
+    std::string filter;
+    std::string json_path;
+    std::string compare[2];
+};
+
+
+using bench_clock = std::chrono::steady_clock;
+
+inline double seconds_since(bench_clock::time_point start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+
+
+// Keeps results alive so the optimizer cannot drop the work being timed
+static volatile double bench_sink;
+
+inline void keep(double x) { bench_sink = bench_sink + x; }
+inline void keep(const color& c) { keep(c.x() + c.y() + c.z()); }
+
+
+
+
+
+// Repeats batch() (which performs ops_per_batch operations) until min_seconds have passed
+template <typename Batch>
+bench_result time_batches(const std::string& group, const std::string& name,
+                          std::uint64_t ops_per_batch, double min_seconds, bool counts_rays,
+                          Batch batch) {
+    batch();  // warm up caches and lazily built state
+
+    bench_result result;
+    result.name = name;
+    result.group = group;
+    result.counts_rays = counts_rays;
+
+    auto start = bench_clock::now();
+    do {
+        batch();
+        result.ops += ops_per_batch;
+        result.seconds = seconds_since(start);
+    } while (result.seconds < min_seconds);
+
+    return result;
+}
+
+
+
+
+// Rays from random points on a sphere of radius `distance` aimed at jittered points near target
+inline std::vector<ray> random_rays(int count, const point3& target, double distance, double jitter) {
+    std::vector<ray> rays;
+    rays.reserve(count);
+    for (int i = 0; i < count; i++) {
+        auto origin = target + distance * random_unit_vector();
+        auto aim = target + jitter * vec3::random(-1, 1);
+        rays.emplace_back(origin, aim - origin, random_double());
+    }
+    return rays;
+}
+
+inline std::vector<point3> random_points(int count, double extent) {
+    std::vector<point3> points;
+    points.reserve(count);
+    for (int i = 0; i < count; i++)
+        points.push_back(vec3::random(-extent, extent));
+    return points;
+}
+
+
+
+
+
+// Reads a P3 (the raytracer's stdout) or P6 image into 8-bit RGB triples
+inline bool read_ppm(const std::string& path, int& width, int& height, std::vector<int>& rgb) {
+    std::ifstream file(path, std::ios::binary);
+    std::string magic;
+    int max_value = 0;
+    file >> magic >> width >> height >> max_value;
+    if (!file || (magic != "P3" && magic != "P6") || max_value != 255 || width <= 0 || height <= 0) {
+        std::cerr << "ERROR: '" << path << "' is not an 8-bit .ppm (P3 or P6)\n";
+        return false;
+    }
+
+    rgb.resize(size_t(width) * height * 3);
+    if (magic == "P3") {
+        for (auto& value : rgb)
+            file >> value;
+    } else {
+        file.get();  // The single whitespace before the pixels
+        std::vector<unsigned char> bytes(rgb.size());
+        file.read(reinterpret_cast<char*>(bytes.data()), std::streamsize(bytes.size()));
+        rgb.assign(bytes.begin(), bytes.end());
+    }
+    if (!file) {
+        std::cerr << "ERROR: '" << path << "' ends before its " << width << "x" << height << " pixels\n";
+        return false;
+    }
+    return true;
+}
+
+// Prints the difference between two renders of the same frame: mean level of each,
+// RMSE and largest difference in 8-bit levels, and how many pixels differ at all
+inline bool compare_images(const std::string& path_a, const std::string& path_b) {
+    int width_a, height_a, width_b, height_b;
+    std::vector<int> a, b;
+    if (!read_ppm(path_a, width_a, height_a, a) || !read_ppm(path_b, width_b, height_b, b))
+        return false;
+    if (width_a != width_b || height_a != height_b) {
+        std::cerr << "ERROR: '" << path_a << "' is " << width_a << "x" << height_a << ", '"
+                  << path_b << "' is " << width_b << "x" << height_b << "\n";
+        return false;
+    }
+
+    double sum_a = 0, sum_b = 0, squared = 0;
+    int largest = 0;
+    size_t differing = 0;
+    for (size_t p = 0; p < a.size(); p += 3) {
+        bool differs = false;
+        for (size_t c = p; c < p + 3; c++) {
+            int d = a[c] - b[c];
+            sum_a += a[c];
+            sum_b += b[c];
+            squared += double(d) * d;
+            largest = std::max(largest, std::abs(d));
+            differs = differs || d != 0;
+        }
+        differing += differs;
+    }
+
+    std::cout << "Comparing " << path_a << " and " << path_b << " (" << width_a << "x" << height_a << ")\n";
+    std::cout << "  mean level: " << sum_a / a.size() << " vs " << sum_b / b.size() << "\n";
+    std::cout << "  RMSE: " << std::sqrt(squared / a.size()) << " levels, largest difference "
+              << largest << "\n";
+    std::cout << "  pixels differing: " << differing << " of " << a.size() / 3 << "\n";
+    return true;
+}
+
+
+
+
+
+class bench_runner {
+public:
+    explicit bench_runner(const bench_options& options) : options(options) {}
+
+    bool enabled(const std::string& group, const std::string& name) const {
+        return options.filter.empty()
+            || (group + "/" + name).find(options.filter) != std::string::npos;
+    }
+
+    void add(const bench_result& r) {
+        results.push_back(r);
+        std::cout << "  " << r.group << "/" << r.name;
+        for (auto pad = r.group.size() + r.name.size(); pad < 48; pad++)
+            std::cout << ' ';
+        std::cout.setf(std::ios::fixed);
+        std::cout.precision(2);
+        std::cout << r.ns_per_op() << " ns/op";
+        if (r.counts_rays)
+            std::cout << "   " << r.mrays_per_s() << " Mrays/s";
+        if (r.bytes)
+            std::cout << "   " << r.bytes / 1e6 << " MB";
+        if (r.max_error >= 0) {
+            std::cout.unsetf(std::ios::fixed);
+            std::cout << "   max error " << r.max_error;
+        }
+        std::cout << '\n' << std::flush;
+    }
+
+    // Accuracy checks that exceeded their bound, main() exits non-zero if there are any
+    int failures() const { return failed_checks; }
+
+    double min_seconds() const { return options.quick ? 0.05 : 0.5; }
+    bool quick() const { return options.quick; }
+
+
+
+    // Hit test of every ray in `rays` against one hittable
+    void intersect(const std::string& group, const std::string& name,
+                   const hittable& object, const std::vector<ray>& rays, std::uint64_t bytes = 0) {
+        if (!enabled(group, name)) return;
+
+        auto result = time_batches(group, name, rays.size(), min_seconds(), true, [&] {
+            hit_record rec;
+            double hits = 0;
+            for (const auto& r : rays)
+                if (object.hit(r, interval(0.001, infinity), rec))
+                    hits += rec.t;
+            keep(hits);
+        });
+        result.bytes = bytes;
+        add(result);
+    }
+
+    // Any-hit test of every ray, the cost of a shadow or visibility ray
+    void occluded(const std::string& group, const std::string& name,
+                  const hittable& object, const std::vector<ray>& rays) {
+        if (!enabled(group, name)) return;
+
+        add(time_batches(group, name, rays.size(), min_seconds(), true, [&] {
+            double blocked = 0;
+            for (const auto& r : rays)
+                blocked += object.occluded(r, interval(0.001, infinity));
+            keep(blocked);
+        }));
+    }
+
+    void lookup(const std::string& group, const std::string& name,
+                const texture& tex, const std::vector<point3>& points) {
+        if (!enabled(group, name)) return;
+
+        add(time_batches(group, name, points.size(), min_seconds(), false, [&] {
+            color sum(0,0,0);
+            for (const auto& p : points)
+                sum += tex.value(p.x() - std::floor(p.x()), p.y() - std::floor(p.y()), p);
+            keep(sum);
+        }));
+    }
+
+    // The same lookups through a texture's flat form, as materials evaluate it
+    void lookup_flat(const std::string& name, const texture& tex, const std::vector<point3>& points) {
+        if (!enabled("texture", name + "_flat")) return;
+
+        flat_texture flat = tex.flatten();
+        add(time_batches("texture", name + "_flat", points.size(), min_seconds(), false, [&] {
+            color sum(0,0,0);
+            for (const auto& p : points)
+                sum += flat.value(p.x() - std::floor(p.x()), p.y() - std::floor(p.y()), p);
+            keep(sum);
+        }));
+    }
+
+
+
+    // Times building a BVH over objects (parallel and on one thread), then traces rays through it
+    void bvh(const std::string& name, const hittable_list& objects, const std::vector<ray>& rays) {
+        shared_ptr<bvh_node> tree;
+
+        if (enabled("bvh_build", name)) {
+            add(time_batches("bvh_build", name, objects.objects.size(), min_seconds(), false, [&] {
+                tree = make_shared<bvh_node>(objects);
+            }));
+        }
+
+        if (enabled("bvh_build_serial", name)) {
+            bvh_build_options serial;
+            serial.parallel = false;
+            add(time_batches("bvh_build_serial", name, objects.objects.size(), min_seconds(), false, [&] {
+                tree = make_shared<bvh_node>(objects, serial);
+            }));
+        }
+
+        if (enabled("bvh_traverse", name)) {
+            if (!tree) tree = make_shared<bvh_node>(objects);
+            intersect("bvh_traverse", name, *tree, rays, tree->node_bytes());
+        }
+
+        // The builder's binary nodes as they are, against the quantized wide nodes above
+        if (enabled("bvh_traverse_binary", name)) {
+            bvh_build_options binary;
+            binary.compress = false;
+            bvh_node uncompressed(objects, binary);
+            intersect("bvh_traverse_binary", name, uncompressed, rays, uncompressed.node_bytes());
+        }
+
+        if (enabled("bvh_occluded", name)) {
+            if (!tree) tree = make_shared<bvh_node>(objects);
+            occluded("bvh_occluded", name, *tree, rays);
+        }
+
+        // Faster builders trade tree quality for build time: compare both sides of that
+        for (const char* builder : {"lbvh", "lbvh-treelet"}) {
+            bvh_build_options options;
+            parse_bvh_method(builder, options);
+            std::string suffix = std::string("_") + builder;
+            shared_ptr<bvh_node> variant;
+
+            if (enabled("bvh_build" + suffix, name)) {
+                add(time_batches("bvh_build" + suffix, name, objects.objects.size(), min_seconds(), false, [&] {
+                    variant = make_shared<bvh_node>(objects, options);
+                }));
+            }
+
+            if (enabled("bvh_traverse" + suffix, name)) {
+                if (!variant) variant = make_shared<bvh_node>(objects, options);
+                intersect("bvh_traverse" + suffix, name, *variant, rays);
+            }
+        }
+    }
+
+
+
+    // Packs count spheres (random_spheres_scene's distribution) into a sphere_set, then
+    // traces rays through it; compare with bvh_traverse/random_spheres_* and triangle_soup_*
+    void particles(int count, double extent, const std::vector<ray>& rays) {
+        auto name = std::to_string(count);
+        if (!enabled("sphere_set_build", name) && !enabled("sphere_set_traverse", name))
+            return;
+
+        std::vector<point3> centers(count);
+        std::vector<double> radii(count);
+        double radius = extent / std::cbrt(double(count)) * 0.3;
+        for (int i = 0; i < count; i++) {
+            centers[i] = vec3::random(-extent, extent);
+            radii[i] = radius * random_double(0.5, 1.0);
+        }
+        auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+
+        shared_ptr<sphere_set> set;
+        auto build = [&] {
+            set = make_shared<sphere_set>();
+            for (int i = 0; i < count; i++)
+                set->add(centers[i], radii[i], mat);
+            set->build();
+        };
+
+        if (enabled("sphere_set_build", name)) {
+            auto result = time_batches("sphere_set_build", name, count, min_seconds(), false, build);
+            result.bytes = set->memory_bytes();
+            add(result);
+        }
+
+        if (!set) build();
+        intersect("sphere_set_traverse", name, *set, rays, set->memory_bytes());
+    }
+
+
+
+    // Packs count triangles (triangle_soup_scene's distribution) into a triangle_mesh,
+    // then traces rays through it; compare with bvh_traverse/triangle_soup_*
+    void meshes(int count, double extent, const std::vector<ray>& rays) {
+        auto name = std::to_string(count);
+        if (!enabled("triangle_mesh_build", name) && !enabled("triangle_mesh_traverse", name))
+            return;
+
+        std::vector<point3> vertices(3 * size_t(count));
+        double size = extent / std::cbrt(double(count)) * 0.8;
+        for (int i = 0; i < count; i++) {
+            vertices[3*i] = vec3::random(-extent, extent);
+            vertices[3*i + 1] = vertices[3*i] + size * vec3::random(-1, 1);
+            vertices[3*i + 2] = vertices[3*i] + size * vec3::random(-1, 1);
+        }
+        auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+
+        shared_ptr<triangle_mesh> mesh;
+        auto build = [&] {
+            mesh = make_shared<triangle_mesh>();
+            for (int i = 0; i < count; i++)
+                mesh->add(vertices[3*i], vertices[3*i + 1], vertices[3*i + 2], mat);
+            mesh->build();
+        };
+
+        if (enabled("triangle_mesh_build", name)) {
+            auto result = time_batches("triangle_mesh_build", name, count, min_seconds(), false, build);
+            result.bytes = mesh->memory_bytes();
+            add(result);
+        }
+
+        if (!mesh) build();
+        intersect("triangle_mesh_traverse", name, *mesh, rays, mesh->memory_bytes());
+    }
+
+    // A wavy heightfield of size x size vertices with normals and UVs, like a scanned
+    // terrain, as a triangle_mesh and as a compressed indexed_mesh. The raw figure is the
+    // same mesh indexed with double positions, normals and UVs and int indices, no BVH.
+    void heightfield(int size, double extent, const std::vector<ray>& rays) {
+        int triangles = 2 * (size - 1) * (size - 1);
+        auto name = std::to_string(triangles);
+        if (!enabled("heightfield_triangle_mesh", name) && !enabled("heightfield_indexed_mesh", name))
+            return;
+
+        auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+        std::vector<point3> points(size_t(size) * size);
+        std::vector<vec3> normals(points.size());
+        indexed_mesh indexed;
+        for (int j = 0; j < size; j++) {
+            for (int i = 0; i < size; i++) {
+                double x = extent * (2.0 * i / (size - 1) - 1), z = extent * (2.0 * j / (size - 1) - 1);
+                size_t k = size_t(j) * size + i;
+                points[k] = point3(x, 3 * std::sin(0.3 * x) * std::cos(0.2 * z), z);
+                normals[k] = unit_vector(vec3(-0.9 * std::cos(0.3 * x) * std::cos(0.2 * z), 1,
+                                              0.6 * std::sin(0.3 * x) * std::sin(0.2 * z)));
+                indexed.add_vertex(points[k], normals[k], double(i) / (size - 1), double(j) / (size - 1));
+            }
+        }
+
+        triangle_mesh mesh;
+        for (int j = 0; j + 1 < size; j++) {
+            for (int i = 0; i + 1 < size; i++) {
+                int a = j * size + i, b = a + 1, c = a + size, d = c + 1;
+                mesh.add(points[a], points[b], points[d], normals[a], normals[b], normals[d], mat);
+                mesh.add(points[a], points[d], points[c], normals[a], normals[d], normals[c], mat);
+                indexed.add_triangle(a, b, d, mat);
+                indexed.add_triangle(a, d, c, mat);
+            }
+        }
+        mesh.build();
+        indexed.build();
+
+        double raw = double(points.size()) * 8 * sizeof(double) + double(triangles) * 3 * sizeof(int);
+        std::cout.setf(std::ios::fixed);
+        std::cout.precision(1);
+        std::cout << "  heightfield/" << name << ": " << raw / triangles << " bytes/triangle raw, "
+                  << double(mesh.memory_bytes()) / triangles << " as triangle_mesh, "
+                  << indexed.bytes_per_triangle() << " as indexed_mesh (BVH included)\n";
+        intersect("heightfield_triangle_mesh", name, mesh, rays, mesh.memory_bytes());
+        intersect("heightfield_indexed_mesh", name, indexed, rays, indexed.memory_bytes());
+    }
+
+    // Boxes of random size and heading in a BVH, like a room of furniture or a city block:
+    // six quads under rotate_y and translate (how scenes built them before) against one
+    // oriented_box each
+    void boxes(int count, double extent, const std::vector<ray>& rays) {
+        auto name = std::to_string(count);
+        if (!enabled("boxes_quads_instanced", name) && !enabled("boxes_oriented", name))
+            return;
+
+        auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+        double size = extent / std::cbrt(double(count));
+        hittable_list quads, oriented;
+        for (int i = 0; i < count; i++) {
+            auto center = vec3::random(-extent, extent);
+            auto half = vec3(random_double(0.1, 0.5), random_double(0.1, 0.5), random_double(0.1, 0.5)) * size;
+            double angle = random_double(0, 90);
+            shared_ptr<hittable> sides = box_from_quads(-half, half, mat);
+            quads.add(make_shared<translate>(make_shared<rotate_y>(sides, angle), center));
+            oriented.add(make_shared<oriented_box>(center, half, angle, mat));
+        }
+
+        intersect("boxes_quads_instanced", name, bvh_node(quads), rays);
+        intersect("boxes_oriented", name, bvh_node(oriented), rays);
+    }
+
+    // Diffuse bounce rays off the surfaces `rays` hit, traced in generation order and in
+    // ray_sorter order (the sort is part of the timed work), as the wavefront integrator
+    // sees them after the first bounce
+    void ray_order(const std::string& name, const hittable& world, const std::vector<ray>& rays) {
+        if (!enabled("ray_order_unsorted", name) && !enabled("ray_order_sorted", name))
+            return;
+
+        std::vector<ray> bounces;
+        hit_record rec;
+        for (const auto& r : rays)
+            if (world.hit(r, interval(0.001, infinity), rec))
+                bounces.emplace_back(rec.p, rec.normal + random_unit_vector(), r.time());
+
+        intersect("ray_order_unsorted", name, world, bounces);
+
+        if (!enabled("ray_order_sorted", name)) return;
+        ray_sorter sorter;
+        add(time_batches("ray_order_sorted", name, bounces.size(), min_seconds(), true, [&] {
+            double hits = 0;
+            for (int k : sorter.sort(bounces.size(), [&](size_t k) -> const ray& { return bounces[k]; }))
+                if (world.hit(bounces[k], interval(0.001, infinity), rec))
+                    hits += rec.t;
+            keep(hits);
+        }));
+    }
+
+    // Rays aimed exactly at the shared edges and center of a triangle fan like the Wicked star.
+    // Every ray should hit; a leaky triangle test lets some through between neighbours.
+    void fan_edges(int rays_per_edge) {
+        if (!enabled("watertight", "star_fan")) return;
+
+        const int points = 10;
+        point3 center(-2.8, 1.8, -0.5);
+        std::vector<point3> rim;
+        for (int i = 0; i < points; i++) {
+            double angle = i * pi / 5 - pi/2;
+            double radius = (i % 2 == 0) ? 1.1 : 0.45;
+            rim.push_back(center + radius * vec3(std::cos(angle), std::sin(angle), 0));
+        }
+
+        auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+        hittable_list single;
+        auto mesh = make_shared<triangle_mesh>();
+        for (int i = 0; i < points; i++) {
+            single.add(make_shared<triangle>(center, rim[i], rim[(i + 1) % points], mat));
+            mesh->add(center, rim[i], rim[(i + 1) % points], mat);
+        }
+        mesh->build();
+        bvh_node tree(single);
+
+        std::vector<ray> rays;
+        for (int i = 0; i < points; i++) {
+            for (int k = 0; k < rays_per_edge; k++) {
+                // Half on the spokes, half at the vertex all ten triangles share
+                auto target = (k % 2) ? center : center + random_double(0.01, 0.99) * (rim[i] - center);
+                auto origin = target + vec3(random_double(-4, 4), random_double(-4, 4), 6);
+                rays.emplace_back(origin, target - origin, 0.0);
+            }
+        }
+
+        auto leaks = [&](const hittable& object) {
+            hit_record rec;
+            int missed = 0;
+            for (const auto& r : rays)
+                missed += !object.hit(r, interval(0.001, infinity), rec);
+            return missed;
+        };
+
+        std::cout << "  watertight/star_fan: " << leaks(tree) << " of " << rays.size()
+                  << " edge rays leak through triangle, " << leaks(*mesh) << " through triangle_mesh\n";
+        intersect("watertight", "star_fan_triangle", tree, rays);
+        intersect("watertight", "star_fan_triangle_mesh", *mesh, rays);
+    }
+
+
+
+    // A fast_math.h approximation against libm on the same inputs (y is ignored by one
+    // argument functions): the worst-case error over all of them, checked against the
+    // function's documented bound, then the time of each
+    template <typename Exact, typename Approx>
+    void math(const std::string& name, const std::vector<double>& x, const std::vector<double>& y,
+              double max_error, const Exact& exact, const Approx& approx) {
+        if (!enabled("fast_math", name + "_libm") && !enabled("fast_math", name + "_fast")) return;
+
+        double worst = 0;
+        for (size_t i = 0; i < x.size(); i++)
+            worst = std::fmax(worst, std::fabs(approx(x[i], y[i]) - exact(x[i], y[i])));
+
+        // Results go to an array rather than a sum, so the approximations' loop can vectorize
+        std::vector<double> out(x.size());
+        add(time_batches("fast_math", name + "_libm", x.size(), min_seconds(), false, [&] {
+            for (size_t i = 0; i < x.size(); i++)
+                out[i] = exact(x[i], y[i]);
+            keep(out[x.size() / 2]);
+        }));
+        auto result = time_batches("fast_math", name + "_fast", x.size(), min_seconds(), false, [&] {
+            for (size_t i = 0; i < x.size(); i++)
+                out[i] = approx(x[i], y[i]);
+            keep(out[x.size() / 2]);
+        });
+        result.max_error = worst;
+        add(result);
+
+        if (!(worst <= max_error)) {
+            std::cout << "  FAILED: fast_math/" << name << " error " << worst
+                      << " exceeds its bound " << max_error << "\n";
+            failed_checks++;
+        }
+    }
+
+
+
+    // Full renders of the Wicked scene at fixed resolution and spp, with the recursive
+    // integrator or the wavefront one (with and without ray sorting)
+    void render_wicked(int width, int spp, integrator_kind integrator = integrator_kind::recursive,
+                       bool sort = true) {
+        auto name = "wicked_" + std::to_string(width) + "w_" + std::to_string(spp) + "spp";
+        if (integrator == integrator_kind::wavefront)
+            name += sort ? "_wavefront" : "_wavefront_unsorted";
+        if (!enabled("render", name)) return;
+
+        scene_arena arena;
+        hittable_list world;
+        camera cam;
+        wicked_scene(world, cam, arena);
+        cam.image_width = width;
+        cam.samples_per_pixel = spp;
+        cam.show_progress = false;
+        cam.integrator = integrator;
+        cam.wavefront_sort = sort;
+
+        bench_result result;
+        result.name = name;
+        result.group = "render";
+        result.counts_rays = true;
+
+        std::ostringstream image;
+        auto start = bench_clock::now();
+        cam.render(world, image);
+        result.seconds = seconds_since(start);
+        result.ops = cam.ray_count();
+        add(result);
+    }
+
+
+
+    void write_json(std::ostream& out) const {
+        out << "{\n  \"quick\": " << (options.quick ? "true" : "false")
+            << ",\n  \"threads\": " << std::thread::hardware_concurrency()
+            << ",\n  \"results\": [\n";
+
+        for (size_t i = 0; i < results.size(); i++) {
+            const auto& r = results[i];
+            out << "    {\"group\": \"" << r.group << "\", \"name\": \"" << r.name
+                << "\", \"ops\": " << r.ops
+                << ", \"seconds\": " << r.seconds
+                << ", \"ns_per_op\": " << r.ns_per_op();
+            if (r.counts_rays)
+                out << ", \"mrays_per_s\": " << r.mrays_per_s();
+            if (r.bytes)
+                out << ", \"bytes\": " << r.bytes;
+            if (r.max_error >= 0)
+                out << ", \"max_error\": " << r.max_error;
+            out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+    }
+
+
+
+private:
+    bench_options options;
+    std::vector<bench_result> results;
+    int failed_checks = 0;
+};
+
+
+
+
+
+
+int main(int argc, char* argv[]) {
+    bench_options options;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--quick")
+            options.quick = true;
+        else if (arg == "--filter" && i + 1 < argc)
+            options.filter = argv[++i];
+        else if (arg == "--json" && i + 1 < argc)
+            options.json_path = argv[++i];
+        else if (arg == "--compare" && i + 2 < argc) {
+            options.compare[0] = argv[++i];
+            options.compare[1] = argv[++i];
+        }
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--quick] [--filter <substring>] [--json <file>]\n"
+                      << "       " << argv[0] << " --compare <a.ppm> <b.ppm>\n";
+            return 1;
+        }
+    }
+
+    if (!options.compare[0].empty())
+        return compare_images(options.compare[0], options.compare[1]) ? 0 : 1;
+
+    bench_runner bench(options);
+    auto grey = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+
+
+
+    // Microbenchmarks: single primitives, about half of the rays hit
+    std::cout << "Primitives\n";
+    auto rays = random_rays(4096, point3(0,0,0), 5, 1.5);
+
+    aabb bounds(point3(-1,-1,-1), point3(1,1,1));
+    if (bench.enabled("aabb", "hit")) {
+        bench.add(time_batches("aabb", "hit", rays.size(), bench.min_seconds(), true, [&] {
+            double hits = 0;
+            for (const auto& r : rays)
+                hits += bounds.hit(r, interval(0.001, infinity));
+            keep(hits);
+        }));
+    }
+
+    bench.intersect("sphere", "static", sphere(point3(0,0,0), 1, grey), rays);
+    bench.intersect("sphere", "moving", sphere(point3(0,0,0), point3(0.2,0,0), 1, grey), rays);
+    bench.intersect("quad", "hit", quad(point3(-1,-1,0), vec3(2,0,0), vec3(0,2,0), grey), rays);
+    bench.intersect("triangle", "flat",
+                    triangle(point3(-1,-1,0), point3(1,-1,0), point3(0,1,0), grey), rays);
+    bench.intersect("triangle", "smooth",
+                    triangle(point3(-1,-1,0), point3(1,-1,0), point3(0,1,0),
+                             vec3(0,0,1), vec3(0.1,0,1), vec3(0,0.1,1), grey), rays);
+    bench.intersect("box", "six_quads", *box_from_quads(point3(-1,-1,-1), point3(1,1,1), grey), rays);
+    bench.intersect("box", "slab", axis_box(point3(-1,-1,-1), point3(1,1,1), grey), rays);
+    bench.intersect("box", "rotated_six_quads",
+                    rotate_y(box_from_quads(point3(-1,-1,-1), point3(1,1,1), grey), 30), rays);
+    bench.intersect("box", "oriented", oriented_box(point3(0,0,0), vec3(1,1,1), 30, grey), rays);
+    bench.intersect("constant_medium", "sphere_boundary",
+                    constant_medium(make_shared<sphere>(point3(0,0,0), 1, grey), 0.5, color(1,1,1)), rays);
+
+    // Same primitives through the any-hit path
+    bench.occluded("occluded", "sphere", sphere(point3(0,0,0), 1, grey), rays);
+    bench.occluded("occluded", "quad", quad(point3(-1,-1,0), vec3(2,0,0), vec3(0,2,0), grey), rays);
+    bench.occluded("occluded", "triangle",
+                   triangle(point3(-1,-1,0), point3(1,-1,0), point3(0,1,0), grey), rays);
+    bench.occluded("occluded", "box_six_quads", *box_from_quads(point3(-1,-1,-1), point3(1,1,1), grey), rays);
+    bench.occluded("occluded", "box", axis_box(point3(-1,-1,-1), point3(1,1,1), grey), rays);
+    bench.occluded("occluded", "constant_medium",
+                   constant_medium(make_shared<sphere>(point3(0,0,0), 1, grey), 0.5, color(1,1,1)), rays);
+
+
+
+    // Textures and noise
+    std::cout << "Textures\n";
+    auto points = random_points(4096, 4);
+
+    bench.lookup("texture", "solid_color", solid_color(color(0.2, 0.4, 0.6)), points);
+    bench.lookup_flat("solid_color", solid_color(color(0.2, 0.4, 0.6)), points);
+    bench.lookup("texture", "checker", checker_texture(0.8, color(0,0,0), color(1,1,1)), points);
+    bench.lookup_flat("checker", checker_texture(0.8, color(0,0,0), color(1,1,1)), points);
+    bench.lookup("texture", "image", image_texture("textures/pink_gradient.jpg"), points);
+    bench.lookup("texture", "noise", noise_texture(3.0), points);
+
+    // Decoding the Wicked scene's images one after another, and through texture_loader.
+    // Both keep the images until the batch ends, as a scene does.
+    const char* images[] = {"textures/pink_gradient.jpg", "textures/sparkle.png"};
+    if (bench.enabled("texture", "decode_sequential")) {
+        bench.add(time_batches("texture", "decode_sequential", 2, bench.min_seconds(), false, [&] {
+            image_texture decoded[2];
+            for (int k = 0; k < 2; k++)
+                decoded[k].decode(images[k]);
+        }));
+    }
+    if (bench.enabled("texture", "decode_loader")) {
+        bench.add(time_batches("texture", "decode_loader", 2, bench.min_seconds(), false, [&] {
+            scene_arena arena;
+            texture_loader loader(arena);
+            for (const char* filename : images)
+                loader.load(filename);
+            loader.wait(false);
+        }));
+    }
+
+    perlin noise;
+    if (bench.enabled("perlin", "noise")) {
+        bench.add(time_batches("perlin", "noise", points.size(), bench.min_seconds(), false, [&] {
+            double sum = 0;
+            for (const auto& p : points) sum += noise.noise(p);
+            keep(sum);
+        }));
+    }
+    if (bench.enabled("perlin", "turb7")) {
+        bench.add(time_batches("perlin", "turb7", points.size(), bench.min_seconds(), false, [&] {
+            double sum = 0;
+            for (const auto& p : points) sum += noise.turb(p, 7);
+            keep(sum);
+        }));
+    }
+
+
+
+    // Fast-math approximations against libm over dense sweeps of their domains
+    std::cout << "Fast math\n";
+    {
+        const int n = bench.quick() ? 1 << 16 : 1 << 20;
+        std::vector<double> unit(n + 1), angle_x(n + 1), angle_y(n + 1), wide(n + 1), tiny(n + 1), zero(n + 1, 0.0);
+        for (int i = 0; i <= n; i++) {
+            double f = double(i) / n;
+            unit[i] = -1 + 2 * f;
+            double radius = 0.5 + i % 5;  // Magnitude must not matter to atan2
+            angle_x[i] = radius * std::cos(2 * pi * f - pi);
+            angle_y[i] = radius * std::sin(2 * pi * f - pi);
+            wide[i] = -1e4 + 2e4 * f;
+            tiny[i] = std::exp2(-64 * f);  // (0, 1] down to random_double()'s smallest steps
+        }
+        std::vector<double> fraction(unit.size());
+        for (size_t i = 0; i < unit.size(); i++)
+            fraction[i] = 0.5 + 0.5 * unit[i];
+
+        bench.math("acos", unit, zero, fast_acos_max_error,
+                   [](double x, double) { return std::acos(x); },
+                   [](double x, double) { return fast_acos(x); });
+        bench.math("atan2", angle_y, angle_x, fast_atan2_max_error,
+                   [](double y, double x) { return std::atan2(y, x); },
+                   [](double y, double x) { return fast_atan2(y, x); });
+        bench.math("sin", wide, zero, fast_sin_max_error,
+                   [](double x, double) { return std::sin(x); },
+                   [](double x, double) { return fast_sin(x); });
+        bench.math("log", tiny, zero, fast_log_max_error,
+                   [](double x, double) { return std::log(x); },
+                   [](double x, double) { return fast_log(x); });
+        bench.math("pow5", fraction, zero, pow5_max_error,
+                   [](double x, double) { return std::pow(x, 5); },
+                   [](double x, double) { return pow5(x); });
+    }
+
+
+
+    // BVH build and traversal on synthetic scenes
+    std::cout << "BVH\n";
+    int scale = bench.quick() ? 10 : 1;
+    auto scene_rays = random_rays(bench.quick() ? 16384 : 65536, point3(0,0,0), 120, 50);
+
+    int spheres = 100000 / scale, triangles = 500000 / scale, trees = 10000 / scale;
+
+    bench.bvh("random_spheres_" + std::to_string(spheres), random_spheres_scene(spheres), scene_rays);
+    bench.bvh("triangle_soup_" + std::to_string(triangles), triangle_soup_scene(triangles), scene_rays);
+    bench.bvh("forest_" + std::to_string(trees) + "_instances", forest_scene(trees), scene_rays);
+
+    // Particles in one SoA primitive: the same spheres as random_spheres, then a million
+    bench.particles(spheres, 50, scene_rays);
+    if (!bench.quick())
+        bench.particles(1000000, 50, scene_rays);
+
+    // Triangles in SoA leaves: the same soup as triangle_soup, and the star fan's shared edges
+    bench.meshes(triangles, 50, scene_rays);
+    bench.heightfield(bench.quick() ? 301 : 1001, 50, scene_rays);
+    bench.boxes(1000, 50, scene_rays);
+    bench.boxes(spheres, 50, scene_rays);
+
+    // Secondary ray coherence: bounce rays off the triangle soup, unsorted and sorted
+    if (bench.enabled("ray_order", "triangle_soup_" + std::to_string(triangles)))
+        bench.ray_order("triangle_soup_" + std::to_string(triangles),
+                        bvh_node(triangle_soup_scene(triangles)), scene_rays);
+    bench.fan_edges(bench.quick() ? 1000 : 10000);
+
+
+
+    // Scene file parsing (no BVH build), one sphere or triangle per line
+    std::cout << "Scene parsing\n";
+    int lines = bench.quick() ? 100000 : 1000000;
+    if (bench.enabled("scene_parse", std::to_string(lines) + "_primitives")) {
+        std::string text = "material grey lambertian 0.5 0.5 0.5\n";
+        char line[160];
+        for (int i = 0; i < lines; i++) {
+            auto p = vec3::random(-50, 50);
+            if (i % 2)
+                std::snprintf(line, sizeof(line), "sphere grey %.6f %.6f %.6f %.4f\n",
+                              p.x(), p.y(), p.z(), random_double(0.1, 0.5));
+            else
+                std::snprintf(line, sizeof(line), "triangle grey %.6f %.6f %.6f %.6f %.6f %.6f %.6f %.6f %.6f\n",
+                              p.x(), p.y(), p.z(), p.x() + 0.3, p.y(), p.z(), p.x(), p.y() + 0.3, p.z());
+            text += line;
+        }
+
+        bench_result result;
+        result.group = "scene_parse";
+        result.name = std::to_string(lines) + "_primitives";
+
+        scene_arena arena;
+        hittable_list objects;
+        camera cam;
+        scene_parser parser(objects, cam, arena);
+        auto start = bench_clock::now();
+        parser.parse(text.data(), text.data() + text.size(), "generated");
+        result.seconds = seconds_since(start);
+        result.ops = parser.primitive_count();
+        bench.add(result);
+    }
+
+
+
+    // End-to-end renders of the Wicked scene
+    std::cout << "Render\n";
+    int render_width = bench.quick() ? 200 : 400, render_spp = bench.quick() ? 4 : 16;
+    bench.render_wicked(render_width, render_spp);
+    bench.render_wicked(render_width, render_spp, integrator_kind::wavefront, false);
+    bench.render_wicked(render_width, render_spp, integrator_kind::wavefront, true);
+
+
+
+    if (!options.json_path.empty()) {
+        std::ofstream json(options.json_path);
+        if (!json) {
+            std::cerr << "ERROR: Could not write '" << options.json_path << "'\n";
+            return 1;
+        }
+        bench.write_json(json);
+        std::cout << "Results written to " << options.json_path << "\n";
+    }
+
+    return bench.failures() > 0 ? 1 : 0;
+}
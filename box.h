@@ -0,0 +1,201 @@
+#ifndef BOX_H
+#define BOX_H
+
+#include "arena.h"
+#include "hittable.h"
+#include "material.h"
+#include <cmath>
+
+
+// Slab test against the box [lo, hi] in the ray's own space. Returns the nearest boundary
+// crossing inside ray_t: the entry, or the exit for rays starting inside (glass boxes,
+// medium boundaries). face is 2 * axis, plus 1 on the axis' max side.
+inline bool box_slab_hit(const point3& origin, const vec3& direction, const point3& lo, const point3& hi,
+                         const interval& ray_t, double& t, int& face) {
+    WICKED_STAT(primitives_tested);
+    double t_near = -infinity, t_far = infinity;
+    int near_face = -1, far_face = -1;
+
+    for (int axis = 0; axis < 3; axis++) {
+        double inv = 1.0 / direction[axis];
+        double t0 = (lo[axis] - origin[axis]) * inv;
+        double t1 = (hi[axis] - origin[axis]) * inv;
+        int face0 = 2 * axis, face1 = 2 * axis + 1;
+        if (inv < 0) {
+            std::swap(t0, t1);
+            std::swap(face0, face1);
+        }
+        if (t0 > t_near) { t_near = t0; near_face = face0; }
+        if (t1 < t_far) { t_far = t1; far_face = face1; }
+    }
+
+    if (t_near > t_far)
+        return false;
+    if (near_face >= 0 && ray_t.contains(t_near)) {
+        t = t_near;
+        face = near_face;
+        return true;
+    }
+    if (far_face >= 0 && ray_t.contains(t_far)) {
+        t = t_far;
+        face = far_face;
+        return true;
+    }
+    return false;
+}
+
+// UVs of a point on a box face, laid out as the six quads of the old box() helper had them
+inline void box_face_uv(const point3& p, const point3& lo, const point3& hi, int face, double& u, double& v) {
+    auto fraction = [&](int axis) {
+        double size = hi[axis] - lo[axis];
+        return size > 0 ? (p[axis] - lo[axis]) / size : 0.0;
+    };
+    switch (face) {
+        case 0: u = fraction(2);       v = fraction(1);       break;  // -x
+        case 1: u = 1 - fraction(2);   v = fraction(1);       break;  // +x
+        case 2: u = fraction(0);       v = fraction(2);       break;  // -y
+        case 3: u = fraction(0);       v = 1 - fraction(2);   break;  // +y
+        case 4: u = 1 - fraction(0);   v = fraction(1);       break;  // -z
+        default: u = fraction(0);      v = fraction(1);       break;  // +z
+    }
+}
+
+
+
+
+
+// Axis-aligned box as one primitive: a single slab test instead of six quads in a list.
+// The face index is recorded with the hit, the normal and UVs are filled from it.
+class axis_box : public hittable {
+public:
+    axis_box(const point3& a, const point3& b, shared_ptr<material> mat)
+        : lo(std::fmin(a.x(),b.x()), std::fmin(a.y(),b.y()), std::fmin(a.z(),b.z())),
+          hi(std::fmax(a.x(),b.x()), std::fmax(a.y(),b.y()), std::fmax(a.z(),b.z())),
+          mat(mat), needs_uv(mat && mat->needs_uv()) {
+        bbox = aabb(lo, hi);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+    scene_features features() const override { return material_features(mat); }
+
+
+
+    bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
+        double t;
+        int face;
+        if (!box_slab_hit(r.origin(), r.direction(), lo, hi, ray_t, t, face))
+            return false;
+        rec.record(t, this, double(face));
+        return true;
+    }
+
+    void finalize_hit(const ray& r, hit_record& rec) const override {
+        int face = int(rec.b1);
+        rec.p = r.at(rec.t);
+        vec3 outward_normal(0,0,0);
+        outward_normal[face / 2] = (face & 1) ? 1.0 : -1.0;
+        rec.set_face_normal(r, outward_normal);
+        if (needs_uv)
+            box_face_uv(rec.p, lo, hi, face, rec.u, rec.v);
+        rec.mat = mat.get();
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override {
+        double t;
+        int face;
+        return box_slab_hit(r.origin(), r.direction(), lo, hi, ray_t, t, face);
+    }
+
+
+
+private:
+    point3 lo, hi;
+    shared_ptr<material> mat;
+    bool needs_uv;
+    aabb bbox;
+};
+
+
+
+
+
+// Box with its own orientation: center, half extents along three orthonormal axes. The
+// ray is rotated into the box frame inside the primitive, instead of passing through
+// rotate_y and translate wrappers and a list of quads.
+class oriented_box : public hittable {
+public:
+    // Box rotated by angle degrees around +y, like rotate_y
+    oriented_box(const point3& center, const vec3& half_size, double angle, shared_ptr<material> mat)
+        : oriented_box(center, half_size,
+                       vec3(std::cos(degrees_to_radians(angle)), 0, -std::sin(degrees_to_radians(angle))),
+                       vec3(0, 1, 0),
+                       vec3(std::sin(degrees_to_radians(angle)), 0, std::cos(degrees_to_radians(angle))),
+                       mat) {}
+
+    // axis_x, axis_y, axis_z: the box's local axes in world space, orthonormal
+    oriented_box(const point3& center, const vec3& half_size,
+                 const vec3& axis_x, const vec3& axis_y, const vec3& axis_z, shared_ptr<material> mat)
+        : center(center), half(half_size), axes{unit_vector(axis_x), unit_vector(axis_y), unit_vector(axis_z)},
+          mat(mat), needs_uv(mat && mat->needs_uv()) {
+        vec3 extent(0,0,0);
+        for (int i = 0; i < 3; i++)
+            for (int a = 0; a < 3; a++)
+                extent[a] += std::fabs(axes[i][a]) * half[i];
+        bbox = aabb(center - extent, center + extent);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+    scene_features features() const override { return material_features(mat); }
+
+
+
+    bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
+        double t;
+        int face;
+        if (!box_slab_hit(to_local(r.origin() - center), to_local(r.direction()), -half, half, ray_t, t, face))
+            return false;
+        rec.record(t, this, double(face));
+        return true;
+    }
+
+    void finalize_hit(const ray& r, hit_record& rec) const override {
+        int face = int(rec.b1);
+        rec.p = r.at(rec.t);
+        vec3 outward_normal = (face & 1) ? axes[face / 2] : -axes[face / 2];
+        rec.set_face_normal(r, outward_normal);
+        if (needs_uv)
+            box_face_uv(to_local(rec.p - center), -half, half, face, rec.u, rec.v);
+        rec.mat = mat.get();
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override {
+        double t;
+        int face;
+        return box_slab_hit(to_local(r.origin() - center), to_local(r.direction()), -half, half, ray_t, t, face);
+    }
+
+
+
+private:
+    point3 center;
+    vec3 half;
+    vec3 axes[3];
+    shared_ptr<material> mat;
+    bool needs_uv;
+    aabb bbox;
+
+    vec3 to_local(const vec3& v) const {
+        return vec3(dot(v, axes[0]), dot(v, axes[1]), dot(v, axes[2]));
+    }
+};
+
+
+
+
+
+// Box between two corners, as one axis_box primitive allocated from arena
+inline shared_ptr<hittable> box(scene_arena& arena, const point3& a, const point3& b, shared_ptr<material> mat) {
+    return arena.make<axis_box>(a, b, mat);
+}
+
+#endif
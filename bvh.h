@@ -4,95 +4,170 @@
 #include "wicked.h"
 #include "hittable.h"
 #include "hittable_list.h"
-#include <algorithm>
+#include "fast_math.h"
+#include "bvh_build.h"
+#include "lbvh_build.h"
+#include "bvh_wide.h"
+#include "arena.h"
+#include <iostream>
+#include <vector>
 
 // REQUIREMENT: Spatial subdivision acceleration structure (BVH)
+// Nodes are stored flat (see bvh_build.h) and built in parallel with binned SAH, or with
+// the faster LBVH builder (lbvh_build.h) when options.method says so, then collapsed into
+// quantized 4-wide nodes (bvh_wide.h) unless options.compress is off. Traversal walks
+// them with a small stack, nearest child first. Unbounded primitives (infinite planes)
+// would stretch every box above them, so they stay out of the tree in a short list
+// every ray tests after traversal.
 class bvh_node : public hittable {
 public:
-    bvh_node(hittable_list list) : bvh_node(list.objects, 0, list.objects.size()) {}
-
-
-    // Recursively building BVH from objects array
-    bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end) {
-        
-        // Compute bounding box
-        bbox = aabb::empty;
-        for (size_t object_index = start; object_index < end; object_index++)
-            bbox = aabb(bbox, objects[object_index]->bounding_box());
-
-        int axis = bbox.longest_axis();
-
-        auto comparator = (axis == 0) ? box_x_compare
-                        : (axis == 1) ? box_y_compare
-                                      : box_z_compare;
-
-        size_t object_span = end - start;
-
-
-        // Leaf node
-        if (object_span == 1) {
-            left = right = objects[start];
-        } 
-        // Two objects
-        else if (object_span == 2) {
-            left = objects[start];
-            right = objects[start+1];
-        } 
-        // Multiple objects
-        else {
-            std::sort(objects.begin() + start, objects.begin() + end, comparator);
-
-            auto mid = start + object_span/2;
-            left = make_shared<bvh_node>(objects, start, mid);
-            right = make_shared<bvh_node>(objects, mid, end);
+    bvh_node(hittable_list list, const bvh_build_options& options = bvh_build_options())
+        : bvh_node(list.objects, 0, list.objects.size(), options) {}
+
+
+    // Builds over objects[start, end)
+    bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end,
+             const bvh_build_options& options = bvh_build_options()) {
+        // Bounds are gathered once so the builder never calls bounding_box().
+        // Padded, since a leaf's box is tested and quads have zero-thickness boxes.
+        std::vector<aabb> bounds;
+        std::vector<size_t> bounded_objects;
+        bounds.reserve(end - start);
+        bounded_objects.reserve(end - start);
+        for (size_t i = start; i < end; i++) {
+            aabb box = objects[i]->bounding_box();
+            if (box.bounded()) {
+                bounds.push_back(box.pad());
+                bounded_objects.push_back(i);
+            } else {
+                unbounded.push_back(objects[i]);
+            }
         }
+        warn_dominant_primitive(bounds);
+
+        std::vector<bvh_flat_node> nodes;
+        std::vector<int> order;
+        if (options.method == bvh_method::lbvh)
+            lbvh_builder(bounds, options).build(nodes, order);
+        else
+            bvh_builder(bounds, options).build(nodes, order);
+        tree.assign(std::move(nodes), options);
+
+        primitives.reserve(order.size());
+        for (int index : order)
+            primitives.push_back(objects[bounded_objects[index]]);
+
+        bbox = tree.root_bounds();
+        for (const auto& object : unbounded)
+            bbox = aabb(bbox, object->bounding_box());
+
+        scene_memory().add(memory_category::bvh,
+                           (primitives.capacity() + unbounded.capacity()) * sizeof(shared_ptr<hittable>));
     }
 
 
 
 
     // Test ray intersection
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        if (!bbox.hit(r, ray_t))
+    bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
+        bool hit_anything = false;
+        traverse(r, ray_t, [&](const hittable& object) {
+            if (object.intersect(r, ray_t, rec)) {
+                hit_anything = true;
+                ray_t.max = rec.t;
+            }
             return false;
+        });
+        // After the tree, so a near hit there already limits ray_t
+        for (const auto& object : unbounded) {
+            if (object->intersect(r, ray_t, rec)) {
+                hit_anything = true;
+                ray_t.max = rec.t;
+            }
+        }
+        return hit_anything;
+    }
 
-        bool hit_left = left->hit(r, ray_t, rec);
-        bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+    // Any-hit: returns at the first primitive that blocks the ray
+    bool occluded(const ray& r, interval ray_t) const override {
+        for (const auto& object : unbounded)
+            if (object->occluded(r, ray_t))
+                return true;
+        return traverse(r, ray_t, [&](const hittable& object) {
+            return object.occluded(r, ray_t);
+        });
+    }
 
-        return hit_left || hit_right;
+    double transmittance(const ray& r, interval ray_t) const override {
+        double result = 1.0;
+        for (const auto& object : unbounded)
+            result *= object->transmittance(r, ray_t);
+        if (result <= 0)
+            return 0.0;
+        traverse(r, ray_t, [&](const hittable& object) {
+            result *= object.transmittance(r, ray_t);
+            return result <= 0;
+        });
+        return result;
     }
 
-    aabb bounding_box() const override { return bbox; }
+    scene_features features() const override {
+        scene_features combined;
+        for (const auto& object : primitives)
+            combined |= object->features();
+        for (const auto& object : unbounded)
+            combined |= object->features();
+        return combined;
+    }
 
+    aabb bounding_box() const override { return bbox; }
 
+    size_t node_count() const { return tree.node_count(); }
+    size_t node_bytes() const { return tree.memory_bytes(); }
 
+    // Primitives kept outside the tree because their boxes are unbounded
+    size_t unbounded_count() const { return unbounded.size(); }
 
 
 
-// Comparing two objects along specified axis
 private:
-    shared_ptr<hittable> left;
-    shared_ptr<hittable> right;
+    bvh_tree tree;
+    std::vector<shared_ptr<hittable>> primitives;  // In leaf order
+    std::vector<shared_ptr<hittable>> unbounded;   // Tested on every ray, outside the tree
     aabb bbox;
 
-    static bool box_compare(
-        const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index
-    ) {
-        auto a_axis_interval = a->bounding_box().axis_interval(axis_index);
-        auto b_axis_interval = b->bounding_box().axis_interval(axis_index);
-        return a_axis_interval.min < b_axis_interval.min;
-    }
 
-    static bool box_x_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-        return box_compare(a, b, 0);
-    }
 
-    static bool box_y_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-        return box_compare(a, b, 1);
+    // A primitive whose box has most of the surface area of all boxes together is entered
+    // by nearly every ray and inflates every node above it (a ground made of a huge
+    // sphere, say). Worth a warning: an infinite plane or smaller pieces trace faster.
+    static void warn_dominant_primitive(const std::vector<aabb>& bounds) {
+        if (bounds.size() < 4)
+            return;
+        double total = 0, largest = 0;
+        size_t largest_index = 0;
+        for (size_t i = 0; i < bounds.size(); i++) {
+            double area = bounds[i].surface_area();
+            total += area;
+            if (area > largest) {
+                largest = area;
+                largest_index = i;
+            }
+        }
+        if (largest > 0.5 * total) {
+            std::cerr << "WARNING: BVH primitive " << largest_index << " of " << bounds.size()
+                      << " has " << int(100 * largest / total) << "% of the surface area of all"
+                      << " primitive boxes; model large grounds and walls as a plane\n";
+        }
     }
 
-    static bool box_z_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-        return box_compare(a, b, 2);
+
+
+    // Visits the primitives of every leaf the ray reaches within ray_t, nearer child
+    // first, until visit(primitive) returns true. visit may shrink ray_t as it finds hits.
+    template <typename Visit>
+    bool traverse(const ray& r, interval& ray_t, const Visit& visit) const {
+        return tree.traverse(r, ray_t, [&](int i) { return visit(*primitives[i]); });
     }
 };
 
@@ -118,38 +193,47 @@ public:
 
 
      // Probabilistically scatter ray inside volume
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        hit_record rec1, rec2;
-
-        if (!boundary->hit(r, interval::universe, rec1))
+    bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
+        double t_enter, t_exit;
+        if (!span_inside(r, ray_t, t_enter, t_exit))
             return false;
 
-        if (!boundary->hit(r, interval(rec1.t+0.0001, infinity), rec2))
-            return false;
-
-        if (rec1.t < ray_t.min) rec1.t = ray_t.min;
-        if (rec2.t > ray_t.max) rec2.t = ray_t.max;
-
-        if (rec1.t >= rec2.t)
-            return false;
-
-        if (rec1.t < 0)
-            rec1.t = 0;
-
         auto ray_length = r.direction().length();
-        auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
-        auto hit_distance = neg_inv_density * std::log(random_double());
+        auto distance_inside_boundary = (t_exit - t_enter) * ray_length;
+        auto hit_distance = neg_inv_density * math_log(random_double());
 
         if (hit_distance > distance_inside_boundary)
             return false;
 
-        rec.t = rec1.t + hit_distance / ray_length;
+        rec.record(t_enter + hit_distance / ray_length, this);
+        return true;
+    }
+
+    void finalize_hit(const ray& r, hit_record& rec) const override {
         rec.p = r.at(rec.t);
         rec.normal = vec3(1,0,0);
         rec.front_face = true;
-        rec.mat = phase_function;
+        rec.mat = phase_function.get();
+    }
 
-        return true;
+    // Beer-Lambert: exp(-density * distance travelled inside the boundary)
+    double transmittance(const ray& r, interval ray_t) const override {
+        double t_enter, t_exit;
+        if (!span_inside(r, ray_t, t_enter, t_exit))
+            return 1.0;
+        return std::exp((t_exit - t_enter) * r.direction().length() / neg_inv_density);
+    }
+
+    // Same probability of stopping the ray as hit()
+    bool occluded(const ray& r, interval ray_t) const override {
+        return random_double() >= transmittance(r, ray_t);
+    }
+
+    // The boundary is never shaded, only its motion carries over
+    scene_features features() const override {
+        scene_features features = material_features(phase_function);
+        features.motion_blur = boundary->features().motion_blur;
+        return features;
     }
 
     aabb bounding_box() const override { return boundary->bounding_box(); }
@@ -160,6 +244,31 @@ private:
     shared_ptr<hittable> boundary;
     double neg_inv_density;
     shared_ptr<material> phase_function;
+
+    // Part of ray_t inside the boundary (assumed convex)
+    bool span_inside(const ray& r, const interval& ray_t, double& t_enter, double& t_exit) const {
+        WICKED_STAT(primitives_tested);
+        hit_record rec1, rec2;  // Only t is needed, so the hits are never finalized
+
+        if (!boundary->intersect(r, interval::universe, rec1))
+            return false;
+
+        if (!boundary->intersect(r, interval(rec1.t+0.0001, infinity), rec2))
+            return false;
+
+        if (rec1.t < ray_t.min) rec1.t = ray_t.min;
+        if (rec2.t > ray_t.max) rec2.t = ray_t.max;
+
+        if (rec1.t >= rec2.t)
+            return false;
+
+        if (rec1.t < 0)
+            rec1.t = 0;
+
+        t_enter = rec1.t;
+        t_exit = rec2.t;
+        return true;
+    }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,440 @@
+#ifndef BVH_BUILD_H
+#define BVH_BUILD_H
+
+#include "wicked.h"
+#include "aabb.h"
+#include "parallel.h"
+#include "stats.h"
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+
+// Both builders fall back to median splits below bvh_split_depth. Halving a range of at
+// most 2^31 primitives takes at most 31 more levels, so no flat tree is deeper than
+// bvh_max_depth, which bounds the traversal stacks.
+constexpr int bvh_split_depth = 48;
+constexpr int bvh_max_depth = bvh_split_depth + 32;
+
+// Flat BVH node shared by bvh_node and the primitives with their own internal BVH.
+// Children are referenced by index, leaves by a range of the builder's primitive order.
+struct bvh_flat_node {
+    aabb bbox;
+    int start = 0;  // leaf: first entry in the primitive order, interior: left child
+    int right = 0;  // interior: right child
+    int count = 0;  // leaf: number of primitives, interior: 0
+    int axis = 0;   // split axis, used to visit the nearer child first
+
+    bool is_leaf() const { return count > 0; }
+};
+
+// Visits the primitive slots of every leaf the ray reaches within ray_t, nearer child
+// first, until visit(slot) returns true. visit may shrink ray_t as it finds hits.
+template <typename Visit>
+bool traverse_flat_bvh(const std::vector<bvh_flat_node>& nodes, const ray& r, interval& ray_t,
+                       const Visit& visit) {
+    if (nodes.empty())
+        return false;
+
+    int stack[bvh_max_depth + 1];  // One waiting sibling per level, plus the root
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0) {
+        const auto& node = nodes[stack[--stack_size]];
+        WICKED_STAT(nodes_visited);
+
+        if (!node.bbox.hit(r, ray_t))
+            continue;
+
+        if (node.is_leaf()) {
+            for (int i = node.start; i < node.start + node.count; i++)
+                if (visit(i))
+                    return true;
+            continue;
+        }
+
+        // Push the farther child first so the nearer one is visited next
+        if (r.direction()[node.axis] < 0) {
+            stack[stack_size++] = node.start;
+            stack[stack_size++] = node.right;
+        } else {
+            stack[stack_size++] = node.right;
+            stack[stack_size++] = node.start;
+        }
+    }
+
+    return false;
+}
+
+
+// High-quality binned SAH (bvh_builder) or fast Morton-code LBVH (lbvh_builder)
+enum class bvh_method { sah, lbvh };
+
+struct bvh_build_options {
+    bvh_method method = bvh_method::sah;
+    int max_leaf_size = 4;   // Leaves never hold more primitives than this
+    bool parallel = true;    // Use the task pool for the top levels and subtrees
+    int treelet_size = 0;    // LBVH only: treelet restructuring with up to 7 leaves, 0 = off
+    int leaf_group = 1;      // Primitives a leaf tests at once (SoA leaves), SAH charges per group
+    bool compress = true;    // Collapse the tree into quantized 4-wide nodes (bvh_wide.h)
+
+    // SAH test cost of a leaf holding count primitives
+    double leaf_cost(int count) const { return (count + leaf_group - 1) / leaf_group; }
+};
+
+// Builder selection by name: "sah", "lbvh" or "lbvh-treelet" (LBVH plus 7-leaf treelets)
+inline bool parse_bvh_method(const std::string& name, bvh_build_options& options) {
+    if (name == "sah") {
+        options.method = bvh_method::sah;
+        options.treelet_size = 0;
+    } else if (name == "lbvh") {
+        options.method = bvh_method::lbvh;
+        options.treelet_size = 0;
+    } else if (name == "lbvh-treelet") {
+        options.method = bvh_method::lbvh;
+        options.treelet_size = 7;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+
+
+
+
+// Binned SAH builder over precomputed primitive bounds.
+// Bounds and centroids live in flat arrays, so no virtual calls happen during the build.
+// Large ranges bin and partition in parallel chunks; below that, subtrees are spawned as
+// tasks on the work-stealing pool and built sequentially once they get small.
+class bvh_builder {
+public:
+    bvh_builder(const std::vector<aabb>& bounds, const bvh_build_options& options = bvh_build_options(),
+                task_pool& pool = task_pool::instance())
+        : bounds(bounds), options(options), pool(pool) {}
+
+
+    // Fills nodes (root at index 0) and order (primitive index for each leaf slot)
+    void build(std::vector<bvh_flat_node>& nodes, std::vector<int>& order) {
+        size_t n = bounds.size();
+        nodes.clear();
+        order.resize(n);
+        if (n == 0) return;
+
+        centroids.resize(n);
+        for_range(0, n, 16384, [&](size_t b, size_t e) {
+            for (size_t i = b; i < e; i++) {
+                order[i] = int(i);
+                centroids[i] = centroid(bounds[i]);
+            }
+        });
+
+        build_nodes.resize(2 * n - 1);
+        node_count = 1;
+        this->order = order.data();
+
+        task_pool::task_group group(pool);
+        build_range(group, 0, 0, int(n), 0);
+        group.wait();
+
+        nodes.assign(build_nodes.begin(), build_nodes.begin() + node_count.load());
+        build_nodes.clear();
+        build_nodes.shrink_to_fit();
+    }
+
+    static point3 centroid(const aabb& box) {
+        return point3(0.5 * (box.x.min + box.x.max),
+                      0.5 * (box.y.min + box.y.max),
+                      0.5 * (box.z.min + box.z.max));
+    }
+
+
+
+private:
+    static constexpr int bin_count = 16;
+    static constexpr int parallel_range = 65536;  // Bin and partition in parallel above this
+    static constexpr int task_range = 2048;       // Spawn subtrees as tasks above this
+    static constexpr int max_depth = bvh_split_depth;  // Fall back to median splits below this
+
+    struct bin {
+        aabb bbox = aabb::empty;
+        int count = 0;
+    };
+
+    struct range_info {
+        aabb bbox = aabb::empty;
+        aabb centroid_bbox = aabb::empty;
+        bin bins[3][bin_count];
+    };
+
+    const std::vector<aabb>& bounds;
+    bvh_build_options options;
+    task_pool& pool;
+    std::vector<point3> centroids;
+    std::vector<bvh_flat_node> build_nodes;
+    std::atomic<int> node_count{0};
+    int* order = nullptr;
+
+
+
+    template <typename Body>
+    void for_range(size_t begin, size_t end, size_t grain, const Body& body) {
+        if (options.parallel)
+            parallel_for(pool, begin, end, grain, body);
+        else
+            body(begin, end);
+    }
+
+
+
+    void build_range(task_pool::task_group& group, int node_index, int begin, int end, int depth) {
+        auto& node = build_nodes[node_index];
+        int count = end - begin;
+
+        range_info info = bounds_of(begin, end);
+        node.bbox = info.bbox;
+
+        if (count == 1) {
+            make_leaf(node, begin, count);
+            return;
+        }
+
+        int axis = info.centroid_bbox.longest_axis();
+        int mid = begin;
+
+        bool degenerate = info.centroid_bbox.axis_interval(axis).size() <= 0;
+        if (degenerate) {
+            if (count <= options.max_leaf_size) {
+                make_leaf(node, begin, count);
+                return;
+            }
+            mid = begin + count / 2;
+        }
+        else if (depth >= max_depth) {
+            mid = median_split(begin, end, axis);
+        }
+        else {
+            bin_range(info, begin, end);
+
+            int best_axis = -1, best_split = 0;
+            double best_cost = infinity;
+            for (int a = 0; a < 3; a++) {
+                double cost;
+                int split = best_bin_split(info.bins[a], cost, options);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = a;
+                    best_split = split;
+                }
+            }
+
+            // SAH cost relative to a leaf (traversal step = 1, primitive test = 1)
+            double leaf_cost = options.leaf_cost(count);
+            double split_cost = 1.0 + best_cost / std::max(info.bbox.surface_area(), 1e-300);
+            if (count <= options.max_leaf_size && (best_axis < 0 || leaf_cost <= split_cost)) {
+                make_leaf(node, begin, count);
+                return;
+            }
+
+            if (best_axis >= 0) {
+                axis = best_axis;
+                mid = partition(info, begin, end, axis, best_split);
+            }
+            if (mid == begin || mid == end)
+                mid = median_split(begin, end, axis);
+        }
+
+        int left = node_count.fetch_add(2);
+        node.start = left;
+        node.right = left + 1;
+        node.count = 0;
+        node.axis = axis;
+
+        if (options.parallel && count > task_range) {
+            group.run([this, &group, left, begin, mid, depth] {
+                build_range(group, left, begin, mid, depth + 1);
+            });
+            build_range(group, left + 1, mid, end, depth + 1);
+        } else {
+            build_range(group, left, begin, mid, depth + 1);
+            build_range(group, left + 1, mid, end, depth + 1);
+        }
+    }
+
+    void make_leaf(bvh_flat_node& node, int begin, int count) {
+        node.start = begin;
+        node.count = count;
+        node.right = 0;
+        node.axis = 0;
+    }
+
+
+
+
+
+    // Bounds of all primitives and of their centroids
+    range_info bounds_of(int begin, int end) {
+        range_info info;
+        if (!options.parallel || end - begin < parallel_range) {
+            for (int i = begin; i < end; i++) {
+                int p = order[i];
+                info.bbox = aabb(info.bbox, bounds[p]);
+                info.centroid_bbox = aabb(info.centroid_bbox, aabb(centroids[p], centroids[p]));
+            }
+            return info;
+        }
+
+        std::mutex merge_mutex;
+        parallel_for(pool, begin, end, parallel_range / 8, [&](size_t b, size_t e) {
+            aabb box = aabb::empty, cbox = aabb::empty;
+            for (size_t i = b; i < e; i++) {
+                int p = order[i];
+                box = aabb(box, bounds[p]);
+                cbox = aabb(cbox, aabb(centroids[p], centroids[p]));
+            }
+            std::lock_guard<std::mutex> lock(merge_mutex);
+            info.bbox = aabb(info.bbox, box);
+            info.centroid_bbox = aabb(info.centroid_bbox, cbox);
+        });
+        return info;
+    }
+
+
+
+    int bin_index(const range_info& info, int axis, const point3& c) const {
+        const interval& extent = info.centroid_bbox.axis_interval(axis);
+        if (extent.size() <= 0) return 0;
+        int b = int(bin_count * (c[axis] - extent.min) / extent.size());
+        return std::min(std::max(b, 0), bin_count - 1);
+    }
+
+    // Drops every primitive into one of bin_count bins along each axis
+    void bin_range(range_info& info, int begin, int end) {
+        auto fill = [&](size_t b, size_t e, bin (&bins)[3][bin_count]) {
+            for (size_t i = b; i < e; i++) {
+                int p = order[i];
+                for (int a = 0; a < 3; a++) {
+                    auto& target = bins[a][bin_index(info, a, centroids[p])];
+                    target.bbox = aabb(target.bbox, bounds[p]);
+                    target.count++;
+                }
+            }
+        };
+
+        if (!options.parallel || end - begin < parallel_range) {
+            fill(begin, end, info.bins);
+            return;
+        }
+
+        std::mutex merge_mutex;
+        parallel_for(pool, begin, end, parallel_range / 8, [&](size_t b, size_t e) {
+            bin local[3][bin_count];
+            fill(b, e, local);
+
+            std::lock_guard<std::mutex> lock(merge_mutex);
+            for (int a = 0; a < 3; a++) {
+                for (int k = 0; k < bin_count; k++) {
+                    info.bins[a][k].bbox = aabb(info.bins[a][k].bbox, local[a][k].bbox);
+                    info.bins[a][k].count += local[a][k].count;
+                }
+            }
+        });
+    }
+
+
+
+    // Best split after bin `split` (left = bins 0..split), cost is the unnormalized SAH
+    static int best_bin_split(const bin (&bins)[bin_count], double& best_cost,
+                              const bvh_build_options& options) {
+        double right_area[bin_count];
+        int right_count[bin_count];
+
+        aabb box = aabb::empty;
+        int count = 0;
+        for (int k = bin_count - 1; k > 0; k--) {
+            box = aabb(box, bins[k].bbox);
+            count += bins[k].count;
+            right_area[k] = count ? box.surface_area() : 0;
+            right_count[k] = count;
+        }
+
+        best_cost = infinity;
+        int best_split = -1;
+        box = aabb::empty;
+        count = 0;
+        for (int k = 0; k < bin_count - 1; k++) {
+            box = aabb(box, bins[k].bbox);
+            count += bins[k].count;
+            if (count == 0 || right_count[k+1] == 0) continue;
+
+            double cost = box.surface_area() * options.leaf_cost(count)
+                        + right_area[k+1] * options.leaf_cost(right_count[k+1]);
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_split = k;
+            }
+        }
+        return best_split;
+    }
+
+
+
+    // Moves primitives whose centroid bin is <= split to the front, returns the boundary
+    int partition(const range_info& info, int begin, int end, int axis, int split) {
+        auto goes_left = [&](int p) { return bin_index(info, axis, centroids[p]) <= split; };
+
+        if (!options.parallel || end - begin < parallel_range)
+            return int(std::partition(order + begin, order + end, goes_left) - order);
+
+        // Parallel stable partition: count per chunk, prefix sums, scatter into a copy
+        const size_t chunk = parallel_range / 8;
+        size_t count = size_t(end - begin);
+        size_t chunks = (count + chunk - 1) / chunk;
+        std::vector<int> left_counts(chunks, 0);
+        std::vector<int> scratch(order + begin, order + end);
+
+        parallel_for(pool, 0, chunks, 1, [&](size_t cb, size_t ce) {
+            for (size_t c = cb; c < ce; c++) {
+                size_t e = std::min(count, (c + 1) * chunk);
+                for (size_t i = c * chunk; i < e; i++)
+                    left_counts[c] += goes_left(scratch[i]);
+            }
+        });
+
+        std::vector<int> left_offsets(chunks), right_offsets(chunks);
+        int total_left = 0;
+        for (size_t c = 0; c < chunks; c++) {
+            left_offsets[c] = total_left;
+            total_left += left_counts[c];
+        }
+        for (size_t c = 0; c < chunks; c++)
+            right_offsets[c] = total_left + int(c * chunk) - left_offsets[c];
+
+        parallel_for(pool, 0, chunks, 1, [&](size_t cb, size_t ce) {
+            for (size_t c = cb; c < ce; c++) {
+                int l = begin + left_offsets[c];
+                int r = begin + right_offsets[c];
+                size_t e = std::min(count, (c + 1) * chunk);
+                for (size_t i = c * chunk; i < e; i++) {
+                    int p = scratch[i];
+                    if (goes_left(p)) order[l++] = p;
+                    else              order[r++] = p;
+                }
+            }
+        });
+
+        return begin + total_left;
+    }
+
+    int median_split(int begin, int end, int axis) {
+        int mid = begin + (end - begin) / 2;
+        std::nth_element(order + begin, order + mid, order + end, [&](int a, int b) {
+            return centroids[a][axis] < centroids[b][axis];
+        });
+        return mid;
+    }
+};
+
+#endif
@@ -0,0 +1,301 @@
+#ifndef BVH_WIDE_H
+#define BVH_WIDE_H
+
+#include "wicked.h"
+#include "aabb.h"
+#include "bvh_build.h"
+#include "stats.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+
+// Four-wide BVH node in one 64-byte cache line. Child boxes are stored as 8-bit offsets
+// from the node's origin in steps of a power of two per axis, rounded outwards so a
+// quantized box always contains the real one. Leaf children hold their primitive range
+// directly, so the wide tree has no leaf nodes at all.
+struct alignas(64) bvh_wide_node {
+    float origin[3];               // Rounded down from the node's box minimum
+    std::int8_t exponent[3];       // Quantization step per axis is 2^exponent
+    std::uint8_t child_count;      // 1 to 4
+    std::uint8_t lo[3][4];         // Per axis, then per child, so child loops vectorize
+    std::uint8_t hi[3][4];
+    std::int32_t child[4];         // Interior: wide node index, leaf: first primitive slot
+    std::uint16_t leaf_count[4];   // Primitives in a leaf child, 0 for interior children
+};
+
+static_assert(sizeof(bvh_wide_node) == 64, "bvh_wide_node should fill one cache line");
+
+
+
+// Bytes of BVH nodes built since the last reset(), as stored and as the builders' binary
+// nodes took them, for the run report. Reset with scene_memory() on every scene load.
+struct bvh_memory_tally {
+    std::atomic<std::uint64_t> node_bytes{0};
+    std::atomic<std::uint64_t> binary_bytes{0};
+
+    void reset() {
+        node_bytes = 0;
+        binary_bytes = 0;
+    }
+};
+
+inline bvh_memory_tally& bvh_memory() {
+    static bvh_memory_tally tally;
+    return tally;
+}
+
+
+
+
+
+// Collapses a binary tree from bvh_builder or lbvh_builder into bvh_wide_node, and walks
+// it with the same visit(slot) contract as traverse_flat_bvh
+class wide_bvh {
+public:
+    void build(const std::vector<bvh_flat_node>& binary) {
+        nodes.clear();
+        if (binary.empty()) return;
+        collapse(binary, 0);
+        nodes.shrink_to_fit();
+        bvh_memory().node_bytes += memory_bytes();
+        bvh_memory().binary_bytes += binary.size() * sizeof(bvh_flat_node);
+    }
+
+    bool empty() const { return nodes.empty(); }
+    size_t node_count() const { return nodes.size(); }
+    size_t memory_bytes() const { return nodes.size() * sizeof(bvh_wide_node); }
+
+
+
+    // Visits the primitive slots of every leaf the ray reaches within ray_t, nearest child
+    // first, until visit(slot) returns true. visit may shrink ray_t as it finds hits, and
+    // children entered beyond the shrunk ray_t are then skipped.
+    template <typename Visit>
+    bool traverse(const ray& r, interval& ray_t, const Visit& visit) const {
+        if (nodes.empty())
+            return false;
+
+        struct entry { int ref; double t; };  // ref >= 0: node, < 0: ~(node * 4 + leaf child)
+        entry stack[3 * bvh_max_depth + 4];  // Up to 3 siblings wait per level of the deepest binary tree
+        int stack_size = 0;
+        stack[stack_size++] = entry{0, ray_t.min};
+
+        double inv[3], orig[3];
+        for (int a = 0; a < 3; a++) {
+            inv[a] = 1.0 / r.direction()[a];
+            orig[a] = r.origin()[a];
+        }
+
+        while (stack_size > 0) {
+            entry e = stack[--stack_size];
+            if (e.t > ray_t.max)
+                continue;
+
+            if (e.ref < 0) {
+                const auto& node = nodes[~e.ref >> 2];
+                int c = ~e.ref & 3;
+                for (int i = node.child[c]; i < node.child[c] + node.leaf_count[c]; i++)
+                    if (visit(i))
+                        return true;
+                continue;
+            }
+
+            const auto& node = nodes[e.ref];
+            WICKED_STAT(nodes_visited);
+
+            // Slab test of all four children at once; t = (origin + q * step - o) / d
+            double t_min[4], t_max[4];
+            for (int c = 0; c < 4; c++) {
+                t_min[c] = ray_t.min;
+                t_max[c] = ray_t.max;
+            }
+            for (int a = 0; a < 3; a++) {
+                double base = (double(node.origin[a]) - orig[a]) * inv[a];
+                double step = exp2_int(node.exponent[a]) * inv[a];
+                for (int c = 0; c < 4; c++) {
+                    double t0 = base + node.lo[a][c] * step;
+                    double t1 = base + node.hi[a][c] * step;
+                    if (t0 > t1) std::swap(t0, t1);
+                    // NaN (origin on a slab of a zero direction) leaves the bounds as they are
+                    if (t0 > t_min[c]) t_min[c] = t0;
+                    if (t1 < t_max[c]) t_max[c] = t1;
+                }
+            }
+
+            // Push hit children farthest first, so the nearest is popped next
+            int order[4], hits = 0;
+            for (int c = 0; c < node.child_count; c++) {
+                if (t_max[c] <= t_min[c])
+                    continue;
+                int k = hits++;
+                while (k > 0 && t_min[order[k - 1]] < t_min[c]) {
+                    order[k] = order[k - 1];
+                    k--;
+                }
+                order[k] = c;
+            }
+            for (int k = 0; k < hits; k++) {
+                int c = order[k];
+                int ref = node.leaf_count[c] ? ~(e.ref * 4 + c) : node.child[c];
+                stack[stack_size++] = entry{ref, t_min[c]};
+            }
+        }
+
+        return false;
+    }
+
+
+
+private:
+    std::vector<bvh_wide_node> nodes;  // Root at index 0
+
+
+
+    // Builds the wide node for binary node b (or a single leaf child if b is a leaf) and
+    // returns its index. Children are gathered by opening the interior child with the
+    // largest surface area until there are four.
+    int collapse(const std::vector<bvh_flat_node>& binary, int b) {
+        int index = int(nodes.size());
+        nodes.emplace_back();
+
+        int children[4];
+        int count = 0;
+        if (binary[b].is_leaf()) {
+            children[count++] = b;
+        } else {
+            children[count++] = binary[b].start;
+            children[count++] = binary[b].right;
+        }
+        while (count < 4) {
+            int widest = -1;
+            double widest_area = -1;
+            for (int c = 0; c < count; c++) {
+                const auto& child = binary[children[c]];
+                if (!child.is_leaf() && child.bbox.surface_area() > widest_area) {
+                    widest = c;
+                    widest_area = child.bbox.surface_area();
+                }
+            }
+            if (widest < 0)
+                break;
+            int opened = children[widest];
+            children[widest] = binary[opened].start;
+            children[count++] = binary[opened].right;
+        }
+
+        quantize(binary[b].bbox, binary, children, count, nodes[index]);
+
+        for (int c = 0; c < count; c++) {
+            const auto& child = binary[children[c]];
+            if (child.is_leaf()) {
+                nodes[index].child[c] = child.start;
+                nodes[index].leaf_count[c] = std::uint16_t(child.count);
+            } else {
+                int wide_child = collapse(binary, children[c]);  // May reallocate nodes
+                nodes[index].child[c] = wide_child;
+                nodes[index].leaf_count[c] = 0;
+            }
+        }
+        return index;
+    }
+
+    static void quantize(const aabb& box, const std::vector<bvh_flat_node>& binary,
+                         const int* children, int count, bvh_wide_node& node) {
+        std::memset(&node, 0, sizeof(node));
+        node.child_count = std::uint8_t(count);
+
+        for (int a = 0; a < 3; a++) {
+            const interval& extent = box.axis_interval(a);
+            float origin = float(extent.min);
+            if (double(origin) > extent.min)
+                origin = std::nextafter(origin, -std::numeric_limits<float>::infinity());
+
+            // Smallest power of two step that spans the box in 255 steps
+            int exponent = -126;
+            double span = extent.max - double(origin);
+            if (span > 0)
+                exponent = std::max(-126, int(std::ceil(std::log2(span / 255))));
+            while (exponent < 127 && double(origin) + 255 * exp2_int(exponent) < extent.max)
+                exponent++;
+            node.origin[a] = origin;
+            node.exponent[a] = std::int8_t(exponent);
+
+            // Outward rounding, checked with the same arithmetic the traversal decodes with
+            double step = exp2_int(exponent);
+            for (int c = 0; c < count; c++) {
+                const interval& child = binary[children[c]].bbox.axis_interval(a);
+                double lo = std::floor((child.min - double(origin)) / step);
+                double hi = std::ceil((child.max - double(origin)) / step);
+                lo = std::fmin(std::fmax(lo, 0.0), 255.0);
+                hi = std::fmin(std::fmax(hi, 0.0), 255.0);
+                while (lo > 0 && double(origin) + lo * step > child.min) lo--;
+                while (hi < 255 && double(origin) + hi * step < child.max) hi++;
+                node.lo[a][c] = std::uint8_t(lo);
+                node.hi[a][c] = std::uint8_t(hi);
+            }
+        }
+    }
+
+    // 2^e as a double, built from its exponent bits (e within the normal float range)
+    static double exp2_int(int e) {
+        std::uint64_t bits = std::uint64_t(e + 1023) << 52;
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+};
+
+
+
+
+
+// The node array a BVH owner traverses: wide quantized nodes when options.compress is
+// set (the default), otherwise the builder's binary nodes as they are
+class bvh_tree {
+public:
+    void assign(std::vector<bvh_flat_node>&& binary, const bvh_build_options& options) {
+        bounds = binary.empty() ? aabb::empty : binary[0].bbox;
+        if (options.compress) {
+            wide.build(binary);
+            flat.clear();
+            flat.shrink_to_fit();
+        } else {
+            wide = wide_bvh();
+            flat = std::move(binary);
+            bvh_memory().binary_bytes += flat.size() * sizeof(bvh_flat_node);
+            bvh_memory().node_bytes += flat.size() * sizeof(bvh_flat_node);
+        }
+    }
+
+    void clear() {
+        flat.clear();
+        wide = wide_bvh();
+        bounds = aabb::empty;
+    }
+
+    bool empty() const { return flat.empty() && wide.empty(); }
+    const aabb& root_bounds() const { return bounds; }
+    size_t node_count() const { return wide.empty() ? flat.size() : wide.node_count(); }
+    size_t memory_bytes() const { return wide.memory_bytes() + flat.size() * sizeof(bvh_flat_node); }
+
+    template <typename Visit>
+    bool traverse(const ray& r, interval& ray_t, const Visit& visit) const {
+        if (!wide.empty())
+            return wide.traverse(r, ray_t, visit);
+        return traverse_flat_bvh(flat, r, ray_t, visit);
+    }
+
+
+
+private:
+    std::vector<bvh_flat_node> flat;
+    wide_bvh wide;
+    aabb bounds = aabb::empty;
+};
+
+#endif
@@ -4,9 +4,45 @@
 #include "wicked.h"
 #include "hittable.h"
 #include "material.h"
+#include "report.h"
+#include "denoise.h"
+#include "tile_writer.h"
+#include "parallel.h"
+#include "ray_sort.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <thread>
 #include <vector>
 #include <mutex>
+#include <cstdint>
+#include <chrono>
+#include <string>
+
+
+// Part of the frame to render, from (x0, y0) inclusive to (x1, y1) exclusive, counted
+// from the top-left corner in pixels, or as fractions of the frame when normalized.
+// The default is the whole frame.
+struct crop_window {
+    double x0 = 0, y0 = 0, x1 = 1, y1 = 1;
+    bool normalized = true;
+    int samples_per_pixel = 0;  // Inside the window, 0 = the camera's samples_per_pixel
+
+    bool whole_frame() const {
+        return normalized && x0 <= 0 && y0 <= 0 && x1 >= 1 && y1 >= 1;
+    }
+};
+
+
+
+
+
+// How camera samples are traced: recursive ray_color() one sample at a time, or wavefront
+// batches that are traversed together and shaded grouped by material kind
+enum class integrator_kind { recursive, wavefront };
+
+
+
 
 
 // REQUIREMENT: Camera with configurable position, orientation, and field of view
@@ -30,31 +66,82 @@ public:
     double focus_dist = 10;
 
 
+    int num_threads = 0;         // 0 = one per hardware thread
+    bool show_progress = true;   // Scanlines remaining counter on std::clog
+    std::string heatmap_prefix = "heatmap";  // Heatmap file prefix (only with WICKED_STATS)
+    bool denoise = false;        // Filter the image with the AOV-guided à-trous denoiser
+    std::string aov_prefix;      // Write first-hit AOVs to <prefix>_*.ppm, empty = off
+    int ao_samples = 0;          // Ambient occlusion rays per first hit for the AO AOV, 0 = off
+    double ao_radius = 1.0;      // Occluders farther than this do not count
+    int tile_size = 64;          // Tile edge in pixels for render_tiles()
+    crop_window crop;            // Only these pixels are traced and output, same projection
+    std::string composite_path;  // render() blends its crop into this full-frame .pfm/.ppm in place
+    int composite_base_spp = 0;  // Samples behind the composite file's pixels: the crop's samples
+                                 // are averaged in with them; 0 = the crop replaces them
+    integrator_kind integrator = integrator_kind::recursive;
+    int wavefront_batch = 2048;  // Paths a thread traces together with the wavefront integrator
+    bool wavefront_sort = true;  // Reorder scattered rays by direction and origin before each bounce
 
 
 
-    void render(const hittable& world) {
-        initialize();
 
-        std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+
+    bool render(const hittable& world) {
+        return render(world, std::cout);
+    }
+
+    // Traces the crop window (the whole frame by default) and writes it to out. Returns
+    // false only if compositing into composite_path failed.
+    bool render(const hittable& world, std::ostream& out) {
+        initialize();
+        select_kernel(world);
 
         // REQUIREMENT: Parallelization, using multiple threads
-        const int num_threads = std::thread::hardware_concurrency();
+        const int thread_count = render_thread_count();
         std::vector<std::thread> threads;
-        std::vector<std::vector<color>> pixel_colors(image_height, 
-                                                     std::vector<color>(image_width));
+        std::vector<color> pixel_colors(size_t(crop_width) * crop_height);
         std::mutex progress_mutex;
         int completed_rows = 0;
+        rays_traced = 0;
+        samples_traced = 0;
+        timings = render_timings();
+        timings.thread_busy_seconds.assign(thread_count, 0.0);
+        stats_totals = traversal_stats();
+        if (stats_enabled)
+            stats_pixels.resize(crop_width, crop_height);
+        const bool collect_aovs = denoise || !aov_prefix.empty();
+        if (collect_aovs)
+            aov.resize(crop_width, crop_height);
+        else
+            aov = aov_buffers();
         
-        auto render_rows = [&](int start_row, int end_row) {
+        auto render_rows = [&](int thread_index, int start_row, int end_row) {
+            auto busy_start = std::chrono::steady_clock::now();
+            std::uint64_t samples = 0;
+            std::uint64_t rays_at_start = thread_ray_count();
+            traversal_stats stats_at_start = stats_enabled ? thread_stats() : traversal_stats();
+
+            // Rows and columns count within the crop, rays are those of the full frame
             for (int j = start_row; j < end_row; j++) {
-                for (int i = 0; i < image_width; i++) {
-                    color pixel_color(0,0,0);
-                    for (int s = 0; s < samples_per_pixel; s++) { //REQUIREMENT: Anti-aliasing
-                        ray r = get_ray(i, j);
-                        pixel_color += ray_color(r, max_depth, world);
+                if (integrator == integrator_kind::wavefront) {
+                    // Per-pixel costs are mixed up in a wavefront, so no heatmap entries
+                    samples += (this->*kernels.wavefront)(world, crop_left, crop_top + j, crop_width, 1,
+                                                          &pixel_colors[size_t(j) * crop_width], crop_width,
+                                                          collect_aovs, 0, j);
+                } else {
+                    for (int i = 0; i < crop_width; i++) {
+                        traversal_stats pixel_start = stats_enabled ? thread_stats() : traversal_stats();
+                        aov_buffers::pixel_accumulator aov_pixel;
+                        color pixel_color = (this->*kernels.pixel)(world, crop_left + i, crop_top + j,
+                                                            collect_aovs ? &aov_pixel : nullptr);
+                        pixel_colors[size_t(j) * crop_width + i] = pixel_samples_scale * pixel_color;
+                        if (collect_aovs)
+                            aov_pixel.finish(aov, i, j);
+                        samples += pixel_samples;
+
+                        if (stats_enabled)
+                            stats_pixels.record(i, j, thread_stats() - pixel_start);
                     }
-                    pixel_colors[j][i] = pixel_samples_scale * pixel_color;
                 }
                 
 
@@ -62,44 +149,245 @@ public:
                 {
                     std::lock_guard<std::mutex> lock(progress_mutex);
                     completed_rows++;
-                    std::clog << "\rScanlines remaining: " << (image_height - completed_rows) 
-                             << ' ' << std::flush;
+                    if (show_progress)
+                        std::clog << "\rScanlines remaining: " << (crop_height - completed_rows) 
+                                 << ' ' << std::flush;
                 }
             }
+
+            // Merge this thread's counters once, after all its rows are done
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            timings.thread_busy_seconds[thread_index] = seconds_since(busy_start);
+            rays_traced += thread_ray_count() - rays_at_start;
+            samples_traced += samples;
+            if (stats_enabled)
+                stats_totals += thread_stats() - stats_at_start;
         };
 
 
 
 
         // Distributes row across threads
-        int rows_per_thread = image_height / num_threads;
-        for (int t = 0; t < num_threads; t++) {
+        auto render_start = std::chrono::steady_clock::now();
+        int rows_per_thread = crop_height / thread_count;
+        for (int t = 0; t < thread_count; t++) {
             int start_row = t * rows_per_thread;
-            int end_row = (t == num_threads - 1) ? image_height : start_row + rows_per_thread;
-            threads.emplace_back(render_rows, start_row, end_row);
+            int end_row = (t == thread_count - 1) ? crop_height : start_row + rows_per_thread;
+            threads.emplace_back(render_rows, t, start_row, end_row);
         }
 
         for (auto& thread : threads) {
             thread.join();
         }
+        timings.render_seconds = seconds_since(render_start);
+        framebuffer_peak = pixel_colors.size() * (sizeof(color) + 3);
 
 
 
-        // Write out all pixels
-        for (int j = 0; j < image_height; j++) {
-            for (int i = 0; i < image_width; i++) {
-                write_color(std::cout, pixel_colors[j][i]);
-            }
+        if (denoise) {
+            auto denoise_start = std::chrono::steady_clock::now();
+            atrous_denoiser().apply(pixel_colors, aov);
+            timings.denoise_seconds = seconds_since(denoise_start);
         }
+        if (!aov_prefix.empty())
+            aov.write(aov_prefix, ao_samples > 0);
+
+
+
+        // Tone map to bytes, then write out all pixels
+        auto tone_map_start = std::chrono::steady_clock::now();
+        std::vector<unsigned char> bytes(size_t(crop_width) * crop_height * 3);
+        for (size_t p = 0; p < pixel_colors.size(); p++)
+            tone_map(pixel_colors[p], &bytes[p * 3]);
+        timings.tone_map_seconds = seconds_since(tone_map_start);
+
+        auto output_start = std::chrono::steady_clock::now();
+        out << "P3\n" << crop_width << ' ' << crop_height << "\n255\n";
+        for (size_t p = 0; p < bytes.size(); p += 3) {
+            write_color(out, &bytes[p]);
+        }
+        out.flush();
+        bool ok = composite_path.empty() || composite(pixel_colors);
+        timings.output_seconds = seconds_since(output_start);
+
+        if (show_progress)
+            std::clog << "\rDone.                 \n";
 
-        std::clog << "\rDone.                 \n";
+        if (stats_enabled) {
+            print_stats(std::clog, stats_totals);
+            write_heatmaps(heatmap_prefix, stats_pixels);
+        }
+        return ok;
     }
 
 
 
+    // Streaming render for images too large for memory: threads take tile_size tiles in
+    // order, trace them into a buffer of their own and hand them to a tile_writer, which
+    // puts them straight into the output file (.pfm floats or .ppm bytes). Peak pixel
+    // memory is one tile per thread. Denoising, AOVs and heatmaps need the whole frame
+    // and are not produced. With a crop window the file holds just the crop.
+    bool render_tiles(const hittable& world, const std::string& path) {
+        initialize();
+        select_kernel(world);
+
+        tile_writer writer;
+        if (!writer.open(path, crop_width, crop_height))
+            return false;
+
+        const int tile = std::max(1, tile_size);
+        const int tiles_x = (crop_width + tile - 1) / tile;
+        const int tiles_y = (crop_height + tile - 1) / tile;
+        const int tile_count = tiles_x * tiles_y;
+        const int thread_count = std::min(render_thread_count(), tile_count);
+
+        std::vector<std::thread> threads;
+        std::mutex progress_mutex;
+        std::atomic<int> next_tile{0};
+        std::atomic<bool> failed{false};
+        int completed_tiles = 0;
+        rays_traced = 0;
+        samples_traced = 0;
+        timings = render_timings();
+        timings.thread_busy_seconds.assign(thread_count, 0.0);
+        stats_totals = traversal_stats();
+        stats_pixels = pixel_stats();
+        aov = aov_buffers();
+
+        auto render_tile_loop = [&](int thread_index) {
+            auto busy_start = std::chrono::steady_clock::now();
+            std::uint64_t samples = 0;
+            std::uint64_t rays_at_start = thread_ray_count();
+            traversal_stats stats_at_start = stats_enabled ? thread_stats() : traversal_stats();
+            double write_seconds = 0;
+            std::vector<color> pixels(size_t(tile) * tile);
+
+            for (int t = next_tile++; t < tile_count && !failed; t = next_tile++) {
+                int x0 = (t % tiles_x) * tile, y0 = (t / tiles_x) * tile;
+                int w = std::min(tile, crop_width - x0), h = std::min(tile, crop_height - y0);
+
+                if (integrator == integrator_kind::wavefront) {
+                    (this->*kernels.wavefront)(world, crop_left + x0, crop_top + y0, w, h, pixels.data(), w,
+                                               false, 0, 0);
+                } else {
+                    for (int j = 0; j < h; j++) {
+                        for (int i = 0; i < w; i++) {
+                            color pixel_color = (this->*kernels.pixel)(world, crop_left + x0 + i, crop_top + y0 + j, nullptr);
+                            pixels[size_t(j) * w + i] = pixel_samples_scale * pixel_color;
+                        }
+                    }
+                }
+                samples += std::uint64_t(w) * h * pixel_samples;
+
+                auto write_start = std::chrono::steady_clock::now();
+                if (!writer.write_tile(x0, y0, w, h, pixels.data()))
+                    failed = true;
+                write_seconds += seconds_since(write_start);
+
+                std::lock_guard<std::mutex> lock(progress_mutex);
+                completed_tiles++;
+                if (show_progress)
+                    std::clog << "\rTiles remaining: " << (tile_count - completed_tiles) << ' ' << std::flush;
+            }
+
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            timings.thread_busy_seconds[thread_index] = seconds_since(busy_start);
+            timings.output_seconds += write_seconds;
+            rays_traced += thread_ray_count() - rays_at_start;
+            samples_traced += samples;
+            if (stats_enabled)
+                stats_totals += thread_stats() - stats_at_start;
+        };
+
+        auto render_start = std::chrono::steady_clock::now();
+        for (int t = 0; t < thread_count; t++)
+            threads.emplace_back(render_tile_loop, t);
+        for (auto& thread : threads)
+            thread.join();
+        timings.render_seconds = seconds_since(render_start);
+        framebuffer_peak = size_t(thread_count) * tile * tile * (sizeof(color) + writer.pixel_bytes());
+
+        bool ok = writer.close() && !failed;
+        if (show_progress)
+            std::clog << "\rDone.                 \n";
+        if (stats_enabled)
+            print_stats(std::clog, stats_totals);
+        return ok;
+    }
+
+
+
+    // Computes the projection from the fields above and picks the sample kernels for
+    // world; the render calls do this themselves
+    void prepare(const hittable& world) {
+        initialize();
+        select_kernel(world);
+    }
+
+    // One preview pass at 1 spp for the preview renderer, after prepare(): one ray through
+    // a random point of each scale x scale block of pixels, traced to depth bounces, for
+    // block rows [block_row_begin, block_row_end). samples receives one colour per block,
+    // row-major over the block grid. Rows run in parallel on the task pool.
+    void trace_preview_blocks(const hittable& world, int scale, int depth,
+                              int block_row_begin, int block_row_end, std::vector<color>& samples) const {
+        const int blocks_x = (image_width + scale - 1) / scale;
+        samples.resize(size_t(blocks_x) * (block_row_end - block_row_begin));
+        parallel_for(size_t(block_row_begin), size_t(block_row_end), 1, [&](size_t row_begin, size_t row_end) {
+            for (int by = int(row_begin); by < int(row_end); by++) {
+                for (int bx = 0; bx < blocks_x; bx++) {
+                    int i = std::min(bx * scale + random_int(0, scale - 1), image_width - 1);
+                    int j = std::min(by * scale + random_int(0, scale - 1), image_height - 1);
+                    samples[size_t(by - block_row_begin) * blocks_x + bx] = (this->*kernels.preview)(world, i, j, depth);
+                }
+            }
+        });
+    }
+
+
+
+    // Rays traced (camera + scattered) by the last render() call
+    std::uint64_t ray_count() const { return rays_traced; }
+
+    // Camera samples traced by the last render() call (achieved spp = samples / pixels)
+    std::uint64_t sample_count() const { return samples_traced; }
+
+    // Stage timings of the last render() call
+    const render_timings& last_timings() const { return timings; }
+
+    int output_height() const { return image_height; }
+
+    // Size and samples per pixel of what the last render traced: the crop window
+    int crop_output_width() const { return crop_width; }
+    int crop_output_height() const { return crop_height; }
+    int crop_samples_per_pixel() const { return pixel_samples; }
+
+    // Features the last render's sample kernel handles, e.g. "defocus,motion_blur,emission"
+    std::string kernel_features() const {
+        std::string names;
+        if (use_defocus) names += ",defocus";
+        if (features.motion_blur) names += ",motion_blur";
+        if (features.emission) names += ",emission";
+        return names.empty() ? "none" : names.substr(1);
+    }
+
+    // Bytes of pixel buffers the last render held at once: the whole frame for render(),
+    // one tile per thread for render_tiles()
+    std::uint64_t framebuffer_bytes() const { return framebuffer_peak; }
+
+    // Merged traversal counters and per-pixel costs (only filled with WICKED_STATS)
+    const traversal_stats& stats() const { return stats_totals; }
+    const pixel_stats& pixel_costs() const { return stats_pixels; }
+
+    // First-hit AOVs of the last render() call (only filled with denoise or aov_prefix)
+    const aov_buffers& aovs() const { return aov; }
+
+
+
 
 private:
     int image_height;
+    int crop_left, crop_top, crop_width, crop_height;  // Crop window in pixels
+    int pixel_samples;  // Samples per pixel inside the crop window
     double pixel_samples_scale;
     point3 center;
     point3 pixel00_loc;
@@ -108,6 +396,29 @@ private:
     vec3 u, v, w;
     vec3 defocus_disk_u;
     vec3 defocus_disk_v;
+    std::uint64_t rays_traced = 0;
+    std::uint64_t samples_traced = 0;
+    std::uint64_t framebuffer_peak = 0;
+    render_timings timings;
+    traversal_stats stats_totals;
+    pixel_stats stats_pixels;
+    aov_buffers aov;
+
+    // The sample kernels select_kernel() picked, all instantiated for the same features:
+    // sample_pixel() traces and sums one pixel's samples, trace_wavefront() a region's
+    // samples breadth first, preview_sample() one preview ray
+    using pixel_kernel = color (camera::*)(const hittable&, int, int, aov_buffers::pixel_accumulator*) const;
+    using wavefront_kernel = std::uint64_t (camera::*)(const hittable&, int, int, int, int,
+                                                       color*, size_t, bool, int, int);
+    using preview_kernel = color (camera::*)(const hittable&, int, int, int) const;
+    struct kernel_set {
+        pixel_kernel pixel = nullptr;
+        wavefront_kernel wavefront = nullptr;
+        preview_kernel preview = nullptr;
+    };
+    kernel_set kernels;
+    scene_features features = scene_features::all();  // Of the world being rendered
+    bool use_defocus = true;
 
 
 
@@ -118,7 +429,16 @@ private:
         image_height = int(image_width / aspect_ratio);
         image_height = (image_height < 1) ? 1 : image_height;
 
-        pixel_samples_scale = 1.0 / samples_per_pixel;
+        // Crop window in whole pixels, at least one, inside the frame
+        double scale_x = crop.normalized ? image_width : 1.0;
+        double scale_y = crop.normalized ? image_height : 1.0;
+        crop_left = std::clamp(int(std::lround(crop.x0 * scale_x)), 0, image_width - 1);
+        crop_top = std::clamp(int(std::lround(crop.y0 * scale_y)), 0, image_height - 1);
+        crop_width = std::clamp(int(std::lround(crop.x1 * scale_x)), crop_left + 1, image_width) - crop_left;
+        crop_height = std::clamp(int(std::lround(crop.y1 * scale_y)), crop_top + 1, image_height) - crop_top;
+
+        pixel_samples = (crop.samples_per_pixel > 0) ? crop.samples_per_pixel : samples_per_pixel;
+        pixel_samples_scale = 1.0 / pixel_samples;
 
         center = lookfrom;
 
@@ -152,12 +472,15 @@ private:
         auto defocus_radius = focus_dist * std::tan(degrees_to_radians(defocus_angle / 2));
         defocus_disk_u = u * defocus_radius;
         defocus_disk_v = v * defocus_radius;
+        use_defocus = defocus_angle > 0;
     }
     
 
     
 
-    // Generates random ray for pixel
+    // Generates random ray for pixel. Without Defocus rays start at the camera center, without MotionBlur at time 0,
+    // and neither draws random numbers
+    template <bool Defocus, bool MotionBlur>
     ray get_ray(int i, int j) const {
         auto offset = sample_square();
         auto pixel_sample = pixel00_loc
@@ -165,9 +488,9 @@ private:
                           + ((j + offset.y()) * pixel_delta_v);
 
         // Ray origin
-        auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
+        auto ray_origin = Defocus ? defocus_disk_sample() : center;
         auto ray_direction = pixel_sample - ray_origin;
-        auto ray_time = random_double();  // REQUIREMENT: Motion blur
+        auto ray_time = MotionBlur ? random_double() : 0.0;  // REQUIREMENT: Motion blur
 
         return ray(ray_origin, ray_direction, ray_time);
     }
@@ -190,12 +513,134 @@ private:
 
 
 
+    // Chooses the sample kernels for this render from the world's features and the lens,
+    // after initialize(). A pinhole camera over a static scene without lights then traces
+    // with no branch and no random number for defocus, motion blur or emission, whichever
+    // integrator or the preview is running.
+    void select_kernel(const hittable& world) {
+        static const kernel_set sets[8] = {
+            kernels_for<false, false, false>(), kernels_for<false, false, true>(),
+            kernels_for<false, true, false>(),  kernels_for<false, true, true>(),
+            kernels_for<true, false, false>(),  kernels_for<true, false, true>(),
+            kernels_for<true, true, false>(),   kernels_for<true, true, true>(),
+        };
+        features = world.features();
+        kernels = sets[(use_defocus ? 4 : 0) | (features.motion_blur ? 2 : 0) | (features.emission ? 1 : 0)];
+    }
+
+    template <bool Defocus, bool MotionBlur, bool Emission>
+    static kernel_set kernels_for() {
+        kernel_set set;
+        set.pixel = &camera::sample_pixel<Defocus, MotionBlur, Emission>;
+        set.wavefront = &camera::trace_wavefront<Defocus, MotionBlur, Emission>;
+        set.preview = &camera::preview_sample<Defocus, MotionBlur, Emission>;
+        return set;
+    }
+
+    // Sum of pixel (i, j)'s samples through ray_color(); aov_pixel, if given, collects
+    // the first-hit AOVs
+    template <bool Defocus, bool MotionBlur, bool Emission>
+    color sample_pixel(const hittable& world, int i, int j, aov_buffers::pixel_accumulator* aov_pixel) const {
+        color pixel_color(0,0,0);
+        for (int s = 0; s < pixel_samples; s++) { //REQUIREMENT: Anti-aliasing
+            ray r = get_ray<Defocus, MotionBlur>(i, j);
+            WICKED_STAT(paths);
+            if (aov_pixel) {
+                aov_sample first_hit;
+                color sample_color = ray_color<Emission>(r, max_depth, world, &first_hit);
+                aov_pixel->add(first_hit, sample_color);
+                pixel_color += sample_color;
+            } else {
+                pixel_color += ray_color<Emission>(r, max_depth, world);
+            }
+        }
+        return pixel_color;
+    }
+
+    // One preview ray through pixel (i, j), traced to depth bounces
+    template <bool Defocus, bool MotionBlur, bool Emission>
+    color preview_sample(const hittable& world, int i, int j, int depth) const {
+        return ray_color<Emission>(get_ray<Defocus, MotionBlur>(i, j), depth, world);
+    }
+
+
+
+
+    static double seconds_since(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+
+
+    // Number of threads render() uses
+    int render_thread_count() const {
+        int count = (num_threads > 0) ? num_threads : int(std::thread::hardware_concurrency());
+        count = (count < 1) ? 1 : count;
+        return (count > crop_height) ? crop_height : count;
+    }
+
+
+
+    // Writes the crop into the full-frame image at composite_path, in place. With
+    // composite_base_spp the file is an accumulation buffer: each pixel becomes the mean
+    // of its base samples and the crop's, weighted by count.
+    bool composite(const std::vector<color>& pixels) const {
+        tile_writer file;
+        if (!file.open_existing(composite_path, image_width, image_height))
+            return false;
+
+        std::vector<color> blended(pixels);
+        if (composite_base_spp > 0) {
+            if (!file.read_tile(crop_left, crop_top, crop_width, crop_height, blended.data()))
+                return false;
+            double base = composite_base_spp, added = pixel_samples;
+            for (size_t p = 0; p < blended.size(); p++)
+                blended[p] = (base * blended[p] + added * pixels[p]) / (base + added);
+        }
+        return file.write_tile(crop_left, crop_top, crop_width, crop_height, blended.data())
+            && file.close();
+    }
+
+
+
+    // Per-thread count of rays passed to ray_color, read before and after a thread's work
+    static std::uint64_t& thread_ray_count() {
+        static thread_local std::uint64_t count = 0;
+        return count;
+    }
+
+
+
+
+    // Fraction of ao_samples cosine-distributed rays blocked within ao_radius.
+    // Uses the any-hit query, so it costs a fraction of tracing as many paths.
+    double ambient_occlusion(const hit_record& rec, double time, const hittable& world) const {
+        if (ao_samples <= 0)
+            return 0;
+        int blocked = 0;
+        for (int s = 0; s < ao_samples; s++) {
+            auto direction = rec.normal + random_unit_vector();
+            if (direction.near_zero())
+                direction = rec.normal;
+            ray probe(rec.p, unit_vector(direction), time);
+            blocked += world.occluded(probe, interval(0.001, ao_radius));
+        }
+        return double(blocked) / ao_samples;
+    }
 
-    // Recursively trace ray through scene
-    color ray_color(const ray& r, int depth, const hittable& world) const {
+
+
+
+    // Recursively trace ray through scene, first_hit (camera rays only) receives the AOVs.
+    // Without Emission no material in the scene emits, and emitted() is not called.
+    template <bool Emission = true>
+    color ray_color(const ray& r, int depth, const hittable& world,
+                    aov_sample* first_hit = nullptr) const {
         if (depth <= 0)
             return color(0,0,0);
 
+        thread_ray_count()++;
+        WICKED_STAT(bounces);
         hit_record rec;
 
         // if missed objects, return background color
@@ -204,16 +649,225 @@ private:
 
         ray scattered;
         color attenuation;
-        color color_from_emission = rec.mat->emitted(rec.u, rec.v, rec.p);
+        color color_from_emission = Emission ? rec.mat->emitted(rec.u, rec.v, rec.p) : color(0,0,0);
+
+        bool scatters = rec.mat->scatter(r, rec, attenuation, scattered);
+
+        if (first_hit) {
+            first_hit->albedo = scatters ? attenuation
+                              : color(std::fmin(color_from_emission.x(), 1.0),
+                                      std::fmin(color_from_emission.y(), 1.0),
+                                      std::fmin(color_from_emission.z(), 1.0));
+            first_hit->normal = rec.normal;
+            first_hit->depth = rec.t * r.direction().length();
+            first_hit->material_id = rec.mat->id();
+            first_hit->occlusion = ambient_occlusion(rec, r.time(), world);
+        }
 
         // if surface does not scatter, retun emission
-        if (!rec.mat->scatter(r, rec, attenuation, scattered))
+        if (!scatters)
             return color_from_emission;
 
-        color color_from_scatter = attenuation * ray_color(scattered, depth-1, world);
+        color color_from_scatter = attenuation * ray_color<Emission>(scattered, depth-1, world);
 
         return color_from_emission + color_from_scatter;
     }
+
+
+
+
+    // One camera sample in flight in the wavefront integrator
+    struct wavefront_path {
+        ray r;
+        color throughput;  // Product of the attenuations so far
+        color radiance;    // Light gathered so far
+        int pixel;         // Pixel within the batch
+        int sample;        // Index of the first-hit AOV sample, when collected
+        int depth;         // Rays left, like ray_color's depth
+    };
+
+    // Per-thread queues, reused across batches and rows
+    struct wavefront_queues {
+        std::vector<wavefront_path> paths, next;
+        std::vector<hit_record> hits;
+        std::vector<unsigned char> kinds;  // Material kind of each path's hit
+        std::vector<int> order;            // Live paths, bucketed by material kind
+        std::vector<color> pixel_sums;
+        std::vector<aov_buffers::pixel_accumulator> pixel_aovs;
+        std::vector<aov_sample> first_hits;
+        ray_sorter sorter;
+    };
+
+    // One set per thread, shared by every trace_wavefront() instantiation
+    static wavefront_queues& thread_wavefront_queues() {
+        static thread_local wavefront_queues q;
+        return q;
+    }
+
+    // The image of ray_color(), traced breadth first: a batch of camera samples is traced
+    // one bounce at a time. Each bounce traverses every live path, buckets the hits by
+    // material kind, shades each bucket in its own loop and compacts the scattered paths
+    // into the next queue; with wavefront_sort the queue is reordered by ray_sorter
+    // before every bounce after the camera rays. Pixels are the w x h region at (x0, y0); colours go to
+    // out[j * stride + i], AOVs to (aov_x + i, aov_y + j). Returns the samples traced.
+    // Specialized like sample_pixel(), and picked by select_kernel() the same way.
+    template <bool Defocus, bool MotionBlur, bool Emission>
+    std::uint64_t trace_wavefront(const hittable& world, int x0, int y0, int w, int h,
+                                  color* out, size_t stride, bool collect_aovs, int aov_x, int aov_y) {
+        wavefront_queues& q = thread_wavefront_queues();
+        const int pixel_count = w * h;
+        const int pixels_per_batch = std::max(1, wavefront_batch / pixel_samples);
+
+        for (int first = 0; first < pixel_count; first += pixels_per_batch) {
+            const int count = std::min(pixels_per_batch, pixel_count - first);
+            q.pixel_sums.assign(count, color(0,0,0));
+            if (collect_aovs) {
+                q.pixel_aovs.assign(count, aov_buffers::pixel_accumulator());
+                q.first_hits.assign(size_t(count) * pixel_samples, aov_sample());
+            }
+
+            // Generate
+            q.paths.clear();
+            for (int p = 0; p < count; p++) {
+                int i = (first + p) % w, j = (first + p) / w;
+                for (int s = 0; s < pixel_samples; s++) { //REQUIREMENT: Anti-aliasing
+                    WICKED_STAT(paths);
+                    int sample = int(q.paths.size());
+                    q.paths.push_back(wavefront_path{get_ray<Defocus, MotionBlur>(x0 + i, y0 + j), color(1,1,1), color(0,0,0),
+                                                     p, sample, max_depth});
+                }
+            }
+
+            auto finish = [&](const wavefront_path& path) {
+                q.pixel_sums[path.pixel] += path.radiance;
+                if (collect_aovs)
+                    q.pixel_aovs[path.pixel].add(q.first_hits[path.sample], path.radiance);
+            };
+
+            for (int bounce = 0; !q.paths.empty(); bounce++) {
+                // Camera rays are already coherent in pixel order, scattered ones are not
+                if (wavefront_sort && bounce > 0) {
+                    const auto& order = q.sorter.sort(q.paths.size(),
+                                                      [&](size_t k) -> const ray& { return q.paths[k].r; });
+                    q.next.clear();
+                    for (int k : order)
+                        q.next.push_back(q.paths[k]);
+                    std::swap(q.paths, q.next);
+                }
+
+                // Traverse every live path, misses pick up the background and end
+                const size_t n = q.paths.size();
+                q.hits.resize(n);
+                int bucket_start[material_kind_count + 1] = {};
+                auto& kinds = q.kinds;
+                kinds.resize(n);
+                for (size_t k = 0; k < n; k++) {
+                    auto& path = q.paths[k];
+                    kinds[k] = material_kind_count;  // Finished
+                    if (path.depth <= 0) {
+                        finish(path);
+                        continue;
+                    }
+                    thread_ray_count()++;
+                    WICKED_STAT(bounces);
+                    if (!world.hit(path.r, interval(0.001, infinity), q.hits[k])) {
+                        path.radiance += path.throughput * background;
+                        finish(path);
+                        continue;
+                    }
+                    kinds[k] = (unsigned char)(q.hits[k].mat->kind());
+                    bucket_start[kinds[k] + 1]++;
+                }
+
+                // Counting sort of the live paths by material kind
+                for (int b = 0; b < material_kind_count; b++)
+                    bucket_start[b + 1] += bucket_start[b];
+                q.order.resize(bucket_start[material_kind_count]);
+                int fill[material_kind_count];
+                std::copy(bucket_start, bucket_start + material_kind_count, fill);
+                for (size_t k = 0; k < n; k++)
+                    if (kinds[k] < material_kind_count)
+                        q.order[fill[kinds[k]]++] = int(k);
+
+                // Shade bucket by bucket
+                q.next.clear();
+                for (int b = 0; b < material_kind_count; b++) {
+                    const int* begin = q.order.data() + bucket_start[b];
+                    const int* end = q.order.data() + bucket_start[b + 1];
+                    switch (material_kind(b)) {
+                        case material_kind::lambertian:
+                            shade_bucket<Emission, lambertian>(world, begin, end, q, collect_aovs, finish);
+                            break;
+                        case material_kind::metal:
+                            shade_bucket<Emission, metal>(world, begin, end, q, collect_aovs, finish);
+                            break;
+                        case material_kind::dielectric:
+                            shade_bucket<Emission, dielectric>(world, begin, end, q, collect_aovs, finish);
+                            break;
+                        case material_kind::light:
+                            shade_bucket<Emission, diffuse_light>(world, begin, end, q, collect_aovs, finish);
+                            break;
+                        case material_kind::isotropic:
+                            shade_bucket<Emission, isotropic>(world, begin, end, q, collect_aovs, finish);
+                            break;
+                        default:
+                            shade_bucket<Emission, material>(world, begin, end, q, collect_aovs, finish);
+                            break;
+                    }
+                }
+                std::swap(q.paths, q.next);
+            }
+
+            for (int p = 0; p < count; p++) {
+                int i = (first + p) % w, j = (first + p) / w;
+                out[size_t(j) * stride + i] = pixel_samples_scale * q.pixel_sums[p];
+                if (collect_aovs)
+                    q.pixel_aovs[p].finish(aov, aov_x + i, aov_y + j);
+            }
+        }
+        return std::uint64_t(pixel_count) * pixel_samples;
+    }
+
+    // Emission and scattering for one bucket of hits on materials of type Material; with
+    // a final class the calls below are direct and the loop stays on one material's code.
+    // Paths that scatter move to the next queue, the rest are finished. Without Emission
+    // no material in the scene emits, and emitted() is not called.
+    template <bool Emission, typename Material, typename Finish>
+    void shade_bucket(const hittable& world, const int* begin, const int* end, wavefront_queues& q,
+                      bool collect_aovs, const Finish& finish) const {
+        for (const int* k = begin; k != end; k++) {
+            auto& path = q.paths[*k];
+            const hit_record& rec = q.hits[*k];
+            const Material& mat = static_cast<const Material&>(*rec.mat);
+
+            color emission = Emission ? mat.emitted(rec.u, rec.v, rec.p) : color(0,0,0);
+            color attenuation;
+            ray scattered;
+            bool scatters = mat.scatter(path.r, rec, attenuation, scattered);
+
+            if (collect_aovs && path.depth == max_depth) {
+                aov_sample& first_hit = q.first_hits[path.sample];
+                first_hit.albedo = scatters ? attenuation
+                                 : color(std::fmin(emission.x(), 1.0),
+                                         std::fmin(emission.y(), 1.0),
+                                         std::fmin(emission.z(), 1.0));
+                first_hit.normal = rec.normal;
+                first_hit.depth = rec.t * path.r.direction().length();
+                first_hit.material_id = rec.mat->id();
+                first_hit.occlusion = ambient_occlusion(rec, path.r.time(), world);
+            }
+
+            path.radiance += path.throughput * emission;
+            if (!scatters) {
+                finish(path);
+                continue;
+            }
+            path.throughput = path.throughput * attenuation;
+            path.r = scattered;
+            path.depth--;
+            q.next.push_back(path);
+        }
+    }
 };
 
 #endif
\ No newline at end of file
@@ -16,7 +16,8 @@ inline double linear_to_gamma(double linear_component) {
 
 
 
-void write_color(std::ostream& out, const color& pixel_color) {
+// Gamma correct and quantize a linear color to bytes
+inline void tone_map(const color& pixel_color, unsigned char rgb[3]) {
     auto r = pixel_color.x();
     auto g = pixel_color.y();
     auto b = pixel_color.z();
@@ -29,11 +30,21 @@ void write_color(std::ostream& out, const color& pixel_color) {
 
     // Translate [0,1] to byte range [0,255]
     static const interval intensity(0.000, 0.999);
-    int rbyte = int(256 * intensity.clamp(r));
-    int gbyte = int(256 * intensity.clamp(g));
-    int bbyte = int(256 * intensity.clamp(b));
+    rgb[0] = (unsigned char)(256 * intensity.clamp(r));
+    rgb[1] = (unsigned char)(256 * intensity.clamp(g));
+    rgb[2] = (unsigned char)(256 * intensity.clamp(b));
+}
+
+
+
+inline void write_color(std::ostream& out, const unsigned char rgb[3]) {
+    out << int(rgb[0]) << ' ' << int(rgb[1]) << ' ' << int(rgb[2]) << '\n';
+}
 
-    out << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';
+inline void write_color(std::ostream& out, const color& pixel_color) {
+    unsigned char rgb[3];
+    tone_map(pixel_color, rgb);
+    write_color(out, rgb);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,288 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "wicked.h"
+#include "color.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+// What the camera ray of one sample saw at its first hit
+struct aov_sample {
+    color albedo = color(1,1,1);  // Scatter attenuation, or clamped emission for lights
+    vec3 normal = vec3(0,0,0);    // Shading normal
+    double depth = infinity;      // Distance along the ray, infinity on a miss
+    int material_id = -1;         // -1 on a miss
+    double occlusion = 0;         // Fraction of ambient occlusion rays blocked
+};
+
+
+
+
+
+// Auxiliary output variables (AOVs) from the first hit, one entry per pixel.
+// Albedo, normal and depth are averaged over the pixel's samples that hit something,
+// material ID is the one seen by most of them. Colour mean and luminance variance
+// come along so the denoiser can estimate noise per pixel.
+class aov_buffers {
+public:
+    int width = 0;
+    int height = 0;
+    std::vector<color> albedo;
+    std::vector<vec3> normal;
+    std::vector<double> depth;
+    std::vector<int> material_id;
+    std::vector<double> ambient;   // Ambient occlusion, 1 = fully open (only with ao_samples)
+    std::vector<double> variance;  // Luminance variance of the pixel mean
+
+
+
+    void resize(int w, int h) {
+        width = w;
+        height = h;
+        size_t n = size_t(w) * h;
+        albedo.assign(n, color(1,1,1));
+        normal.assign(n, vec3(0,0,0));
+        depth.assign(n, infinity);
+        material_id.assign(n, -1);
+        ambient.assign(n, 1.0);
+        variance.assign(n, 0.0);
+    }
+
+    bool empty() const { return albedo.empty(); }
+
+
+
+    // Sums one pixel's samples; call add() for each, then finish()
+    class pixel_accumulator {
+    public:
+        void add(const aov_sample& s, const color& sample_color) {
+            double l = luminance(sample_color);
+            lum_sum += l;
+            lum_sq_sum += l * l;
+            samples++;
+
+            if (s.material_id < 0) return;
+            albedo_sum += s.albedo;
+            normal_sum += s.normal;
+            depth_sum += s.depth;
+            occlusion_sum += s.occlusion;
+            hits++;
+            // Boyer-Moore majority vote keeps the dominant material without a map
+            if (votes == 0) { id = s.material_id; votes = 1; }
+            else votes += (id == s.material_id) ? 1 : -1;
+        }
+
+        void finish(aov_buffers& buffers, int i, int j) const {
+            size_t p = size_t(j) * buffers.width + i;
+            if (samples > 1) {
+                double mean = lum_sum / samples;
+                double sample_var = std::max(0.0, (lum_sq_sum - samples * mean * mean) / (samples - 1));
+                buffers.variance[p] = sample_var / samples;
+            }
+            // Pixels where most samples missed keep the miss values, edges stay sharp
+            if (2 * hits < samples) return;
+            buffers.albedo[p] = albedo_sum / hits;
+            buffers.normal[p] = normal_sum.near_zero() ? vec3(0,0,0) : unit_vector(normal_sum);
+            buffers.depth[p] = depth_sum / hits;
+            buffers.material_id[p] = id;
+            buffers.ambient[p] = 1.0 - occlusion_sum / hits;
+        }
+
+    private:
+        color albedo_sum = color(0,0,0);
+        vec3 normal_sum = vec3(0,0,0);
+        double depth_sum = 0;
+        double occlusion_sum = 0;
+        double lum_sum = 0, lum_sq_sum = 0;
+        int samples = 0, hits = 0;
+        int id = -1, votes = 0;
+    };
+
+
+
+    // Writes <prefix>_albedo.ppm, _normal.ppm, _depth.ppm, _material.ppm, and _ao.ppm
+    // when ambient occlusion was traced
+    bool write(const std::string& prefix, bool with_ambient = false) const {
+        double max_depth = 0;
+        for (auto d : depth)
+            if (d < infinity) max_depth = std::max(max_depth, d);
+
+        bool ok = write_image(prefix + "_albedo.ppm", [&](size_t p) { return albedo[p]; });
+        ok &= write_image(prefix + "_normal.ppm", [&](size_t p) {
+            return normal[p].near_zero() ? color(0,0,0) : 0.5 * (normal[p] + vec3(1,1,1));
+        });
+        ok &= write_image(prefix + "_depth.ppm", [&](size_t p) {
+            double g = (depth[p] < infinity && max_depth > 0) ? 1.0 - depth[p] / max_depth : 0.0;
+            return color(g, g, g);
+        });
+        ok &= write_image(prefix + "_material.ppm", [&](size_t p) {
+            return material_id[p] < 0 ? color(0,0,0) : id_color(material_id[p]);
+        });
+        if (with_ambient)
+            ok &= write_image(prefix + "_ao.ppm", [&](size_t p) { return color(1,1,1) * ambient[p]; });
+        return ok;
+    }
+
+
+
+    static double luminance(const color& c) {
+        return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+    }
+
+private:
+    template <typename F>
+    bool write_image(const std::string& filename, const F& pixel) const {
+        std::ofstream out(filename);
+        if (!out) {
+            std::cerr << "ERROR: Could not write AOV '" << filename << "'\n";
+            return false;
+        }
+        out << "P3\n" << width << ' ' << height << "\n255\n";
+        for (size_t p = 0; p < albedo.size(); p++) {
+            color c = pixel(p);
+            out << int(255.999 * std::clamp(c.x(), 0.0, 1.0)) << ' '
+                << int(255.999 * std::clamp(c.y(), 0.0, 1.0)) << ' '
+                << int(255.999 * std::clamp(c.z(), 0.0, 1.0)) << '\n';
+        }
+        return true;
+    }
+
+    // Distinct, stable false colour per material ID
+    static color id_color(int id) {
+        unsigned h = unsigned(id) * 2654435761u;
+        return color(((h >> 8) & 255) / 255.0, ((h >> 16) & 255) / 255.0, ((h >> 24) & 255) / 255.0);
+    }
+};
+
+
+
+
+
+// Edge-avoiding à-trous wavelet denoiser (Dammertz et al. 2010), with the per-pixel
+// variance guided luminance weight from SVGF (Schied et al. 2017).
+// Colour is divided by albedo first so textures are not blurred, then filtered with a
+// 5x5 B3 spline kernel whose taps spread out by 2^i on iteration i. Taps are weighted
+// down across normal, depth and material ID edges and across luminance differences
+// that are large compared to the pixel's noise. Rows are filtered in parallel.
+class atrous_denoiser {
+public:
+    int iterations = 5;          // Filter radius is 2^(iterations+1) pixels
+    double sigma_luminance = 4;  // Luminance tolerance in standard deviations of noise
+    double sigma_normal = 64;    // Exponent on the normal cosine
+    double sigma_depth = 0.02;   // Relative depth tolerance per pixel of tap distance
+
+
+
+    void apply(std::vector<color>& pixels, const aov_buffers& aov) const {
+        const int w = aov.width, h = aov.height;
+        const size_t n = size_t(w) * h;
+        if (n == 0 || pixels.size() != n) return;
+
+        // Demodulate: filter irradiance, put the albedo back at the end
+        std::vector<color> current(n), next(n);
+        std::vector<double> var(aov.variance), next_var(n);
+        for (size_t p = 0; p < n; p++) {
+            color a = safe_albedo(aov.albedo[p]);
+            current[p] = color(pixels[p].x() / a.x(), pixels[p].y() / a.y(), pixels[p].z() / a.z());
+            double la = aov_buffers::luminance(a);
+            var[p] /= la * la;
+        }
+
+        for (int it = 0; it < iterations; it++) {
+            const int step = 1 << it;
+            parallel_for(0, size_t(h), 4, [&](size_t row_begin, size_t row_end) {
+                for (int j = int(row_begin); j < int(row_end); j++)
+                    for (int i = 0; i < w; i++)
+                        filter_pixel(i, j, step, aov, current, var, next, next_var);
+            });
+            std::swap(current, next);
+            std::swap(var, next_var);
+        }
+
+        for (size_t p = 0; p < n; p++)
+            pixels[p] = current[p] * safe_albedo(aov.albedo[p]);
+    }
+
+
+
+private:
+    static color safe_albedo(const color& a) {
+        const double floor = 0.01;
+        return color(std::max(a.x(), floor), std::max(a.y(), floor), std::max(a.z(), floor));
+    }
+
+    void filter_pixel(int i, int j, int step, const aov_buffers& aov,
+                      const std::vector<color>& in, const std::vector<double>& var,
+                      std::vector<color>& out, std::vector<double>& out_var) const {
+        static const double kernel[3] = { 3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0 };
+        const int w = aov.width, h = aov.height;
+        const size_t p = size_t(j) * w + i;
+
+        const double lp = aov_buffers::luminance(in[p]);
+        const double sigma_l = sigma_luminance * std::sqrt(blurred_variance(i, j, w, h, var)) + 1e-6;
+        const vec3& np = aov.normal[p];
+        const double zp = aov.depth[p];
+        const int mp = aov.material_id[p];
+
+        color sum(0,0,0);
+        double weight_sum = 0, var_sum = 0;
+
+        for (int dy = -2; dy <= 2; dy++) {
+            int y = j + dy * step;
+            if (y < 0 || y >= h) continue;
+            for (int dx = -2; dx <= 2; dx++) {
+                int x = i + dx * step;
+                if (x < 0 || x >= w) continue;
+                const size_t q = size_t(y) * w + x;
+
+                double weight = kernel[std::abs(dx)] * kernel[std::abs(dy)];
+                if (q != p) {
+                    if (aov.material_id[q] != mp) continue;
+
+                    double wl = std::fabs(lp - aov_buffers::luminance(in[q])) / sigma_l;
+                    double wz = 0;
+                    if (zp < infinity) {
+                        double tolerance = sigma_depth * zp * step * std::max(std::abs(dx), std::abs(dy));
+                        wz = std::fabs(zp - aov.depth[q]) / tolerance;
+                    }
+                    double wn = np.near_zero() ? 1.0
+                              : std::pow(std::max(0.0, dot(np, aov.normal[q])), sigma_normal);
+                    weight *= wn * std::exp(-wl - wz);
+                }
+
+                sum += weight * in[q];
+                weight_sum += weight;
+                var_sum += weight * weight * var[q];
+            }
+        }
+
+        out[p] = sum / weight_sum;
+        out_var[p] = var_sum / (weight_sum * weight_sum);
+    }
+
+    // 3x3 Gaussian of the variance, stabilises the luminance weight at low spp
+    static double blurred_variance(int i, int j, int w, int h, const std::vector<double>& var) {
+        static const double kernel[2] = { 1.0 / 2.0, 1.0 / 4.0 };
+        double sum = 0, weight_sum = 0;
+        for (int dy = -1; dy <= 1; dy++) {
+            int y = j + dy;
+            if (y < 0 || y >= h) continue;
+            for (int dx = -1; dx <= 1; dx++) {
+                int x = i + dx;
+                if (x < 0 || x >= w) continue;
+                double k = kernel[std::abs(dx)] * kernel[std::abs(dy)];
+                sum += k * var[size_t(y) * w + x];
+                weight_sum += k;
+            }
+        }
+        return sum / weight_sum;
+    }
+};
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef FAST_MATH_H
+#define FAST_MATH_H
+
+#include "wicked.h"
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+
+// Approximations of the libm functions the shading hot path calls, compiled in with
+// -DWICKED_FAST_MATH (make raytracer_fast). Each is straight-line arithmetic: range
+// reduction by bit manipulation or selects, then one polynomial, no tables, no branches
+// and no fmin/fmax/floor (libm calls or NaN rules SSE2 lacks), so loops over them
+// vectorize. Without WICKED_FAST_MATH the math_* wrappers call libm and the
+// approximations are only used by the bench, which checks their worst-case error
+// against the bounds below.
+#ifdef WICKED_FAST_MATH
+constexpr bool fast_math_enabled = true;
+#else
+constexpr bool fast_math_enabled = false;
+#endif
+
+
+
+// Worst-case absolute error over the whole domain, as wicked_bench verifies it
+constexpr double fast_acos_max_error = 5e-8;   // Radians, x in [-1, 1]
+constexpr double fast_atan2_max_error = 5e-8;  // Radians
+constexpr double fast_sin_max_error = 1e-10;   // |x| up to 1e4
+constexpr double fast_log_max_error = 1e-11;   // x in (0, 1], as random_double() draws it
+constexpr double pow5_max_error = 1e-15;       // x in [0, 1]
+
+
+
+
+
+// Abramowitz & Stegun 4.4.46: acos(a) = sqrt(1 - a) * p(a) for a in [0, 1], mirrored
+// for negative x. Inputs outside [-1, 1] are clamped, as rounding can put them there.
+inline double fast_acos(double x) {
+    double a = std::fabs(x);
+    a = a < 1.0 ? a : 1.0;
+    double p = -0.0012624911;
+    p = p * a + 0.0066700901;
+    p = p * a - 0.0170881256;
+    p = p * a + 0.0308918810;
+    p = p * a - 0.0501743046;
+    p = p * a + 0.0889789874;
+    p = p * a - 0.2145988016;
+    p = p * a + 1.5707963050;
+    double r = std::sqrt(1.0 - a) * p;
+    return x < 0 ? pi - r : r;
+}
+
+// Abramowitz & Stegun 4.4.49 on min/max of |x| and |y|, then unfolded into the right
+// octant. Like std::atan2 the result is in [-pi, pi], with the sign of y (including -0).
+inline double fast_atan2(double y, double x) {
+    double ax = std::fabs(x), ay = std::fabs(y);
+    double hi = ax > ay ? ax : ay, lo = ax > ay ? ay : ax;
+    double t = hi > 0 ? lo / hi : 0.0;
+    double t2 = t * t;
+    double p = 0.0028662257;
+    p = p * t2 - 0.0161657367;
+    p = p * t2 + 0.0429096138;
+    p = p * t2 - 0.0752896400;
+    p = p * t2 + 0.1065626393;
+    p = p * t2 - 0.1420889944;
+    p = p * t2 + 0.1999355085;
+    p = p * t2 - 0.3333314528;
+    double r = t + t * t2 * p;
+    r = ay > ax ? 0.5 * pi - r : r;
+    r = x < 0 ? pi - r : r;
+    return std::copysign(r, y);
+}
+
+// Reduced to [-pi, pi] with 2 pi split in two parts, folded to [-pi/2, pi/2] by
+// sin(x) = sin(pi - x), then the odd Taylor polynomial to x^15. The nearest multiple of
+// 2 pi comes from adding and subtracting 1.5 * 2^52, which rounds to an integer (|x| < 2^50).
+inline double fast_sin(double x) {
+    const double two_pi_hi = 6.28318530717958623200;
+    const double two_pi_lo = 2.44929359829470635445e-16;
+    const double round_magic = 6755399441055744.0;
+    double k = (x * (1.0 / (2 * pi)) + round_magic) - round_magic;
+    double r = (x - k * two_pi_hi) - k * two_pi_lo;
+    r = r > 0.5 * pi ? pi - r : r;
+    r = r < -0.5 * pi ? -pi - r : r;
+    double r2 = r * r;
+    double p = -1.0 / 1307674368000.0;
+    p = p * r2 + 1.0 / 6227020800.0;
+    p = p * r2 - 1.0 / 39916800.0;
+    p = p * r2 + 1.0 / 362880.0;
+    p = p * r2 - 1.0 / 5040.0;
+    p = p * r2 + 1.0 / 120.0;
+    p = p * r2 - 1.0 / 6.0;
+    return r + r * r2 * p;
+}
+
+// x = 2^e * m with m in [sqrt(1/2), sqrt(2)) from the exponent bits, then
+// log(m) = 2 atanh(s), s = (m - 1) / (m + 1), as a series in s^2 (|s| <= 0.172).
+// The exponent becomes a double by placing it in the mantissa of 2^52 (SSE2 has no
+// 64-bit integer conversion). For positive normal x; 0 and below give -infinity.
+inline double fast_log(double x) {
+    std::uint64_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    std::uint64_t exponent_bits = (bits >> 52) | 0x4330000000000000ull;  // x > 0: no sign bit
+    std::uint64_t mantissa_bits = (bits & 0x000fffffffffffffull) | 0x3ff0000000000000ull;
+    double e, m;
+    std::memcpy(&e, &exponent_bits, sizeof(e));
+    std::memcpy(&m, &mantissa_bits, sizeof(m));
+    e -= 4503599627370496.0 + 1023;
+    bool high = m > 1.4142135623730951;
+    m = high ? 0.5 * m : m;
+    e = high ? e + 1 : e;
+
+    double s = (m - 1) / (m + 1);
+    double s2 = s * s;
+    double p = 1.0 / 13;
+    p = p * s2 + 1.0 / 11;
+    p = p * s2 + 1.0 / 9;
+    p = p * s2 + 1.0 / 7;
+    p = p * s2 + 1.0 / 5;
+    p = p * s2 + 1.0 / 3;
+    double r = e * 0.69314718055994530942 + 2 * s * (1 + s2 * p);
+    return x > 0 ? r : -infinity;
+}
+
+// x^5 by three multiplications instead of a general pow
+inline double pow5(double x) {
+    double x2 = x * x;
+    return x2 * x2 * x;
+}
+
+
+
+
+
+// What the hot path calls: the approximations with WICKED_FAST_MATH, libm otherwise.
+// sqrt has no wrapper: with -fno-math-errno std::sqrt is a single instruction already.
+#ifdef WICKED_FAST_MATH
+inline double math_acos(double x) { return fast_acos(x); }
+inline double math_atan2(double y, double x) { return fast_atan2(y, x); }
+inline double math_sin(double x) { return fast_sin(x); }
+inline double math_log(double x) { return fast_log(x); }
+inline double math_pow5(double x) { return pow5(x); }
+#else
+inline double math_acos(double x) { return std::acos(x); }
+inline double math_atan2(double y, double x) { return std::atan2(y, x); }
+inline double math_sin(double x) { return std::sin(x); }
+inline double math_log(double x) { return std::log(x); }
+inline double math_pow5(double x) { return std::pow(x, 5); }
+#endif
+
+#endif
@@ -3,21 +3,101 @@
 
 #include "wicked.h"
 #include "aabb.h"
+#include "stats.h"
 
 class material;
+class hittable;
 
 
-// Stores info on a ray-object intersection
+// Object-to-world transform of an instanced hit: a rotation about Y, then an offset.
+// Instancing wrappers compose into it as intersect() returns through them.
+struct hit_transform {
+    bool identity = true;
+    double sin_theta = 0;
+    double cos_theta = 1;
+    vec3 offset = vec3(0,0,0);
+
+    vec3 rotate(const vec3& v) const {
+        return vec3(cos_theta*v.x() + sin_theta*v.z(), v.y(), -sin_theta*v.x() + cos_theta*v.z());
+    }
+
+    vec3 unrotate(const vec3& v) const {
+        return vec3(cos_theta*v.x() - sin_theta*v.z(), v.y(), sin_theta*v.x() + cos_theta*v.z());
+    }
+
+    ray to_local(const ray& r) const {
+        return ray(unrotate(r.origin() - offset), unrotate(r.direction()), r.time());
+    }
+
+    // Applies a further rotation about Y after this transform
+    void rotate_by(double sin_angle, double cos_angle) {
+        hit_transform outer;
+        outer.sin_theta = sin_angle;
+        outer.cos_theta = cos_angle;
+        offset = outer.rotate(offset);
+        double s = sin_angle*cos_theta + cos_angle*sin_theta;
+        cos_theta = cos_angle*cos_theta - sin_angle*sin_theta;
+        sin_theta = s;
+        identity = false;
+    }
+
+    void translate_by(const vec3& v) {
+        offset += v;
+        identity = false;
+    }
+};
+
+
+
+
+
+// What a scene uses of the features camera::render() specializes its sample kernel on.
+// Each hittable reports its own, containers and wrappers combine their children's.
+struct scene_features {
+    bool motion_blur = false;  // Something moves during the shutter interval
+    bool emission = false;     // Some material can emit light
+
+    // For hittables that do not report their own: assume everything
+    static scene_features all() { return scene_features{true, true}; }
+
+    scene_features& operator|=(const scene_features& f) {
+        motion_blur = motion_blur || f.motion_blur;
+        emission = emission || f.emission;
+        return *this;
+    }
+};
+
+
+
+
+
+// Stores info on a ray-object intersection.
+// intersect() only records t, the primitive and its hit parameters; p, normal, material
+// and UVs are filled by the primitive's finalize_hit() once the closest hit is known.
 class hit_record {
 public:
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat;
+    const material* mat = nullptr;  // Owned by the primitive
     double t;
-    double u;  // Textured spheres/triangles need UV coordinates
-    double v;
+    double u = 0;  // Textured spheres/triangles need UV coordinates, 0 when not computed
+    double v = 0;
     bool front_face;
 
+    const hittable* object = nullptr;  // Primitive that recorded the hit
+    double b1 = 0, b2 = 0;             // Its hit parameters, e.g. barycentrics
+    double t_min = 0;                  // Lower end of the query interval t was found in
+    hit_transform to_world;            // Primitive space to world space
+
+    // Called by primitives from intersect() when they find a closer hit
+    void record(double hit_t, const hittable* hit_object, double param1 = 0, double param2 = 0) {
+        t = hit_t;
+        object = hit_object;
+        b1 = param1;
+        b2 = param2;
+        to_world = hit_transform();
+    }
+
     void set_face_normal(const ray& r, const vec3& outward_normal) {
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal : -outward_normal;
@@ -33,8 +113,53 @@ class hittable {
 public:
     virtual ~hittable() = default;
 
-    virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
     virtual aabb bounding_box() const = 0;
+
+
+
+    // Closest hit with all surface attributes: intersect(), then finalize_hit() once,
+    // on the winning primitive only
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const {
+        if (!intersect(r, ray_t, rec))
+            return false;
+
+        if (rec.to_world.identity) {
+            rec.object->finalize_hit(r, rec);
+            return true;
+        }
+
+        rec.object->finalize_hit(rec.to_world.to_local(r), rec);
+        rec.p = rec.to_world.rotate(rec.p) + rec.to_world.offset;
+        rec.normal = rec.to_world.rotate(rec.normal);
+        return true;
+    }
+
+    // Closest-hit search: on a hit closer than ray_t.max, records t, the primitive and
+    // its hit parameters in rec (see hit_record::record) and returns true
+    virtual bool intersect(const ray& r, interval ray_t, hit_record& rec) const = 0;
+
+    // Fills p, normal, front face, material, and UVs when the material samples textures,
+    // for a hit this primitive recorded. The ray is in the primitive's own space.
+    virtual void finalize_hit(const ray&, hit_record&) const {}
+
+
+
+    // Any-hit query for shadow and visibility rays: true as soon as anything blocks the
+    // ray within ray_t. Nothing is written back, so primitives skip the normal, UVs and
+    // material. The default runs intersect() into a scratch record.
+    virtual bool occluded(const ray& r, interval ray_t) const {
+        hit_record rec;
+        return intersect(r, ray_t, rec);
+    }
+
+    // Fraction of light that gets through ray_t: 0 behind a surface, in between for
+    // participating media. Containers multiply the transmittance of their children.
+    virtual double transmittance(const ray& r, interval ray_t) const {
+        return occluded(r, ray_t) ? 0.0 : 1.0;
+    }
+
+    // Features this object needs the camera's kernel to handle; the default is all of them
+    virtual scene_features features() const { return scene_features::all(); }
 };
 
 
@@ -45,19 +170,30 @@ class translate : public hittable {
 public:
     translate(shared_ptr<hittable> object, const vec3& offset)
         : object(object), offset(offset) {
+        // Infinite ends stay infinite under the offset, so unbounded boxes carry through
         bbox = object->bounding_box() + offset;
     }
 
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+    bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
         ray offset_r(r.origin() - offset, r.direction(), r.time());
 
-        if (!object->hit(offset_r, ray_t, rec))
+        if (!object->intersect(offset_r, ray_t, rec))
             return false;
 
-        rec.p += offset;
+        rec.to_world.translate_by(offset);
         return true;
     }
 
+    bool occluded(const ray& r, interval ray_t) const override {
+        return object->occluded(ray(r.origin() - offset, r.direction(), r.time()), ray_t);
+    }
+
+    double transmittance(const ray& r, interval ray_t) const override {
+        return object->transmittance(ray(r.origin() - offset, r.direction(), r.time()), ray_t);
+    }
+
+    scene_features features() const override { return object->features(); }
+
     aabb bounding_box() const override { return bbox; }
 
 
@@ -80,70 +216,55 @@ public:
         cos_theta = std::cos(radians);
         bbox = object->bounding_box();
 
-        point3 min(infinity, infinity, infinity);
-        point3 max(-infinity, -infinity, -infinity);
+        // The rotation leaves y alone. An unbounded x or z (an infinite plane) would turn
+        // the corners below into inf - inf = NaN, so the rotated box is unbounded there.
+        if (bbox.x.size() == infinity || bbox.z.size() == infinity) {
+            bbox = aabb(interval::universe, bbox.y, interval::universe);
+            return;
+        }
+
+        interval new_x, new_z;
 
         for (int i = 0; i < 2; i++) {
-            for (int j = 0; j < 2; j++) {
-                for (int k = 0; k < 2; k++) {
-                    auto x = i*bbox.x.max + (1-i)*bbox.x.min;
-                    auto y = j*bbox.y.max + (1-j)*bbox.y.min;
-                    auto z = k*bbox.z.max + (1-k)*bbox.z.min;
-
-                    auto newx =  cos_theta*x + sin_theta*z;
-                    auto newz = -sin_theta*x + cos_theta*z;
-
-                    vec3 tester(newx, y, newz);
-
-                    for (int c = 0; c < 3; c++) {
-                        min[c] = std::fmin(min[c], tester[c]);
-                        max[c] = std::fmax(max[c], tester[c]);
-                    }
-                }
+            for (int k = 0; k < 2; k++) {
+                auto x = i*bbox.x.max + (1-i)*bbox.x.min;
+                auto z = k*bbox.z.max + (1-k)*bbox.z.min;
+
+                auto newx =  cos_theta*x + sin_theta*z;
+                auto newz = -sin_theta*x + cos_theta*z;
+
+                new_x = interval(new_x, interval(newx, newx));
+                new_z = interval(new_z, interval(newz, newz));
             }
         }
 
-        bbox = aabb(min, max);
+        bbox = aabb(new_x, bbox.y, new_z);
     }
 
 
 
 
 
-    // Rotate ray into object space, test hit, rotate result back
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        auto origin = point3(
-            cos_theta*r.origin().x() - sin_theta*r.origin().z(),
-            r.origin().y(),
-            sin_theta*r.origin().x() + cos_theta*r.origin().z()
-        );
-
-        auto direction = vec3(
-            cos_theta*r.direction().x() - sin_theta*r.direction().z(),
-            r.direction().y(),
-            sin_theta*r.direction().x() + cos_theta*r.direction().z()
-        );
-
-        ray rotated_r(origin, direction, r.time());
-
-        if (!object->hit(rotated_r, ray_t, rec))
+    // Rotate ray into object space and test it; the hit point and normal are rotated
+    // back when the hit is finalized
+    bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (!object->intersect(to_object(r), ray_t, rec))
             return false;
 
-        rec.p = point3(
-            cos_theta*rec.p.x() + sin_theta*rec.p.z(),
-            rec.p.y(),
-           -sin_theta*rec.p.x() + cos_theta*rec.p.z()
-        );
+        rec.to_world.rotate_by(sin_theta, cos_theta);
+        return true;
+    }
 
-        rec.normal = vec3(
-            cos_theta*rec.normal.x() + sin_theta*rec.normal.z(),
-            rec.normal.y(),
-           -sin_theta*rec.normal.x() + cos_theta*rec.normal.z()
-        );
+    bool occluded(const ray& r, interval ray_t) const override {
+        return object->occluded(to_object(r), ray_t);
+    }
 
-        return true;
+    double transmittance(const ray& r, interval ray_t) const override {
+        return object->transmittance(to_object(r), ray_t);
     }
 
+    scene_features features() const override { return object->features(); }
+
     aabb bounding_box() const override { return bbox; }
 
 
@@ -153,6 +274,22 @@ private:
     double sin_theta;
     double cos_theta;
     aabb bbox;
+
+    ray to_object(const ray& r) const {
+        auto origin = point3(
+            cos_theta*r.origin().x() - sin_theta*r.origin().z(),
+            r.origin().y(),
+            sin_theta*r.origin().x() + cos_theta*r.origin().z()
+        );
+
+        auto direction = vec3(
+            cos_theta*r.direction().x() - sin_theta*r.direction().z(),
+            r.direction().y(),
+            sin_theta*r.direction().x() + cos_theta*r.direction().z()
+        );
+
+        return ray(origin, direction, r.time());
+    }
 };
 
 #endif
\ No newline at end of file
@@ -21,23 +21,46 @@ public:
 
 
 
-    // Tests ray intersection with all objects, return closest hit
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        hit_record temp_rec;
+    // Tests ray intersection with all objects, records the closest hit
+    bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
         bool hit_anything = false;
         auto closest_so_far = ray_t.max;
 
         for (const auto& object : objects) {
-            if (object->hit(r, interval(ray_t.min, closest_so_far), temp_rec)) {
+            if (object->intersect(r, interval(ray_t.min, closest_so_far), rec)) {
                 hit_anything = true;
-                closest_so_far = temp_rec.t;
-                rec = temp_rec;
+                closest_so_far = rec.t;
             }
         }
 
         return hit_anything;
     }
 
+    // Stops at the first object that blocks the ray
+    bool occluded(const ray& r, interval ray_t) const override {
+        for (const auto& object : objects)
+            if (object->occluded(r, ray_t))
+                return true;
+        return false;
+    }
+
+    double transmittance(const ray& r, interval ray_t) const override {
+        double result = 1.0;
+        for (const auto& object : objects) {
+            result *= object->transmittance(r, ray_t);
+            if (result <= 0)
+                break;
+        }
+        return result;
+    }
+
+    scene_features features() const override {
+        scene_features combined;
+        for (const auto& object : objects)
+            combined |= object->features();
+        return combined;
+    }
+
 
     // Bounding box containing all objects
     aabb bounding_box() const override { return bbox; }
@@ -0,0 +1,463 @@
+#ifndef INDEXED_MESH_H
+#define INDEXED_MESH_H
+
+#include "hittable.h"
+#include "material.h"
+#include "triangle.h"
+#include "triangle_mesh.h"
+#include "bvh_build.h"
+#include "lbvh_build.h"
+#include "bvh_wide.h"
+#include "arena.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+
+// Unit vector as two 16-bit fixed point coordinates on the octahedron (Cigolle et al. 2014)
+inline std::uint32_t octahedral_encode(const vec3& n) {
+    double l1 = std::fabs(n.x()) + std::fabs(n.y()) + std::fabs(n.z());
+    if (l1 <= 0)
+        return octahedral_encode(vec3(0, 0, 1));
+    double x = n.x() / l1, y = n.y() / l1;
+    if (n.z() < 0) {
+        double folded_x = (1 - std::fabs(y)) * (x >= 0 ? 1 : -1);
+        double folded_y = (1 - std::fabs(x)) * (y >= 0 ? 1 : -1);
+        x = folded_x;
+        y = folded_y;
+    }
+    auto snorm = [](double v) {
+        return std::uint16_t(std::int16_t(std::lround(std::fmin(std::fmax(v, -1.0), 1.0) * 32767)));
+    };
+    return std::uint32_t(snorm(x)) | (std::uint32_t(snorm(y)) << 16);
+}
+
+inline vec3 octahedral_decode(std::uint32_t packed) {
+    double x = std::int16_t(packed & 0xFFFF) / 32767.0;
+    double y = std::int16_t(packed >> 16) / 32767.0;
+    double z = 1 - std::fabs(x) - std::fabs(y);
+    if (z < 0) {
+        double unfolded_x = (1 - std::fabs(y)) * (x >= 0 ? 1 : -1);
+        double unfolded_y = (1 - std::fabs(x)) * (y >= 0 ? 1 : -1);
+        x = unfolded_x;
+        y = unfolded_y;
+    }
+    return unit_vector(vec3(x, y, z));
+}
+
+// IEEE half precision, rounded to nearest even; enough for texture coordinates
+inline std::uint16_t half_from_float(float f) {
+    std::uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    std::uint32_t sign = (bits >> 16) & 0x8000;
+    std::uint32_t magnitude = bits & 0x7FFFFFFF;
+
+    if (magnitude >= 0x7F800000)  // Infinity, NaN
+        return std::uint16_t(sign | 0x7C00 | (magnitude > 0x7F800000 ? 0x200 : 0));
+    if (magnitude >= 0x477FF000)  // Rounds past 65504
+        return std::uint16_t(sign | 0x7C00);
+    if (magnitude < 0x38800000) {  // Below 2^-14: subnormal half
+        float value;
+        std::memcpy(&value, &magnitude, sizeof(value));
+        return std::uint16_t(sign | std::uint32_t(std::nearbyint(value * 16777216.0f)));
+    }
+    std::uint32_t rounded = magnitude + 0xFFF + ((magnitude >> 13) & 1);
+    return std::uint16_t(sign | ((rounded - 0x38000000) >> 13));
+}
+
+inline float float_from_half(std::uint16_t h) {
+    std::uint32_t sign = std::uint32_t(h & 0x8000) << 16;
+    std::uint32_t exponent = (h >> 10) & 0x1F;
+    std::uint32_t mantissa = h & 0x3FF;
+    if (exponent == 0) {
+        float value = mantissa / 16777216.0f;
+        return sign ? -value : value;
+    }
+    std::uint32_t bits = exponent == 31 ? (sign | 0x7F800000 | (mantissa << 13))
+                                        : (sign | ((exponent + 112) << 23) | (mantissa << 13));
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+
+
+
+
+// Indexed triangle mesh with compressed storage, for large scanned assets. Positions are
+// 16-bit fixed point within the mesh's box, normals octahedral in two 16-bit values and
+// UVs half floats. Vertices are renumbered in the order the BVH leaves first use them,
+// so each leaf stores its corners as 16-bit deltas from its smallest vertex index.
+// Intersection decodes a leaf into the float groups of triangle_mesh and runs the same
+// watertight test; finalize_hit decodes normals and UVs of the winning triangle only.
+// The mesh traced is the quantized one: shared vertices decode to the same point, so it
+// stays watertight.
+// Call add_vertex() and add_triangle(), then build() once before rendering.
+class indexed_mesh : public hittable {
+public:
+    static constexpr int group_width = triangle_mesh::group_width;
+
+
+
+    // Returns the vertex index. Vertices without a normal get the average of their faces'
+    // normals if any vertex of the mesh has one; a mesh without any is shaded flat.
+    int add_vertex(const point3& p) {
+        pending_vertices.push_back(pending_vertex{p, vec3(0,0,0), 0, 0, false});
+        return int(pending_vertices.size()) - 1;
+    }
+
+    int add_vertex(const point3& p, const vec3& normal) {
+        has_normals = true;
+        pending_vertices.push_back(pending_vertex{p, normal, 0, 0, true});
+        return int(pending_vertices.size()) - 1;
+    }
+
+    int add_vertex(const point3& p, const vec3& normal, double u, double v) {
+        has_normals = true;
+        has_uvs = true;
+        pending_vertices.push_back(pending_vertex{p, normal, u, v, true});
+        return int(pending_vertices.size()) - 1;
+    }
+
+    // Corners are indices returned by add_vertex()
+    void add_triangle(int a, int b, int c, shared_ptr<material> mat) {
+        auto found = material_lookup.find(mat.get());
+        std::uint16_t index;
+        if (found != material_lookup.end()) {
+            index = found->second;
+        } else if (materials.size() > 0xFFFF) {
+            std::cerr << "ERROR: indexed_mesh holds at most 65536 materials, using the last one\n";
+            index = 0xFFFF;
+        } else {
+            index = std::uint16_t(materials.size());
+            material_lookup.emplace(mat.get(), index);
+            materials.push_back(mat);
+        }
+        pending_triangles.push_back(pending_triangle{{a, b, c}, index});
+    }
+
+    size_t vertex_count() const { return positions.empty() ? pending_vertices.size() : positions.size(); }
+    size_t material_count() const { return materials.size(); }
+
+
+
+    void build(const bvh_build_options& options = bvh_build_options()) {
+        size_t n = pending_triangles.size();
+        triangle_count = n;
+        positions.clear();
+        normals.clear();
+        uvs.clear();
+        groups.clear();
+        escaped_indices.clear();
+        tree.clear();
+        bbox = aabb::empty;
+        if (n == 0) return;
+
+        fill_missing_normals();
+
+        // Quantize first: the BVH has to bound the triangles as they will be decoded
+        aabb vertex_box = aabb::empty;
+        for (const auto& v : pending_vertices)
+            vertex_box = aabb(vertex_box, aabb(v.p, v.p));
+        for (int a = 0; a < 3; a++) {
+            const auto& extent = vertex_box.axis_interval(a);
+            origin[a] = float(extent.min);
+            scale[a] = extent.size() > 0 ? float(extent.size() / 65535) : 0.0f;
+        }
+        std::vector<quantized_position> quantized(pending_vertices.size());
+        for (size_t i = 0; i < pending_vertices.size(); i++) {
+            for (int a = 0; a < 3; a++) {
+                double steps = scale[a] > 0 ? (pending_vertices[i].p[a] - origin[a]) / scale[a] : 0.0;
+                quantized[i].q[a] = std::uint16_t(std::lround(std::fmin(std::fmax(steps, 0.0), 65535.0)));
+            }
+        }
+
+        std::vector<aabb> bounds(n);
+        for (size_t i = 0; i < n; i++) {
+            const auto& tri = pending_triangles[i];
+            point3 v0 = decode(quantized[tri.v[0]]);
+            point3 v1 = decode(quantized[tri.v[1]]);
+            point3 v2 = decode(quantized[tri.v[2]]);
+            bounds[i] = aabb(aabb(v0, v1), aabb(v2, v2)).pad();
+        }
+
+        bvh_build_options leaf_options = options;
+        leaf_options.max_leaf_size = group_width;
+        leaf_options.leaf_group = group_width;
+        std::vector<bvh_flat_node> nodes;
+        std::vector<int> order;
+        if (options.method == bvh_method::lbvh)
+            lbvh_builder(bounds, leaf_options).build(nodes, order);
+        else
+            bvh_builder(bounds, leaf_options).build(nodes, order);
+
+        // Renumber vertices in the order the leaves first use them
+        std::vector<int> renumbered(pending_vertices.size(), -1);
+        int next_vertex = 0;
+        for (int index : order)
+            for (int corner : pending_triangles[index].v)
+                if (renumbered[corner] < 0)
+                    renumbered[corner] = next_vertex++;
+
+        positions.resize(next_vertex);
+        if (has_normals) normals.resize(next_vertex);
+        if (has_uvs) uvs.resize(next_vertex);
+        for (size_t i = 0; i < pending_vertices.size(); i++) {
+            int k = renumbered[i];
+            if (k < 0) continue;  // Unused vertex
+            const auto& v = pending_vertices[i];
+            positions[k] = quantized[i];
+            if (has_normals)
+                normals[k] = octahedral_encode(v.normal);
+            if (has_uvs)
+                uvs[k] = std::uint32_t(half_from_float(float(v.u))) | (std::uint32_t(half_from_float(float(v.v))) << 16);
+        }
+
+        // Leaves become index groups, with full indices for the rare leaf spanning more
+        for (auto& node : nodes) {
+            if (!node.is_leaf()) continue;
+
+            index_group g = {};
+            g.count = std::uint8_t(node.count);
+            int lowest = std::numeric_limits<int>::max(), highest = 0;
+            for (int k = 0; k < node.count; k++) {
+                const auto& tri = pending_triangles[order[node.start + k]];
+                g.material[k] = tri.material;
+                for (int corner : tri.v) {
+                    lowest = std::min(lowest, renumbered[corner]);
+                    highest = std::max(highest, renumbered[corner]);
+                }
+            }
+
+            g.escaped = highest - lowest > 65535;
+            g.base = g.escaped ? std::uint32_t(escaped_indices.size()) : std::uint32_t(lowest);
+            if (g.escaped)
+                escaped_indices.resize(escaped_indices.size() + 3 * group_width, 0);
+            for (int k = 0; k < node.count; k++) {
+                const auto& tri = pending_triangles[order[node.start + k]];
+                for (int corner = 0; corner < 3; corner++) {
+                    int vertex = renumbered[tri.v[corner]];
+                    if (g.escaped)
+                        escaped_indices[g.base + corner * group_width + k] = std::uint32_t(vertex);
+                    else
+                        g.delta[corner][k] = std::uint16_t(vertex - lowest);
+                }
+            }
+
+            node.start = int(groups.size());
+            node.count = 1;
+            groups.push_back(g);
+        }
+
+        bbox = nodes[0].bbox;
+        tree.assign(std::move(nodes), options);
+        pending_vertices.clear();
+        pending_vertices.shrink_to_fit();
+        pending_triangles.clear();
+        pending_triangles.shrink_to_fit();
+        material_lookup.clear();
+        scene_memory().add(memory_category::geometry, memory_bytes() - tree.memory_bytes());
+    }
+
+
+
+    size_t size() const { return triangle_count; }
+
+    // Bytes held after build(): vertices, index groups and BVH nodes
+    size_t memory_bytes() const {
+        return positions.size() * sizeof(quantized_position)
+             + normals.size() * sizeof(std::uint32_t)
+             + uvs.size() * sizeof(std::uint32_t)
+             + groups.size() * sizeof(index_group)
+             + escaped_indices.size() * sizeof(std::uint32_t)
+             + tree.memory_bytes()
+             + materials.size() * sizeof(shared_ptr<material>);
+    }
+
+    double bytes_per_triangle() const {
+        return triangle_count ? double(memory_bytes()) / triangle_count : 0.0;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    scene_features features() const override {
+        scene_features features;
+        for (const auto& mat : materials)
+            features |= material_features(mat);
+        return features;
+    }
+
+
+
+
+
+    bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
+        triangle_mesh::group_ray gr(r);
+        triangle_mesh::triangle_group decoded;
+        bool hit_anything = false;
+
+        tree.traverse(r, ray_t, [&](int group) {
+            decode_group(group, decoded);
+            float t;
+            int lane = triangle_mesh::nearest_in_group(decoded, gr, ray_t, t);
+            if (lane < 0)
+                return false;
+            rec.record(t, this, double(group * group_width + lane));
+            rec.t_min = ray_t.min;
+            ray_t.max = t;
+            hit_anything = true;
+            return false;
+        });
+
+        return hit_anything;
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override {
+        triangle_mesh::group_ray gr(r);
+        triangle_mesh::triangle_group decoded;
+        return tree.traverse(r, ray_t, [&](int group) {
+            decode_group(group, decoded);
+            float t;
+            return triangle_mesh::nearest_in_group(decoded, gr, ray_t, t) >= 0;
+        });
+    }
+
+    // Redoes the winning triangle's test in double for t and the barycentrics, then
+    // decodes and interpolates its normals and UVs (the barycentrics without UVs). As in
+    // triangle_mesh, the float t is kept if the double t is not above the query's t_min.
+    void finalize_hit(const ray& r, hit_record& rec) const override {
+        int slot = int(rec.b1);
+        const auto& g = groups[slot / group_width];
+        int lane = slot % group_width;
+        int corners[3];
+        for (int corner = 0; corner < 3; corner++)
+            corners[corner] = vertex_index(g, corner, lane);
+        point3 v0 = decode(positions[corners[0]]);
+        point3 v1 = decode(positions[corners[1]]);
+        point3 v2 = decode(positions[corners[2]]);
+
+        double t, u = 1.0 / 3, v = 1.0 / 3;
+        if (watertight_hit(r, watertight_ray(r.direction()), v0, v1, v2, t, u, v) && t > rec.t_min)
+            rec.t = t;
+        double w = 1.0 - u - v;
+
+        rec.p = r.at(rec.t);
+        vec3 normal = has_normals
+            ? w * octahedral_decode(normals[corners[0]]) + u * octahedral_decode(normals[corners[1]])
+              + v * octahedral_decode(normals[corners[2]])
+            : cross(v1 - v0, v2 - v0);
+        rec.set_face_normal(r, unit_vector(normal));
+
+        if (has_uvs) {
+            auto uv = [&](int corner, int half) {
+                return double(float_from_half(std::uint16_t(uvs[corners[corner]] >> (16 * half))));
+            };
+            rec.u = w * uv(0, 0) + u * uv(1, 0) + v * uv(2, 0);
+            rec.v = w * uv(0, 1) + u * uv(1, 1) + v * uv(2, 1);
+        } else {
+            rec.u = u;
+            rec.v = v;
+        }
+        rec.mat = materials[g.material[lane]].get();
+    }
+
+
+
+private:
+    struct pending_vertex {
+        point3 p;
+        vec3 normal;
+        double u, v;
+        bool has_normal;
+    };
+
+    struct pending_triangle {
+        int v[3];
+        std::uint16_t material;
+    };
+
+    struct quantized_position {
+        std::uint16_t q[3];
+    };
+
+    // One BVH leaf: up to group_width triangles
+    struct index_group {
+        std::uint32_t base;                    // Smallest corner index, or offset in escaped_indices
+        std::uint16_t delta[3][group_width];   // Corner index minus base, per corner then lane
+        std::uint16_t material[group_width];
+        std::uint8_t count;                    // Triangles in the leaf
+        std::uint8_t escaped;                  // Corners span more than 16 bits
+    };
+
+    std::vector<pending_vertex> pending_vertices;  // Until build()
+    std::vector<pending_triangle> pending_triangles;
+    std::unordered_map<const material*, std::uint16_t> material_lookup;
+    bool has_normals = false;
+    bool has_uvs = false;
+
+    float origin[3] = {0, 0, 0};  // Position = origin + q * scale, per axis
+    float scale[3] = {0, 0, 0};
+    std::vector<quantized_position> positions;
+    std::vector<std::uint32_t> normals;            // Octahedral, empty if the mesh has none
+    std::vector<std::uint32_t> uvs;                // Two halves, empty if the mesh has none
+    std::vector<index_group> groups;               // One per BVH leaf
+    std::vector<std::uint32_t> escaped_indices;    // [corner][lane] blocks of escaped groups
+    std::vector<shared_ptr<material>> materials;   // Distinct materials
+    bvh_tree tree;                                 // Leaves reference one group each
+    size_t triangle_count = 0;
+    aabb bbox;
+
+
+
+    // Float arithmetic, so the group test and finalize_hit see exactly the same vertices
+    point3 decode(const quantized_position& p) const {
+        return point3(origin[0] + float(p.q[0]) * scale[0],
+                      origin[1] + float(p.q[1]) * scale[1],
+                      origin[2] + float(p.q[2]) * scale[2]);
+    }
+
+    int vertex_index(const index_group& g, int corner, int lane) const {
+        return g.escaped ? int(escaped_indices[g.base + corner * group_width + lane])
+                         : int(g.base + g.delta[corner][lane]);
+    }
+
+    // Unused lanes are NaN and never hit, as in triangle_mesh
+    void decode_group(int group, triangle_mesh::triangle_group& out) const {
+        const auto& g = groups[group];
+        const float nan = std::numeric_limits<float>::quiet_NaN();
+        int index[3][group_width];
+        for (int corner = 0; corner < 3; corner++)
+            for (int k = 0; k < group_width; k++)
+                index[corner][k] = vertex_index(g, corner, k);  // Unused lanes point at a valid vertex
+
+        for (int corner = 0; corner < 3; corner++)
+            for (int a = 0; a < 3; a++)
+                for (int k = 0; k < group_width; k++) {
+                    float value = origin[a] + float(positions[index[corner][k]].q[a]) * scale[a];
+                    out.v[corner][a][k] = k < g.count ? value : nan;
+                }
+    }
+
+    // Area weighted face normals for vertices added without one, when others have one
+    void fill_missing_normals() {
+        if (!has_normals)
+            return;
+        std::vector<vec3> sums(pending_vertices.size(), vec3(0,0,0));
+        for (const auto& tri : pending_triangles) {
+            const auto& a = pending_vertices[tri.v[0]].p;
+            vec3 face = cross(pending_vertices[tri.v[1]].p - a, pending_vertices[tri.v[2]].p - a);
+            for (int corner : tri.v)
+                sums[corner] += face;
+        }
+        for (size_t i = 0; i < pending_vertices.size(); i++)
+            if (!pending_vertices[i].has_normal && sums[i].length_squared() > 0)
+                pending_vertices[i].normal = unit_vector(sums[i]);
+    }
+};
+
+#endif
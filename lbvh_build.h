@@ -0,0 +1,501 @@
+#ifndef LBVH_BUILD_H
+#define LBVH_BUILD_H
+
+#include "wicked.h"
+#include "aabb.h"
+#include "bvh_build.h"
+#include "parallel.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+
+// Linear BVH builder for interactive edits: primitives are sorted by the Morton code of
+// their centroid with a parallel radix sort, and every internal node of the hierarchy is
+// emitted independently from the sorted codes (Karras 2012). An optional pass rebuilds
+// small treelets with their SAH-optimal topology (Karras & Aila 2013) to recover most of
+// the quality of a full SAH build. Output uses the same flat nodes as bvh_builder.
+class lbvh_builder {
+public:
+    lbvh_builder(const std::vector<aabb>& bounds, const bvh_build_options& options = bvh_build_options(),
+                 task_pool& pool = task_pool::instance())
+        : bounds(bounds), options(options), pool(pool) {}
+
+
+    void build(std::vector<bvh_flat_node>& nodes, std::vector<int>& order) {
+        nodes.clear();
+        order.clear();
+        n = int(bounds.size());
+        if (n == 0) return;
+
+        sort_by_morton_code();
+        emit_hierarchy();
+        compute_bounds();
+        if (options.treelet_size >= 3 && n >= 3)
+            optimize_treelets();
+
+        flatten(nodes, order);
+    }
+
+
+
+    // Primitive indices sorted along the Morton curve of their centroids, for callers that
+    // want spatially coherent clusters rather than a tree
+    std::vector<int> morton_order() {
+        n = int(bounds.size());
+        std::vector<int> order(n);
+        if (n == 0) return order;
+
+        sort_by_morton_code();
+        for (int i = 0; i < n; i++)
+            order[i] = int(keys[i] & 0xFFFFFFFFu);
+        return order;
+    }
+
+
+
+    // 30-bit Morton code of a point in [0,1]^3
+    static std::uint32_t morton_code(double x, double y, double z) {
+        auto quantize = [](double v) {
+            v = std::min(std::max(v * 1024.0, 0.0), 1023.0);
+            return expand_bits(std::uint32_t(v));
+        };
+        return (quantize(x) << 2) | (quantize(y) << 1) | quantize(z);
+    }
+
+
+
+private:
+    static constexpr size_t chunk_size = 16384;
+    static constexpr int max_treelet_size = 7;
+
+    const std::vector<aabb>& bounds;
+    bvh_build_options options;
+    task_pool& pool;
+    int n = 0;
+
+    // Sorted keys: Morton code in the high 32 bits, primitive index in the low 32 bits
+    std::vector<std::uint64_t> keys;
+
+    // Binary radix tree: internal nodes 0..n-2, leaf k is node n-1+k (root is node 0)
+    std::vector<int> left, right, parent;
+    std::vector<aabb> node_bbox;
+    std::vector<double> node_cost;  // SAH cost (area weighted, traversal and test cost 1)
+    std::vector<int> node_prims;    // Primitives below each node
+
+    int leaf_node(int k) const { return n - 1 + k; }
+    bool is_leaf(int node) const { return node >= n - 1; }
+
+    template <typename Body>
+    void for_range(size_t begin, size_t end, size_t grain, const Body& body) {
+        if (options.parallel)
+            parallel_for(pool, begin, end, grain, body);
+        else
+            body(begin, end);
+    }
+
+
+
+    // Spreads the low 10 bits of v so there are two zero bits between each
+    static std::uint32_t expand_bits(std::uint32_t v) {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    static int count_leading_zeros(std::uint32_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+        return x ? __builtin_clz(x) : 32;
+#else
+        int count = 0;
+        for (std::uint32_t bit = 0x80000000u; bit && !(x & bit); bit >>= 1) count++;
+        return count;
+#endif
+    }
+
+
+
+
+
+    void sort_by_morton_code() {
+        aabb centroid_box = aabb::empty;
+        for (const auto& box : bounds) {
+            auto c = bvh_builder::centroid(box);
+            centroid_box = aabb(centroid_box, aabb(c, c));
+        }
+
+        keys.resize(n);
+        for_range(0, n, chunk_size, [&](size_t b, size_t e) {
+            for (size_t i = b; i < e; i++) {
+                auto c = bvh_builder::centroid(bounds[i]);
+                double p[3];
+                for (int a = 0; a < 3; a++) {
+                    const auto& extent = centroid_box.axis_interval(a);
+                    p[a] = extent.size() > 0 ? (c[a] - extent.min) / extent.size() : 0.5;
+                }
+                keys[i] = (std::uint64_t(morton_code(p[0], p[1], p[2])) << 32) | std::uint64_t(i);
+            }
+        });
+
+        radix_sort_codes();
+    }
+
+
+
+    // Stable LSD radix sort on the 30 code bits, 8 bits per pass. Each pass counts digits
+    // per chunk in parallel, prefix sums the counts, then scatters the chunks in parallel.
+    void radix_sort_codes() {
+        std::vector<std::uint64_t> scratch(n);
+        size_t chunks = (size_t(n) + chunk_size - 1) / chunk_size;
+        std::vector<std::uint32_t> counts(chunks * 256);
+
+        for (int shift = 32; shift < 64; shift += 8) {
+            std::fill(counts.begin(), counts.end(), 0);
+
+            for_range(0, chunks, 1, [&](size_t cb, size_t ce) {
+                for (size_t c = cb; c < ce; c++) {
+                    size_t e = std::min(size_t(n), (c + 1) * chunk_size);
+                    for (size_t i = c * chunk_size; i < e; i++)
+                        counts[c * 256 + ((keys[i] >> shift) & 0xFF)]++;
+                }
+            });
+
+            // Exclusive prefix over (digit, chunk) so equal digits keep chunk order
+            std::uint32_t offset = 0;
+            for (int digit = 0; digit < 256; digit++) {
+                for (size_t c = 0; c < chunks; c++) {
+                    auto count = counts[c * 256 + digit];
+                    counts[c * 256 + digit] = offset;
+                    offset += count;
+                }
+            }
+
+            for_range(0, chunks, 1, [&](size_t cb, size_t ce) {
+                for (size_t c = cb; c < ce; c++) {
+                    size_t e = std::min(size_t(n), (c + 1) * chunk_size);
+                    for (size_t i = c * chunk_size; i < e; i++)
+                        scratch[counts[c * 256 + ((keys[i] >> shift) & 0xFF)]++] = keys[i];
+                }
+            });
+
+            keys.swap(scratch);
+        }
+    }
+
+
+
+
+
+    // Length of the common prefix of sorted keys i and j, -1 outside the array.
+    // Duplicate codes fall back to comparing positions, so every key is distinct.
+    int delta(int i, int j) const {
+        if (j < 0 || j >= n) return -1;
+        auto ci = std::uint32_t(keys[i] >> 32), cj = std::uint32_t(keys[j] >> 32);
+        if (ci == cj)
+            return 32 + count_leading_zeros(std::uint32_t(i ^ j));
+        return count_leading_zeros(ci ^ cj);
+    }
+
+    // Every internal node finds its key range and split independently
+    void emit_hierarchy() {
+        int total = 2 * n - 1;
+        left.assign(total, -1);
+        right.assign(total, -1);
+        parent.assign(total, -1);
+
+        for_range(0, size_t(n - 1), chunk_size, [&](size_t b, size_t e) {
+            for (int i = int(b); i < int(e); i++) {
+                int d = (delta(i, i + 1) - delta(i, i - 1)) >= 0 ? 1 : -1;
+                int delta_min = delta(i, i - d);
+
+                int length_max = 2;
+                while (delta(i, i + length_max * d) > delta_min)
+                    length_max *= 2;
+
+                int length = 0;
+                for (int t = length_max / 2; t >= 1; t /= 2) {
+                    if (delta(i, i + (length + t) * d) > delta_min)
+                        length += t;
+                }
+                int j = i + length * d;
+
+                int delta_node = delta(i, j);
+                int split = 0;
+                int t = length;
+                do {
+                    t = (t + 1) / 2;
+                    if (delta(i, i + (split + t) * d) > delta_node)
+                        split += t;
+                } while (t > 1);
+                int gamma = i + split * d + std::min(d, 0);
+
+                int l = (std::min(i, j) == gamma) ? leaf_node(gamma) : gamma;
+                int r = (std::max(i, j) == gamma + 1) ? leaf_node(gamma + 1) : gamma + 1;
+                left[i] = l;
+                right[i] = r;
+                parent[l] = i;
+                parent[r] = i;
+            }
+        });
+    }
+
+
+
+    // Bottom-up in parallel: each leaf climbs towards the root, and the second child to
+    // arrive at a node computes it, so a node is processed once both subtrees are done.
+    template <typename Visit>
+    void bottom_up(const Visit& visit) {
+        std::vector<std::atomic<int>> arrivals(size_t(n > 1 ? n - 1 : 1));
+        for (auto& a : arrivals) a.store(0, std::memory_order_relaxed);
+
+        for_range(0, size_t(n), chunk_size, [&](size_t b, size_t e) {
+            for (int k = int(b); k < int(e); k++) {
+                int node = parent[leaf_node(k)];
+                while (node >= 0) {
+                    if (arrivals[node].fetch_add(1, std::memory_order_acq_rel) == 0)
+                        break;
+                    visit(node);
+                    node = parent[node];
+                }
+            }
+        });
+    }
+
+    void update_node(int node) {
+        int l = left[node], r = right[node];
+        node_bbox[node] = aabb(node_bbox[l], node_bbox[r]);
+        node_prims[node] = node_prims[l] + node_prims[r];
+        node_cost[node] = node_bbox[node].surface_area() + node_cost[l] + node_cost[r];
+    }
+
+    void compute_bounds() {
+        int total = 2 * n - 1;
+        node_bbox.assign(total, aabb::empty);
+        node_cost.assign(total, 0.0);
+        node_prims.assign(total, 0);
+
+        for (int k = 0; k < n; k++) {
+            int node = leaf_node(k);
+            node_bbox[node] = bounds[std::uint32_t(keys[k])];
+            node_prims[node] = 1;
+            node_cost[node] = node_bbox[node].surface_area();
+        }
+
+        bottom_up([&](int node) { update_node(node); });
+    }
+
+
+
+
+
+    // Treelet restructuring: grow a treelet of up to treelet_size leaves below each node
+    // (always expanding the largest leaf), find the topology with the lowest SAH cost by
+    // dynamic programming over leaf subsets, and rewire the treelet's internal nodes.
+    void optimize_treelets() {
+        int size = std::min(options.treelet_size, max_treelet_size);
+        bottom_up([&](int node) { restructure(node, size); });
+    }
+
+    void restructure(int root, int size) {
+        int leaves[max_treelet_size];
+        int internals[max_treelet_size];
+        int leaf_count = 2, internal_count = 1;
+        leaves[0] = left[root];
+        leaves[1] = right[root];
+        internals[0] = root;
+
+        while (leaf_count < size) {
+            int largest = -1;
+            double largest_area = -1;
+            for (int k = 0; k < leaf_count; k++) {
+                if (is_leaf(leaves[k])) continue;
+                double area = node_bbox[leaves[k]].surface_area();
+                if (area > largest_area) {
+                    largest_area = area;
+                    largest = k;
+                }
+            }
+            if (largest < 0) break;
+
+            int expanded = leaves[largest];
+            internals[internal_count++] = expanded;
+            leaves[largest] = left[expanded];
+            leaves[leaf_count++] = right[expanded];
+        }
+        if (leaf_count < 3) return;
+
+        // cost[s] = lowest SAH cost of a subtree over leaf subset s, split[s] = its left half
+        const int subsets = 1 << leaf_count;
+        double cost[1 << max_treelet_size];
+        double area[1 << max_treelet_size];
+        int split[1 << max_treelet_size];
+
+        for (int s = 1; s < subsets; s++) {
+            aabb box = aabb::empty;
+            for (int k = 0; k < leaf_count; k++)
+                if (s & (1 << k)) box = aabb(box, node_bbox[leaves[k]]);
+            area[s] = box.surface_area();
+        }
+
+        for (int s = 1; s < subsets; s++) {
+            if ((s & (s - 1)) == 0) {
+                int k = 0;
+                while (!(s & (1 << k))) k++;
+                cost[s] = node_cost[leaves[k]];
+                continue;
+            }
+
+            // Sub-masks holding the lowest set bit, so each partition is tried once
+            int low = s & -s;
+            double best = infinity;
+            int best_split = 0;
+            for (int p = (s - 1) & s; p > 0; p = (p - 1) & s) {
+                if (!(p & low)) continue;
+                double c = cost[p] + cost[s ^ p];
+                if (c < best) {
+                    best = c;
+                    best_split = p;
+                }
+            }
+            cost[s] = area[s] + best;
+            split[s] = best_split;
+        }
+
+        if (cost[subsets - 1] >= node_cost[root] * (1 - 1e-9))
+            return;
+
+        int next_internal = 1;
+        rebuild(subsets - 1, root, leaves, internals, split, next_internal);
+    }
+
+    int rebuild(int s, int node, const int* leaves, const int* internals, const int* split,
+                int& next_internal) {
+        if ((s & (s - 1)) == 0) {
+            int k = 0;
+            while (!(s & (1 << k))) k++;
+            return leaves[k];
+        }
+
+        int p = split[s];
+        int l = subtree(p, leaves, internals, split, next_internal);
+        int r = subtree(s ^ p, leaves, internals, split, next_internal);
+        left[node] = l;
+        right[node] = r;
+        parent[l] = node;
+        parent[r] = node;
+        update_node(node);
+        return node;
+    }
+
+    int subtree(int s, const int* leaves, const int* internals, const int* split, int& next_internal) {
+        if ((s & (s - 1)) == 0)
+            return rebuild(s, -1, leaves, internals, split, next_internal);
+        int node = internals[next_internal++];
+        return rebuild(s, node, leaves, internals, split, next_internal);
+    }
+
+
+
+
+
+    // Writes flat nodes depth first, collapsing small subtrees into leaves when cheaper
+    void flatten(std::vector<bvh_flat_node>& nodes, std::vector<int>& order) {
+        nodes.reserve(2 * size_t(n));
+        order.reserve(n);
+        nodes.emplace_back();
+        flatten_node(0 == n - 1 ? leaf_node(0) : 0, 0, 0, nodes, order);
+    }
+
+    void flatten_node(int node, int flat_index, int depth, std::vector<bvh_flat_node>& nodes,
+                      std::vector<int>& order) {
+        nodes[flat_index].bbox = node_bbox[node];
+
+        int prims = node_prims[node];
+        bool collapse = is_leaf(node)
+            || (prims <= options.max_leaf_size
+                && options.leaf_cost(prims) * node_bbox[node].surface_area() <= node_cost[node]);
+
+        if (collapse) {
+            nodes[flat_index].start = int(order.size());
+            nodes[flat_index].count = prims;
+            gather_primitives(node, order);
+            return;
+        }
+
+        // Duplicate codes and treelet rotations have no depth bound, so deep subtrees are
+        // replaced by median splits of their primitives in curve order (see bvh_max_depth)
+        if (depth >= bvh_split_depth) {
+            int begin = int(order.size());
+            gather_primitives(node, order);
+            flatten_median(begin, int(order.size()), flat_index, nodes, order);
+            return;
+        }
+
+        int l = left[node], r = right[node];
+        if (flip_children(node_bbox[l], node_bbox[r], nodes[flat_index].axis))
+            std::swap(l, r);
+
+        int left_index = add_children(flat_index, nodes);
+        flatten_node(l, left_index, depth + 1, nodes, order);
+        flatten_node(r, left_index + 1, depth + 1, nodes, order);
+    }
+
+    // Balanced tree over order[begin, end), already written, with the node's bbox set
+    void flatten_median(int begin, int end, int flat_index, std::vector<bvh_flat_node>& nodes,
+                        const std::vector<int>& order) {
+        int count = end - begin;
+        if (count <= options.max_leaf_size) {
+            nodes[flat_index].start = begin;
+            nodes[flat_index].count = count;
+            return;
+        }
+
+        int mid = begin + count / 2;
+        aabb left_box = aabb::empty, right_box = aabb::empty;
+        for (int i = begin; i < mid; i++) left_box = aabb(left_box, bounds[order[i]]);
+        for (int i = mid; i < end; i++) right_box = aabb(right_box, bounds[order[i]]);
+
+        bool flip = flip_children(left_box, right_box, nodes[flat_index].axis);
+        int left_index = add_children(flat_index, nodes);
+        int l = left_index + (flip ? 1 : 0), r = left_index + (flip ? 0 : 1);
+        nodes[l].bbox = left_box;
+        nodes[r].bbox = right_box;
+        flatten_median(begin, mid, l, nodes, order);
+        flatten_median(mid, end, r, nodes, order);
+    }
+
+    // Near-first traversal expects the right child further along the split axis: picks
+    // that axis and returns whether the two children must be swapped
+    static bool flip_children(const aabb& l, const aabb& r, int& axis) {
+        auto d = bvh_builder::centroid(r) - bvh_builder::centroid(l);
+        axis = 0;
+        for (int a = 1; a < 3; a++)
+            if (std::fabs(d[a]) > std::fabs(d[axis])) axis = a;
+        return d[axis] < 0;
+    }
+
+    // Makes flat_index an interior node with two new children, returns the first's index
+    static int add_children(int flat_index, std::vector<bvh_flat_node>& nodes) {
+        int left_index = int(nodes.size());
+        nodes.emplace_back();
+        nodes.emplace_back();
+        nodes[flat_index].start = left_index;
+        nodes[flat_index].right = left_index + 1;
+        nodes[flat_index].count = 0;
+        return left_index;
+    }
+
+    void gather_primitives(int node, std::vector<int>& order) const {
+        if (is_leaf(node)) {
+            order.push_back(int(std::uint32_t(keys[node - (n - 1)])));
+            return;
+        }
+        gather_primitives(left[node], order);
+        gather_primitives(right[node], order);
+    }
+};
+
+#endif
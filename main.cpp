@@ -1,256 +1,207 @@
 #include "wicked.h"
 #include "camera.h"
 #include "hittable_list.h"
-#include "sphere.h"
-#include "quad.h"
-#include "triangle.h"
-#include "bvh.h"
-#include "material.h"
-#include "texture.h"
-
-
-
-// REQUIREMENT: Visible features shown in Glinda's pink bubble scene
-int main() {
-    // REQUIREMENT: Object instancing: world container
-    hittable_list world;
-
-
-
-
-    // REQUIREMENT: Texture loading: Load image textures from files
-    auto pink_gradient = make_shared<image_texture>("textures/pink_gradient.jpg");
-    auto sparkle_texture = make_shared<image_texture>("textures/sparkle.png");
-    
-
-
-
-
-    // REQUIREMENT: Dielectric material: outter glass-like bubble (small sphere in the front)
-    auto bubble_material = make_shared<dielectric>(1.3);
-    
-
-
-
-
-    // REQUIREMENT: Diffuse material with texture: inner bubble in the center uses pink gradient
-    auto textured_pink = make_shared<lambertian>(pink_gradient);
-    
-
-
-
-
-    // Main bubble sphere, REQUIREMENT: Ray/sphere intersections & textured spheres
-    auto bubble_center = point3(0, 1.0, 0);
-    auto bubble_radius = 1.0;
-    
-
-
-
-    // Outer glass layer on main bubble, REQUIREMENT: Dielectric material
-    world.add(make_shared<sphere>(bubble_center, bubble_radius, bubble_material));
-    
-
-
-
-    // Inner textured layer, REQUIREMENT: Textured spheres with pink gradient
-    world.add(make_shared<sphere>(bubble_center, bubble_radius - 0.02, textured_pink));
-    
-
-
-
-    // REQUIREMENT: Textured sphere with sparkle texture (the far right shpere)
-    auto sparkle_material = make_shared<lambertian>(sparkle_texture);
-    world.add(make_shared<sphere>(point3(2.2, 0.9, -0.8), 0.9, sparkle_material));
-    
-
-
-
-    // REQUIREMENT: Specular material, reflective metal (seen on small sphere in the front)
-    auto shiny_pink = make_shared<metal>(color(1.0, 0.7, 0.9), 0.1);
-    
-
-
-
-    // REQUIREMENT: Motion blur, floating sparkles around the main sphere (cause it needs to be magical and stuff!)
-    for (int i = 0; i < 30; i++) {
-        double theta = random_double(0, 2*pi);
-        double phi = random_double(0, pi);
-        double r = bubble_radius + random_double(0.1, 0.5);
-        
-        auto x = r * std::sin(phi) * std::cos(theta);
-        auto y = 1.0 + r * std::cos(phi);
-        auto z = r * std::sin(phi) * std::sin(theta);
-        
-        point3 center1(x, y, z);
-        point3 center2 = center1 + vec3(random_double(-0.1, 0.1), 
-                                        random_double(-0.05, 0.05), 
-                                        random_double(-0.1, 0.1));
-        
-
-        // REQUIREMENT: Emissive materials (lights), glowing pink sparkles around main sphere
-        auto sparkle_mat = make_shared<diffuse_light>(color(1.0, 0.5, 0.95) * random_double(4, 8));
-        world.add(make_shared<sphere>(center1, center2, 0.025, sparkle_mat));
+#include "scenes.h"
+#include "report.h"
+#include "scene_parser.h"
+#include "preview.h"
+#include <cstdlib>
+#include <string>
+
+
+
+// REQUIREMENT: Visible features shown in Glinda's pink bubble scene (built in scenes.h)
+//   ./raytracer [--scene <file.scene>] [--report <file.json>] [--bvh sah|lbvh|lbvh-treelet]
+//               [--spp <n>] [--denoise] [--aov <prefix>] [--ao <rays>] > output.ppm
+//   ./raytracer [...] [--width <pixels>] --stream <file.pfm|file.ppm> [--tile <pixels>]
+//   ./raytracer [...] --crop|--crop-frac <x0> <y0> <x1> <y1> [--crop-spp <n>]
+//               [--composite <frame.pfm|frame.ppm> [--composite-spp <n>]] > crop.ppm
+//   ./raytracer [...] --preview <file.ppm|file.pfm> [--preview-budget <ms>] [--preview-once]
+//   ./raytracer [...] --integrator recursive|wavefront [--no-ray-sort]
+int main(int argc, char* argv[]) {
+    std::string report_path;  // No report unless --report is given
+    std::string scene_path;
+    std::string bvh_method_name = "sah";
+    bvh_build_options bvh_options;
+    int spp = 0;  // 0 = keep the scene's samples per pixel
+    bool denoise = false;
+    std::string aov_prefix;
+    int ao_samples = 0;
+    int width = 0;  // 0 = keep the scene's image width
+    std::string stream_path;
+    int tile_size = 0;
+    crop_window crop;
+    std::string crop_text;  // As given, for the report
+    std::string composite_path;
+    int composite_spp = 0;
+    preview_options preview;
+    std::string integrator_name = "recursive";
+    bool ray_sort = true;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--report" && i + 1 < argc)
+            report_path = argv[++i];
+        else if (arg == "--scene" && i + 1 < argc)
+            scene_path = argv[++i];
+        else if (arg == "--bvh" && i + 1 < argc && parse_bvh_method(argv[i + 1], bvh_options))
+            bvh_method_name = argv[++i];
+        else if (arg == "--spp" && i + 1 < argc && std::atoi(argv[i + 1]) > 0)
+            spp = std::atoi(argv[++i]);
+        else if (arg == "--denoise")
+            denoise = true;
+        else if (arg == "--aov" && i + 1 < argc)
+            aov_prefix = argv[++i];
+        else if (arg == "--ao" && i + 1 < argc && std::atoi(argv[i + 1]) > 0)
+            ao_samples = std::atoi(argv[++i]);
+        else if (arg == "--width" && i + 1 < argc && std::atoi(argv[i + 1]) > 0)
+            width = std::atoi(argv[++i]);
+        else if (arg == "--stream" && i + 1 < argc)
+            stream_path = argv[++i];
+        else if (arg == "--tile" && i + 1 < argc && std::atoi(argv[i + 1]) > 0)
+            tile_size = std::atoi(argv[++i]);
+        else if ((arg == "--crop" || arg == "--crop-frac") && i + 4 < argc) {
+            crop.normalized = (arg == "--crop-frac");
+            crop.x0 = std::atof(argv[i + 1]);
+            crop.y0 = std::atof(argv[i + 2]);
+            crop.x1 = std::atof(argv[i + 3]);
+            crop.y1 = std::atof(argv[i + 4]);
+            crop_text = arg.substr(2) + " " + argv[i + 1] + " " + argv[i + 2] + " " + argv[i + 3] + " " + argv[i + 4];
+            i += 4;
+            if (crop.x1 <= crop.x0 || crop.y1 <= crop.y0 || crop.x0 < 0 || crop.y0 < 0
+                    || (crop.normalized && (crop.x1 > 1 || crop.y1 > 1))) {
+                std::cerr << "ERROR: Crop window needs 0 <= x0 < x1 and 0 <= y0 < y1"
+                          << (crop.normalized ? ", at most 1" : "") << "\n";
+                return 1;
+            }
+        }
+        else if (arg == "--crop-spp" && i + 1 < argc && std::atoi(argv[i + 1]) > 0)
+            crop.samples_per_pixel = std::atoi(argv[++i]);
+        else if (arg == "--composite" && i + 1 < argc)
+            composite_path = argv[++i];
+        else if (arg == "--composite-spp" && i + 1 < argc && std::atoi(argv[i + 1]) > 0)
+            composite_spp = std::atoi(argv[++i]);
+        else if (arg == "--preview" && i + 1 < argc)
+            preview.output_path = argv[++i];
+        else if (arg == "--preview-budget" && i + 1 < argc && std::atoi(argv[i + 1]) > 0)
+            preview.frame_seconds = std::atoi(argv[++i]) / 1000.0;
+        else if (arg == "--preview-once")
+            preview.watch = false;
+        else if (arg == "--integrator" && i + 1 < argc
+                 && (std::string(argv[i + 1]) == "recursive" || std::string(argv[i + 1]) == "wavefront"))
+            integrator_name = argv[++i];
+        else if (arg == "--no-ray-sort")
+            ray_sort = false;
+        else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--scene <file.scene>] [--report <file.json>]"
+                      << " [--bvh sah|lbvh|lbvh-treelet] [--spp <n>] [--denoise] [--aov <prefix>]"
+                      << " [--ao <rays>] [--width <pixels>] [--stream <file.pfm|file.ppm>]"
+                      << " [--tile <pixels>] [--crop|--crop-frac <x0> <y0> <x1> <y1>] [--crop-spp <n>]"
+                      << " [--composite <frame.pfm|frame.ppm>] [--composite-spp <n>]"
+                      << " [--preview <file.ppm|file.pfm>] [--preview-budget <ms>] [--preview-once]"
+                      << " [--integrator recursive|wavefront] [--no-ray-sort] > output.ppm\n";
+            return 1;
+        }
     }
-    
-
-
-
-
-    // Ground with checker pattern, REQUIREMENT: Diffuse material
-    auto checker = make_shared<checker_texture>(0.8, color(0.1, 0.3, 0.2), color(0.15, 0.4, 0.3));
-    auto ground_mat = make_shared<lambertian>(checker);
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_mat));
-    
-
-
-
-
-    // REQUIREMENT: Quads, dark gold platform beneath main bubble with gradient texture
-    auto platform_mat = make_shared<lambertian>(color(0.4, 0.3, 0.05));
-    world.add(make_shared<quad>(point3(-2, 0, -2), vec3(4, 0, 0), vec3(0, 0, 4), platform_mat));
-    
-
-
-
-
-    // REQUIREMENT: Ray/triangle intersections with normal interpolation (smooth shading)
-    // REQUIREMENT: Textured triangles using gradient texture, star shape with connected edges (this took forever, was playing with fire here honestly)
-    auto textured_triangle_mat = make_shared<lambertian>(pink_gradient);
-    
-
 
-
-    // 5-pointed star (made of triangles) with all triangles connected
-    point3 star_center(-2.8, 1.8, -0.5);
-    double star_outer_radius = 1.1;
-    double star_inner_radius = 0.45;
-    
-    
-
-
-    // Generate all 10 points
-    std::vector<point3> star_points;
-    for (int i = 0; i < 10; i++) {
-        double angle = i * pi / 5 - pi/2;  
-        double radius = (i % 2 == 0) ? star_outer_radius : star_inner_radius;
-        star_points.push_back(point3(
-            star_center.x() + radius * std::cos(angle),
-            star_center.y() + radius * std::sin(angle),
-            star_center.z()
-        ));
+    if (!stream_path.empty() && (denoise || !aov_prefix.empty())) {
+        std::cerr << "ERROR: --denoise and --aov need the whole frame and cannot be used with --stream\n";
+        return 1;
     }
-    
-
-
-
-
-    // Create triangles connecting center to each edge of the star
-    vec3 normal = vec3(0, 0, 1);
-    for (int i = 0; i < 10; i++) {
-        int next = (i + 1) % 10;
-        // REQUIREMENT: Textured triangles with loaded pink gradient texture
-        // REQUIREMENT: Normal interpolation
-        world.add(make_shared<triangle>(star_center, star_points[i], star_points[next], 
-                                       normal, normal, normal, textured_triangle_mat));
+    if (!stream_path.empty() && !composite_path.empty()) {
+        std::cerr << "ERROR: --composite writes into an existing frame and cannot be used with --stream\n";
+        return 1;
     }
-    
-
-
-
 
-    // Additional small, lit triangles seen around the main bubble for more glow
-    for (int i = 0; i < 5; i++) {
-        double angle = i * 2 * pi / 5 + pi/5;
-        double r = bubble_radius + 0.8;
-        auto x = r * std::cos(angle);
-        auto z = r * std::sin(angle);
-        
-        point3 v0(x, 0.9, z);
-        point3 v1(x + 0.1*std::cos(angle + 0.6), 1.1, z + 0.1*std::sin(angle + 0.6));
-        point3 v2(x + 0.1*std::cos(angle - 0.6), 1.1, z + 0.1*std::sin(angle - 0.6));
-        
-        vec3 n0 = unit_vector(v0 - bubble_center);
-        vec3 n1 = unit_vector(v1 - bubble_center);
-        vec3 n2 = unit_vector(v2 - bubble_center);
-        
-        auto light_triangle_mat = make_shared<diffuse_light>(color(1.0, 0.6, 0.95) * 2.5);
-        world.add(make_shared<triangle>(v0, v1, v2, n0, n1, n2, light_triangle_mat));
+    if (!preview.output_path.empty() && (denoise || !aov_prefix.empty() || !stream_path.empty()
+                                         || !crop_text.empty() || !composite_path.empty())) {
+        std::cerr << "ERROR: --preview renders the whole frame progressively and cannot be used with"
+                  << " --denoise, --aov, --stream, --crop or --composite\n";
+        return 1;
     }
-    
-
-
-
-    // REQUIREMENT: Volume rendering, mist in main bubble
-    auto boundary = make_shared<sphere>(bubble_center, bubble_radius + 0.3, 
-                                       make_shared<dielectric>(1.5));
-    world.add(make_shared<constant_medium>(boundary, 0.5, color(1.0, 0.8, 1.0)));
-    
-
-
 
+    // Command line settings applied over the scene's camera
+    auto configure = [&](camera& cam) {
+        // A low spp render plus the denoiser replaces most of the samples
+        if (spp > 0)
+            cam.samples_per_pixel = spp;
+        cam.denoise = denoise;
+        cam.aov_prefix = aov_prefix;
+        cam.ao_samples = ao_samples;
+        if (width > 0)
+            cam.image_width = width;
+        if (tile_size > 0)
+            cam.tile_size = tile_size;
+        cam.crop = crop;
+        cam.composite_path = composite_path;
+        cam.composite_base_spp = composite_spp;
+        cam.integrator = integrator_name == "wavefront" ? integrator_kind::wavefront : integrator_kind::recursive;
+        cam.wavefront_sort = ray_sort;
+    };
+
+    // Preview: progressive 1 spp refinement into a file a viewer polls, reloading the
+    // scene file whenever it changes. No report, it runs until stopped.
+    if (!preview.output_path.empty())
+        return preview_renderer(preview).run(scene_path, bvh_options, configure) ? 0 : 1;
+
+    run_report report;
 
-    // REQUIREMENT: Perlin noise, marble-textured sphere (far left sphere) 
-    // I know, very out of place for the scene, but I wanted to implement it
-    auto perlin_texture = make_shared<noise_texture>(3.0);
-    auto perlin_mat = make_shared<lambertian>(perlin_texture);
-    world.add(make_shared<sphere>(point3(-3.0, 0.7, 0.5), 0.7, perlin_mat));
-    
-
-
-
-    // Small sphere, REQUIREMENT: Specular material
-    world.add(make_shared<sphere>(point3(1.5, 0.3, 1), 0.3, shiny_pink));
-    
-
-
-
-    // REQUIREMENT: Emissive materials
-    auto light_mat = make_shared<diffuse_light>(color(1, 1, 1) * 4);
-    world.add(make_shared<sphere>(point3(4, 6, 3), 1.5, light_mat));
-    
-
-    
-    // Making lights pink and bright
-    auto fill_light = make_shared<diffuse_light>(color(1.0, 0.5, 0.9) * 3.5);
-    world.add(make_shared<quad>(point3(-3, 5, -3), vec3(2, 0, 0), vec3(0, 0, 2), fill_light));
-    
-    
-
-
-    // REQUIREMENT: Spatial subdivision acceleration structure (BVH)
-    world = hittable_list(make_shared<bvh_node>(world));
-
-
-
-    // REQUIREMENT: Camera with configurable position, orientation, and field of view
+    // REQUIREMENT: Object instancing: world container
+    scene_arena arena;
+    hittable_list world;
     camera cam;
-    
 
+    // Scene file if given, otherwise the built-in Wicked scene
+    if (scene_path.empty())
+        wicked_scene(world, cam, arena, &report, bvh_options);
+    else if (!load_scene(scene_path, world, cam, arena, &report, bvh_options))
+        return 1;
 
-    cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = 800;
-    cam.samples_per_pixel = 200;  // REQUIREMENT: Anti-aliasing
-    cam.max_depth = 50;
-    cam.background = color(0.4, 0.18, 0.32);  // Dark pink sky
-    
-
-    cam.vfov = 40;  // REQUIREMENT: Field of view
-    cam.lookfrom = point3(3, 2, 5);  // REQUIREMENT: Configurable position
-    cam.lookat = point3(0, 1, 0);    // REQUIREMENT: Configurable orientation
-    cam.vup = vec3(0, 1, 0);         // REQUIREMENT: Configurable orientation
-    
+    configure(cam);
 
 
 
-    // REQUIREMENT: Defocus blur/depth of field
-    cam.defocus_angle = 0.3;
-    cam.focus_dist = (cam.lookfrom - cam.lookat).length();
+    // REQUIREMENT: Parallelization happens inside render()
+    // Streaming keeps only in-flight tiles in memory and writes them to stream_path.
+    // A crop traces only its pixels and outputs that sub-image, or patches composite_path.
+    if (stream_path.empty()) {
+        if (!cam.render(world))
+            return 1;
+    } else if (!cam.render_tiles(world, stream_path)) {
+        return 1;
+    }
 
 
 
-    // REQUIREMENT: Parallelization happens inside render()
-    cam.render(world);
+    // Phase timings, throughput and peak memory for this run
+    report.set("samples_per_pixel", std::uint64_t(cam.crop_samples_per_pixel()));
+    report.set("bvh_method", bvh_method_name);
+    report.set("integrator", integrator_name);
+    if (integrator_name == "wavefront")
+        report.set("ray_sort", ray_sort);
+    report.set("fast_math", fast_math_enabled);
+    report.set("kernel_features", cam.kernel_features());
+    report.set("denoised", denoise);
+    report.set("streamed", !stream_path.empty());
+    report.set("framebuffer_bytes", cam.framebuffer_bytes());
+    report.set("bvh_node_bytes", bvh_memory().node_bytes.load());
+    report.set("bvh_binary_node_bytes", bvh_memory().binary_bytes.load());
+    report.set("memory_geometry_bytes", scene_memory()[memory_category::geometry]);
+    report.set("memory_bvh_bytes", scene_memory()[memory_category::bvh] + bvh_memory().node_bytes.load());
+    report.set("memory_textures_bytes", scene_memory()[memory_category::textures]);
+    report.set("memory_materials_bytes", scene_memory()[memory_category::materials]);
+    report.set("arena_bytes", arena.reserved_bytes());
+    report.set("arena_objects", arena.object_count());
+    report.set("interned_objects", arena.interned_count());
+    if (!crop_text.empty())
+        report.set("crop", crop_text);
+    if (!composite_path.empty())
+        report.set("composited_into", composite_path);
+    report.add_render(cam.last_timings(), cam.ray_count(), cam.sample_count(),
+                      cam.crop_output_width(), cam.crop_output_height());
+    if (!report_path.empty())
+        report.write_json(report_path);
     
     return 0;
-}
\ No newline at end of file
+}
@@ -3,7 +3,18 @@
 
 #include "wicked.h"
 #include "texture.h"
+#include "fast_math.h"
 #include "hittable.h"
+#include <atomic>
+
+
+// Concrete material types, so the wavefront integrator can shade each kind in a loop of
+// its own (the classes are final, which lets those loops call them without virtual dispatch)
+enum class material_kind { lambertian, metal, dielectric, light, isotropic, other };
+constexpr int material_kind_count = 6;
+
+
+
 
 
 // REQUIREMENT: Specular, diffuse, and dielectric materials
@@ -19,17 +30,43 @@ public:
     virtual color emitted(double u, double v, const point3& p) const {
         return color(0,0,0);
     }
+
+    // Whether shading reads the hit's UVs, primitives skip computing them otherwise
+    virtual bool needs_uv() const { return false; }
+
+    virtual material_kind kind() const { return material_kind::other; }
+
+    // Whether emitted() can be anything but black: lights, and kinds this file does not know
+    bool may_emit() const { return kind() == material_kind::light || kind() == material_kind::other; }
+
+    // Small integer unique to each material, written to the material ID AOV
+    int id() const { return material_id; }
+
+private:
+    int material_id = next_id();
+
+    static int next_id() {
+        static std::atomic<int> next{0};
+        return next++;
+    }
 };
 
+// Features a primitive brings into the scene through its material (see scene_features)
+inline scene_features material_features(const shared_ptr<material>& mat) {
+    scene_features features;
+    features.emission = mat && mat->may_emit();
+    return features;
+}
+
 
 
 
 
 // REQUIREMENT: Diffuse (Lambertian) material
-class lambertian : public material {
+class lambertian final : public material {
 public:
-    lambertian(const color& albedo) : tex(make_shared<solid_color>(albedo)) {}
-    lambertian(shared_ptr<texture> tex) : tex(tex) {}
+    lambertian(const color& albedo) : flat(flat_texture::constant(albedo)) {}
+    lambertian(shared_ptr<texture> tex) : tex(tex), flat(this->tex->flatten()) {}
 
     bool scatter(const ray& r_in, const hit_record& rec, 
                 color& attenuation, ray& scattered) const override {
@@ -39,12 +76,17 @@ public:
             scatter_direction = rec.normal;
 
         scattered = ray(rec.p, scatter_direction, r_in.time());
-        attenuation = tex->value(rec.u, rec.v, rec.p);
+        attenuation = flat.value(rec.u, rec.v, rec.p);
         return true;
     }
 
+    bool needs_uv() const override { return flat.uses_uv; }
+
+    material_kind kind() const override { return material_kind::lambertian; }
+
 private:
-    shared_ptr<texture> tex;
+    shared_ptr<texture> tex;  // Keeps flat's texture alive, empty for a plain color
+    flat_texture flat;
 };
 
 
@@ -52,7 +94,7 @@ private:
 
 
 // REQUIREMENT: Specular (metal) material
-class metal : public material {
+class metal final : public material {
 public:
     metal(const color& albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
 
@@ -65,6 +107,8 @@ public:
         return (dot(scattered.direction(), rec.normal) > 0);
     }
 
+    material_kind kind() const override { return material_kind::metal; }
+
 private:
     color albedo;
     double fuzz;
@@ -75,7 +119,7 @@ private:
 
 
 // REQUIREMENT: Dielectric material (glass)
-class dielectric : public material {
+class dielectric final : public material {
 public:
     dielectric(double refraction_index) : refraction_index(refraction_index) {}
 
@@ -102,13 +146,15 @@ public:
 
 
 
+    material_kind kind() const override { return material_kind::dielectric; }
+
 private:
     double refraction_index;
 
     static double reflectance(double cosine, double refraction_index) {
         auto r0 = (1 - refraction_index) / (1 + refraction_index);
         r0 = r0*r0;
-        return r0 + (1-r0)*std::pow((1 - cosine),5);
+        return r0 + (1-r0)*math_pow5(1 - cosine);
     }
 };
 
@@ -117,37 +163,47 @@ private:
 
 
 // REQUIREMENT: Emissive materials (lights)
-class diffuse_light : public material {
+class diffuse_light final : public material {
 public:
-    diffuse_light(shared_ptr<texture> tex) : tex(tex) {}
-    diffuse_light(const color& emit) : tex(make_shared<solid_color>(emit)) {}
+    diffuse_light(shared_ptr<texture> tex) : tex(tex), flat(this->tex->flatten()) {}
+    diffuse_light(const color& emit) : flat(flat_texture::constant(emit)) {}
 
     color emitted(double u, double v, const point3& p) const override {
-        return tex->value(u, v, p);
+        return flat.value(u, v, p);
     }
 
+    bool needs_uv() const override { return flat.uses_uv; }
+
+    material_kind kind() const override { return material_kind::light; }
+
 private:
     shared_ptr<texture> tex;
+    flat_texture flat;
 };
 
 
 
 
 // REQUIREMENT: Volume rendering (mist)
-class isotropic : public material {
+class isotropic final : public material {
 public:
-    isotropic(const color& albedo) : tex(make_shared<solid_color>(albedo)) {}
-    isotropic(shared_ptr<texture> tex) : tex(tex) {}
+    isotropic(const color& albedo) : flat(flat_texture::constant(albedo)) {}
+    isotropic(shared_ptr<texture> tex) : tex(tex), flat(this->tex->flatten()) {}
 
     bool scatter(const ray& r_in, const hit_record& rec, 
                 color& attenuation, ray& scattered) const override {
         scattered = ray(rec.p, random_unit_vector(), r_in.time());
-        attenuation = tex->value(rec.u, rec.v, rec.p);
+        attenuation = flat.value(rec.u, rec.v, rec.p);
         return true;
     }
 
+    bool needs_uv() const override { return flat.uses_uv; }
+
+    material_kind kind() const override { return material_kind::isotropic; }
+
 private:
     shared_ptr<texture> tex;
+    flat_texture flat;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,214 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Small work-stealing task pool for scene setup work (BVH builds, texture decodes).
+// Every worker owns a deque: it pushes and pops its own tasks at the back and steals
+// from the front of the others. Threads waiting on a task_group run queued tasks
+// instead of blocking, so nested task groups cannot deadlock the pool.
+class task_pool {
+public:
+    // Shared pool: one worker per hardware thread, minus the thread that waits on tasks
+    static task_pool& instance() {
+        static task_pool pool(std::thread::hardware_concurrency());
+        return pool;
+    }
+
+    explicit task_pool(unsigned hardware_threads) {
+        unsigned workers = hardware_threads > 1 ? hardware_threads - 1 : 0;
+        queues.reserve(workers + 1);
+        for (unsigned i = 0; i <= workers; i++)  // queues[0] takes tasks from non-worker threads
+            queues.push_back(std::make_unique<task_queue>());
+        for (unsigned i = 0; i < workers; i++)
+            threads.emplace_back([this, i] { worker_loop(int(i) + 1); });
+    }
+
+    ~task_pool() {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : threads)
+            t.join();
+    }
+
+    task_pool(const task_pool&) = delete;
+    task_pool& operator=(const task_pool&) = delete;
+
+    // Threads that execute tasks, including the one that waits
+    int concurrency() const { return int(threads.size()) + 1; }
+
+
+
+
+    // Tasks spawned through a group, wait() returns once all of them have finished
+    class task_group {
+    public:
+        explicit task_group(task_pool& pool = task_pool::instance()) : pool(pool) {}
+        ~task_group() { wait(); }
+
+        task_group(const task_group&) = delete;
+        task_group& operator=(const task_group&) = delete;
+
+        template <typename F>
+        void run(F&& f) {
+            pending.fetch_add(1, std::memory_order_relaxed);
+            pool.push(task{std::function<void()>(std::forward<F>(f)), &pending});
+        }
+
+        void wait() {
+            while (pending.load(std::memory_order_acquire) > 0) {
+                if (!pool.run_one())
+                    std::this_thread::yield();
+            }
+        }
+
+    private:
+        task_pool& pool;
+        std::atomic<int> pending{0};
+    };
+
+
+
+private:
+    struct task {
+        std::function<void()> work;
+        std::atomic<int>* pending;
+    };
+
+    struct task_queue {
+        std::mutex mutex;
+        std::deque<task> tasks;
+    };
+
+    std::vector<std::unique_ptr<task_queue>> queues;
+    std::vector<std::thread> threads;
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    int queued = 0;  // Tasks pushed and not yet taken (briefly -1 if taken first), under sleep_mutex
+    bool stopping = false;
+
+    // The pool the calling thread works for and its queue there
+    struct worker_slot {
+        const task_pool* pool = nullptr;
+        int index = 0;
+    };
+
+    static worker_slot& current_worker() {
+        static thread_local worker_slot slot;
+        return slot;
+    }
+
+    // Index of the calling thread's own queue (0 for threads outside this pool)
+    int worker_index() const {
+        const auto& slot = current_worker();
+        return slot.pool == this ? slot.index : 0;
+    }
+
+    void push(task t) {
+        auto& q = *queues[worker_index()];
+        {
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.tasks.push_back(std::move(t));
+        }
+        {
+            // Counted under the mutex the workers sleep on, so none can miss the wakeup
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            queued++;
+        }
+        wake.notify_one();
+    }
+
+    // Pops from our own queue (newest first), else steals the oldest task of another queue
+    bool run_one() {
+        int self = worker_index();
+        task t;
+        if (!pop_back(*queues[self], t)) {
+            bool stolen = false;
+            for (size_t k = 1; k <= queues.size() && !stolen; k++)
+                stolen = steal_front(*queues[(self + k) % queues.size()], t);
+            if (!stolen)
+                return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            queued--;
+        }
+
+        t.work();
+        t.pending->fetch_sub(1, std::memory_order_release);
+        return true;
+    }
+
+    static bool pop_back(task_queue& q, task& t) {
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.tasks.empty()) return false;
+        t = std::move(q.tasks.back());
+        q.tasks.pop_back();
+        return true;
+    }
+
+    static bool steal_front(task_queue& q, task& t) {
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.tasks.empty()) return false;
+        t = std::move(q.tasks.front());
+        q.tasks.pop_front();
+        return true;
+    }
+
+    // Sleeps until a task is queued, so idle workers cost nothing while rendering
+    void worker_loop(int index) {
+        current_worker() = worker_slot{this, index};
+        while (true) {
+            if (run_one())
+                continue;
+
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake.wait(lock, [this] { return stopping || queued > 0; });
+            if (stopping)
+                return;
+        }
+    }
+};
+
+
+
+
+
+// Calls body(chunk_begin, chunk_end) over [begin, end) split into chunks of at least grain
+template <typename Body>
+void parallel_for(task_pool& pool, size_t begin, size_t end, size_t grain, const Body& body) {
+    size_t count = end - begin;
+    if (count <= grain || pool.concurrency() == 1) {
+        if (count > 0) body(begin, end);
+        return;
+    }
+
+    size_t chunks = std::min(count / grain, size_t(pool.concurrency()) * 4);
+    size_t chunk_size = (count + chunks - 1) / chunks;
+
+    task_pool::task_group group(pool);
+    for (size_t chunk_begin = begin; chunk_begin < end; chunk_begin += chunk_size) {
+        size_t chunk_end = std::min(end, chunk_begin + chunk_size);
+        group.run([=, &body] { body(chunk_begin, chunk_end); });
+    }
+    group.wait();
+}
+
+template <typename Body>
+void parallel_for(size_t begin, size_t end, size_t grain, const Body& body) {
+    parallel_for(task_pool::instance(), begin, end, grain, body);
+}
+
+#endif
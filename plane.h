@@ -0,0 +1,167 @@
+#ifndef PLANE_H
+#define PLANE_H
+
+#include "hittable.h"
+#include "material.h"
+#include "fast_math.h"
+
+
+// Orthonormal tangents spanning the plane with the given unit normal
+inline void plane_tangents(const vec3& normal, vec3& tangent_u, vec3& tangent_v) {
+    vec3 helper = std::fabs(normal.y()) < 0.9 ? vec3(0,1,0) : vec3(1,0,0);
+    tangent_u = unit_vector(cross(helper, normal));
+    tangent_v = cross(normal, tangent_u);
+}
+
+
+
+
+
+// Infinite plane through Q, for grounds and walls. One dot product per ray instead of a
+// huge sphere's quadratic, and its box is unbounded, so bvh_node tests it beside the tree
+// rather than inside it. UVs tile once per unit along the two tangents.
+class plane : public hittable {
+public:
+    plane(const point3& Q, const vec3& normal, shared_ptr<material> mat)
+        : Q(Q), normal(unit_vector(normal)), mat(mat), needs_uv(mat && mat->needs_uv()) {
+        D = dot(this->normal, Q);
+        plane_tangents(this->normal, tangent_u, tangent_v);
+
+        // Flat along the normal's axis when axis aligned, unbounded everywhere else
+        axis = -1;
+        for (int a = 0; a < 3; a++)
+            if (std::fabs(this->normal[a]) == 1.0) axis = a;
+        interval span[3] = { interval::universe, interval::universe, interval::universe };
+        if (axis >= 0)
+            span[axis] = interval(Q[axis], Q[axis]);
+        bbox = aabb(span[0], span[1], span[2]);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+    scene_features features() const override { return material_features(mat); }
+
+
+
+    bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
+        double t;
+        if (!plane_hit(r, ray_t, t))
+            return false;
+        rec.record(t, this);
+        return true;
+    }
+
+    // On an axis-aligned plane the hit gets the plane's coordinate exactly, so 3D textures
+    // like the checker do not flicker between cells from rounding
+    void finalize_hit(const ray& r, hit_record& rec) const override {
+        rec.p = r.at(rec.t);
+        if (axis >= 0)
+            rec.p[axis] = Q[axis];
+        rec.set_face_normal(r, normal);
+        if (needs_uv) {
+            vec3 d = rec.p - Q;
+            rec.u = dot(d, tangent_u) - std::floor(dot(d, tangent_u));
+            rec.v = dot(d, tangent_v) - std::floor(dot(d, tangent_v));
+        }
+        rec.mat = mat.get();
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override {
+        double t;
+        return plane_hit(r, ray_t, t);
+    }
+
+
+
+private:
+    point3 Q;
+    vec3 normal;
+    vec3 tangent_u, tangent_v;
+    double D;
+    int axis;  // Axis the normal lies along, -1 if none
+    shared_ptr<material> mat;
+    bool needs_uv;
+    aabb bbox;
+
+    bool plane_hit(const ray& r, const interval& ray_t, double& t) const {
+        WICKED_STAT(primitives_tested);
+        auto denom = dot(normal, r.direction());
+        if (std::fabs(denom) < 1e-8)
+            return false;
+        t = (D - dot(normal, r.origin())) / denom;
+        return ray_t.contains(t);
+    }
+};
+
+
+
+
+
+// Flat disk: the plane test plus a radius check. UVs are polar, u the angle around the
+// normal and v the distance from the center as a fraction of the radius.
+class disk : public hittable {
+public:
+    disk(const point3& center, const vec3& normal, double radius, shared_ptr<material> mat)
+        : center(center), normal(unit_vector(normal)), radius(std::fmax(0, radius)), mat(mat),
+          needs_uv(mat && mat->needs_uv()) {
+        D = dot(this->normal, center);
+        plane_tangents(this->normal, tangent_u, tangent_v);
+
+        // Per axis, the disk extends radius * sin(angle between normal and axis)
+        vec3 extent;
+        for (int a = 0; a < 3; a++)
+            extent[a] = this->radius * std::sqrt(std::fmax(0.0, 1.0 - this->normal[a] * this->normal[a]));
+        bbox = aabb(center - extent, center + extent).pad();
+    }
+
+    aabb bounding_box() const override { return bbox; }
+    scene_features features() const override { return material_features(mat); }
+
+
+
+    bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
+        double t;
+        if (!disk_hit(r, ray_t, t))
+            return false;
+        rec.record(t, this);
+        return true;
+    }
+
+    void finalize_hit(const ray& r, hit_record& rec) const override {
+        rec.p = r.at(rec.t);
+        rec.set_face_normal(r, normal);
+        if (needs_uv) {
+            vec3 d = rec.p - center;
+            rec.u = (math_atan2(dot(d, tangent_v), dot(d, tangent_u)) + pi) / (2*pi);
+            rec.v = radius > 0 ? std::fmin(1.0, d.length() / radius) : 0.0;
+        }
+        rec.mat = mat.get();
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override {
+        double t;
+        return disk_hit(r, ray_t, t);
+    }
+
+
+
+private:
+    point3 center;
+    vec3 normal;
+    vec3 tangent_u, tangent_v;
+    double radius;
+    double D;
+    shared_ptr<material> mat;
+    bool needs_uv;
+    aabb bbox;
+
+    bool disk_hit(const ray& r, const interval& ray_t, double& t) const {
+        WICKED_STAT(primitives_tested);
+        auto denom = dot(normal, r.direction());
+        if (std::fabs(denom) < 1e-8)
+            return false;
+        t = (D - dot(normal, r.origin())) / denom;
+        return ray_t.contains(t) && (r.at(t) - center).length_squared() <= radius * radius;
+    }
+};
+
+#endif
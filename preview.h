@@ -0,0 +1,238 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include "wicked.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "scenes.h"
+#include "scene_parser.h"
+#include "tile_writer.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+struct preview_options {
+    std::string output_path;     // Rewritten after every refinement, .ppm bytes or .pfm floats
+    double frame_seconds = 0.1;  // Time budget between two rewrites of the image
+    int start_scale = 8;         // First pass traces one ray per start_scale^2 pixels
+    bool watch = true;           // Keep running and restart when the scene file changes
+};
+
+
+
+
+
+// Interactive preview for scene authoring. Traces a 1 spp pyramid at 1/8, 1/4, 1/2 and
+// full resolution, each pass filling its blocks with one sample, then keeps adding full
+// resolution samples up to the camera's samples_per_pixel. Passes are cut into slices of
+// block rows sized to the frame budget (or to 4x the time a rewrite takes, for large
+// images), and the image file is rewritten after each slice
+// (to a temporary name, then renamed, so a polling viewer never sees half a file).
+// When the coarsest pass alone overruns the budget, later passes trace fewer bounces and
+// the next restart starts coarser; both recover when frames come in well under budget.
+// The scene file is checked between slices and a change restarts from the coarsest pass.
+class preview_renderer {
+public:
+    explicit preview_renderer(const preview_options& options)
+        : options(options), start_scale(std::max(1, options.start_scale)) {}
+
+    // Loads scene_path (the built-in scene when empty), applies configure to its camera
+    // and refines until converged, restarting on changes while options.watch is set
+    bool run(const std::string& scene_path, const bvh_build_options& bvh_options,
+             const std::function<void(camera&)>& configure) {
+        while (true) {
+            scene_arena arena;  // Fresh per load, the previous scene's chunks go with it
+            hittable_list world;
+            camera cam;
+            auto stamp = modified_time(scene_path);
+            bool loaded = true;
+            if (scene_path.empty())
+                wicked_scene(world, cam, arena, nullptr, bvh_options);
+            else
+                loaded = load_scene(scene_path, world, cam, arena, nullptr, bvh_options);
+
+            if (!loaded) {
+                if (!options.watch || scene_path.empty())
+                    return false;
+                std::clog << "Preview: waiting for '" << scene_path << "' to change\n";
+                while (modified_time(scene_path) == stamp)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+
+            configure(cam);
+            cam.show_progress = false;
+            cam.prepare(world);
+            if (depth_limit <= 0 || depth_limit > cam.max_depth)
+                depth_limit = cam.max_depth;
+
+            changed = [&] { return !scene_path.empty() && modified_time(scene_path) != stamp; };
+            if (!refine(world, cam))
+                return false;
+            if (!changed()) {
+                if (!options.watch || scene_path.empty())
+                    return true;
+                std::clog << "Preview: converged, watching '" << scene_path << "'\n";
+                while (!changed())
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+            std::clog << "Preview: scene changed, restarting\n";
+        }
+    }
+
+
+
+private:
+    preview_options options;
+    int start_scale;
+    int depth_limit = 0;             // Bounces for the pyramid, adapted to the budget
+    double seconds_per_block = 0;    // Running estimate of one block sample's cost
+    double write_seconds = 0;        // Time the last image rewrite took
+    std::function<bool()> changed;
+    std::vector<color> frame;        // Displayed image, full resolution
+    std::vector<color> sum;          // Full resolution samples added so far
+    std::vector<color> samples;      // One slice of a pass, one colour per block
+
+
+
+    // Runs the pyramid, then accumulation. Returns false if the image cannot be written;
+    // returns true early when the scene changed.
+    bool refine(const hittable& world, camera& cam) {
+        const int width = cam.image_width, height = cam.output_height();
+        frame.assign(size_t(width) * height, color(0,0,0));
+        sum.assign(frame.size(), color(0,0,0));
+
+        for (int scale = start_scale; scale >= 1; scale /= 2) {
+            auto pass_start = std::chrono::steady_clock::now();
+            bool done;
+            if (!pass(world, cam, scale, depth_limit, 0, done))
+                return false;
+            if (!done)
+                return true;
+            if (scale == start_scale)
+                adapt(seconds_since(pass_start), cam.max_depth);
+            std::clog << "Preview: 1/" << scale << " resolution, " << depth_limit << " bounces, "
+                      << seconds_since(pass_start) << " s\n";
+        }
+
+        for (int n = 1; n <= cam.samples_per_pixel; n++) {
+            bool done;
+            if (!pass(world, cam, 1, cam.max_depth, n, done))
+                return false;
+            if (!done)
+                return true;
+            std::clog << "\rPreview: " << n << "/" << cam.samples_per_pixel << " spp " << std::flush;
+        }
+        std::clog << '\n';
+        return true;
+    }
+
+    // One 1 spp pass in budget-sized slices of block rows, rewriting the image after each.
+    // accumulate = 0 fills scale x scale blocks, n > 0 adds sample n to sum and shows the
+    // mean. done is false when the scene changed midway.
+    bool pass(const hittable& world, const camera& cam, int scale, int depth, int accumulate, bool& done) {
+        const int width = cam.image_width, height = cam.output_height();
+        const int blocks_x = (width + scale - 1) / scale;
+        const int blocks_y = (height + scale - 1) / scale;
+        done = false;
+
+        for (int row = 0; row < blocks_y;) {
+            if (changed())
+                return true;
+
+            // Large images take a while to rewrite: trace at least 4x as long as that
+            double slice_seconds = std::max(options.frame_seconds, 4 * write_seconds);
+            int rows = 1;
+            if (seconds_per_block > 0)
+                rows = int(slice_seconds / (seconds_per_block * blocks_x));
+            rows = std::clamp(rows, 1, blocks_y - row);
+
+            auto slice_start = std::chrono::steady_clock::now();
+            cam.trace_preview_blocks(world, scale, depth, row, row + rows, samples);
+            double elapsed = seconds_since(slice_start);
+            double per_block = elapsed / (double(rows) * blocks_x);
+            seconds_per_block = seconds_per_block > 0 ? 0.5 * (seconds_per_block + per_block) : per_block;
+
+            for (int by = row; by < row + rows; by++) {
+                for (int bx = 0; bx < blocks_x; bx++) {
+                    const color& c = samples[size_t(by - row) * blocks_x + bx];
+                    for (int j = by * scale; j < std::min((by + 1) * scale, height); j++) {
+                        for (int i = bx * scale; i < std::min((bx + 1) * scale, width); i++) {
+                            size_t p = size_t(j) * width + i;
+                            if (accumulate > 0) {
+                                sum[p] += c;
+                                frame[p] = sum[p] / accumulate;
+                            } else {
+                                frame[p] = c;
+                            }
+                        }
+                    }
+                }
+            }
+            row += rows;
+
+            auto write_start = std::chrono::steady_clock::now();
+            if (!write_frame(width, height))
+                return false;
+            write_seconds = seconds_since(write_start);
+        }
+        done = true;
+        return true;
+    }
+
+    // Trades bounces (then resolution, on the next restart) for time after the coarsest pass
+    void adapt(double seconds, int max_depth) {
+        if (seconds > options.frame_seconds) {
+            if (depth_limit > 1)
+                depth_limit = std::max(1, depth_limit / 2);
+            else
+                start_scale = std::min(start_scale * 2, 64);
+        } else if (seconds < options.frame_seconds / 4) {
+            if (start_scale > options.start_scale)
+                start_scale /= 2;
+            else
+                depth_limit = std::min(depth_limit * 2, max_depth);
+        }
+    }
+
+    bool write_frame(int width, int height) {
+        // Same extension, so the temporary file gets the same format
+        std::filesystem::path temporary_path(options.output_path);
+        temporary_path.replace_extension(".tmp" + temporary_path.extension().string());
+        std::string temporary = temporary_path.string();
+        {
+            tile_writer writer;
+            if (!writer.open(temporary, width, height)
+                    || !writer.write_tile(0, 0, width, height, frame.data()) || !writer.close())
+                return false;
+        }
+        if (std::rename(temporary.c_str(), options.output_path.c_str()) != 0) {
+            std::cerr << "ERROR: Could not replace preview image '" << options.output_path << "'\n";
+            return false;
+        }
+        return true;
+    }
+
+
+
+    static std::filesystem::file_time_type modified_time(const std::string& path) {
+        std::error_code error;
+        if (path.empty())
+            return std::filesystem::file_time_type();
+        auto time = std::filesystem::last_write_time(path, error);
+        return error ? std::filesystem::file_time_type() : time;
+    }
+
+    static double seconds_since(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+#endif
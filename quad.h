@@ -2,6 +2,7 @@
 #define QUAD_H
 
 #include "hittable.h"
+#include "material.h"
 #include "hittable_list.h"
 
 // REQUIREMENT: Quads
@@ -27,36 +28,34 @@ public:
     }
 
     aabb bounding_box() const override { return bbox; }
+    scene_features features() const override { return material_features(mat); }
 
 
 
 
 
     // Test ray intersection with quad plane
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        auto denom = dot(normal, r.direction());
-
-        if (std::fabs(denom) < 1e-8)
+    bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
+        double t, alpha, beta;
+        if (!plane_hit(r, ray_t, t, alpha, beta) || !is_interior(alpha, beta))
             return false;
 
-        auto t = (D - dot(normal, r.origin())) / denom;
-        if (!ray_t.contains(t))
-            return false;
-
-        auto intersection = r.at(t);
-        vec3 planar_hitpt_vector = intersection - Q;
-        auto alpha = dot(w, cross(planar_hitpt_vector, v));
-        auto beta = dot(w, cross(u, planar_hitpt_vector));
-
-        if (!is_interior(alpha, beta, rec))
-            return false;
+        rec.record(t, this, alpha, beta);
+        return true;
+    }
 
-        rec.t = t;
-        rec.p = intersection;
-        rec.mat = mat;
+    // The planar coordinates double as UVs
+    void finalize_hit(const ray& r, hit_record& rec) const override {
+        rec.p = r.at(rec.t);
+        rec.u = rec.b1;
+        rec.v = rec.b2;
+        rec.mat = mat.get();
         rec.set_face_normal(r, normal);
+    }
 
-        return true;
+    bool occluded(const ray& r, interval ray_t) const override {
+        double t, alpha, beta;
+        return plane_hit(r, ray_t, t, alpha, beta) && is_interior(alpha, beta);
     }
 
 
@@ -65,14 +64,9 @@ public:
 
 
     // Check if barycentric coordiantes are inside quad
-    virtual bool is_interior(double a, double b, hit_record& rec) const {
+    virtual bool is_interior(double a, double b) const {
         interval unit_interval = interval(0, 1);
-        if (!unit_interval.contains(a) || !unit_interval.contains(b))
-            return false;
-
-        rec.u = a;
-        rec.v = b;
-        return true;
+        return unit_interval.contains(a) && unit_interval.contains(b);
     }
 
 
@@ -84,14 +78,33 @@ private:
     aabb bbox;
     vec3 normal;
     double D;
+
+    // Ray parameter and planar coordinates of the hit on the quad's plane
+    bool plane_hit(const ray& r, const interval& ray_t, double& t, double& alpha, double& beta) const {
+        WICKED_STAT(primitives_tested);
+        auto denom = dot(normal, r.direction());
+
+        if (std::fabs(denom) < 1e-8)
+            return false;
+
+        t = (D - dot(normal, r.origin())) / denom;
+        if (!ray_t.contains(t))
+            return false;
+
+        vec3 planar_hitpt_vector = r.at(t) - Q;
+        alpha = dot(w, cross(planar_hitpt_vector, v));
+        beta = dot(w, cross(u, planar_hitpt_vector));
+        return true;
+    }
 };
 
 
 
 
 
-// Helper function to create a box from quads
-inline shared_ptr<hittable_list> box(const point3& a, const point3& b, shared_ptr<material> mat) {
+// Box as a list of six quads, how box() used to build it. Kept for comparison in
+// wicked_bench; box() in box.h is a single slab-tested primitive.
+inline shared_ptr<hittable_list> box_from_quads(const point3& a, const point3& b, shared_ptr<material> mat) {
     auto sides = make_shared<hittable_list>();
 
     auto min = point3(std::fmin(a.x(),b.x()), std::fmin(a.y(),b.y()), std::fmin(a.z(),b.z()));
@@ -0,0 +1,71 @@
+#ifndef RAY_SORT_H
+#define RAY_SORT_H
+
+#include "wicked.h"
+#include "aabb.h"
+#include "lbvh_build.h"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+
+// Orders a batch of rays so that rays likely to visit the same BVH nodes are traced one
+// after another. After a diffuse bounce neighbouring paths scatter all over the scene,
+// and tracing them in batch order walks a different part of the tree for every ray. The
+// key is the direction octant (3 bits) above the 27-bit Morton code of the origin within
+// the batch's own origin bounds, so rays leaving the same region the same way end up
+// adjacent. The bounds come from the batch rather than the scene, which stays finite
+// even with an infinite ground plane in the world.
+class ray_sorter {
+public:
+    // Indices 0..count-1 sorted by key; ray_of(k) returns ray k. The vector is reused
+    // by the next call. One counting sort pass on the top key_bits of the key: a batch
+    // of a few thousand rays gains nothing from finer cells than that.
+    template <typename RayOf>
+    const std::vector<int>& sort(size_t count, const RayOf& ray_of) {
+        aabb bounds = aabb::empty;
+        for (size_t k = 0; k < count; k++) {
+            const point3& p = ray_of(k).origin();
+            bounds = aabb(bounds, aabb(p, p));
+        }
+
+        keys.resize(count);
+        std::fill(std::begin(offsets), std::end(offsets), 0);
+        for (size_t k = 0; k < count; k++) {
+            keys[k] = key(ray_of(k), bounds) >> (30 - key_bits);
+            offsets[keys[k] + 1]++;
+        }
+        for (int b = 0; b < bucket_count; b++)
+            offsets[b + 1] += offsets[b];
+
+        order.resize(count);
+        for (size_t k = 0; k < count; k++)
+            order[offsets[keys[k]]++] = int(k);
+        return order;
+    }
+
+    // Direction octant in bits 27-29, origin Morton code (9 bits per axis) below
+    static std::uint32_t key(const ray& r, const aabb& bounds) {
+        const vec3& d = r.direction();
+        std::uint32_t octant = (std::uint32_t(d.x() < 0) << 2) | (std::uint32_t(d.y() < 0) << 1)
+                             | std::uint32_t(d.z() < 0);
+        double p[3];
+        for (int a = 0; a < 3; a++) {
+            const auto& extent = bounds.axis_interval(a);
+            p[a] = extent.size() > 0 ? (r.origin()[a] - extent.min) / extent.size() : 0.5;
+        }
+        return (octant << 27) | (lbvh_builder::morton_code(p[0], p[1], p[2]) >> 3);
+    }
+
+
+
+private:
+    static constexpr int key_bits = 12;  // Octant and 3 Morton levels: 8 x 512 cells
+    static constexpr int bucket_count = 1 << key_bits;
+
+    std::vector<std::uint32_t> keys;
+    std::vector<int> order;
+    int offsets[bucket_count + 1];
+};
+
+#endif
@@ -0,0 +1,196 @@
+#ifndef REPORT_H
+#define REPORT_H
+
+#include "wicked.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+
+// Wall time of each render() stage, filled by camera
+struct render_timings {
+    double render_seconds = 0;                // Wall time of the parallel tracing stage
+    std::vector<double> thread_busy_seconds;  // Time each thread spent tracing
+    double denoise_seconds = 0;               // 0 when the denoiser is off
+    double tone_map_seconds = 0;
+    double output_seconds = 0;
+};
+
+
+
+// Peak resident set size of the process in bytes (0 if unknown)
+inline std::uint64_t peak_rss_bytes() {
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#if defined(__APPLE__)
+    return std::uint64_t(usage.ru_maxrss);         // bytes on macOS
+#else
+    return std::uint64_t(usage.ru_maxrss) * 1024;  // kilobytes on Linux
+#endif
+#else
+    return 0;
+#endif
+}
+
+
+
+
+
+// Phase timings and throughput numbers for one run, written as JSON next to the image
+class run_report {
+public:
+    using clock = std::chrono::steady_clock;
+
+    run_report() : start(clock::now()) {}
+
+
+
+    // Times a phase from construction until end() or the end of the scope (no-op for nullptr)
+    class phase_timer {
+    public:
+        phase_timer(run_report* report, std::string name)
+            : report(report), name(std::move(name)), start(clock::now()) {}
+
+        phase_timer(const phase_timer&) = delete;
+        phase_timer& operator=(const phase_timer&) = delete;
+
+        ~phase_timer() { end(); }
+
+        void end() {
+            if (!report) return;
+            report->add_phase(name, std::chrono::duration<double>(clock::now() - start).count());
+            report = nullptr;
+        }
+
+    private:
+        run_report* report;
+        std::string name;
+        clock::time_point start;
+    };
+
+    phase_timer phase(const std::string& name) { return phase_timer(this, name); }
+
+
+
+    void add_phase(const std::string& name, double seconds) {
+        for (auto& p : phases) {
+            if (p.first == name) {
+                p.second += seconds;
+                return;
+            }
+        }
+        phases.emplace_back(name, seconds);
+    }
+
+    void set(const std::string& key, double value) { put(key, number(value)); }
+    void set(const std::string& key, std::uint64_t value) { put(key, std::to_string(value)); }
+    void set(const std::string& key, const std::string& value) { put(key, "\"" + escape(value) + "\""); }
+    void set(const std::string& key, const char* value) { set(key, std::string(value)); }  // Not the bool one
+    void set(const std::string& key, bool value) { put(key, value ? "true" : "false"); }
+
+
+
+    // Render, tone mapping and output phases plus per-thread busy/idle time and throughput
+    void add_render(const render_timings& timings, std::uint64_t rays, std::uint64_t samples,
+                    int width, int height) {
+        add_phase("render", timings.render_seconds);
+        if (timings.denoise_seconds > 0)
+            add_phase("denoise", timings.denoise_seconds);
+        add_phase("tone_map", timings.tone_map_seconds);
+        add_phase("output", timings.output_seconds);
+
+        threads.clear();
+        for (auto busy : timings.thread_busy_seconds)
+            threads.emplace_back(busy, std::max(0.0, timings.render_seconds - busy));
+
+        double pixels = double(width) * height;
+        set("image_width", std::uint64_t(width));
+        set("image_height", std::uint64_t(height));
+        set("rays_traced", rays);
+        set("mrays_per_s", timings.render_seconds > 0 ? rays / timings.render_seconds / 1e6 : 0.0);
+        set("achieved_spp", pixels > 0 ? samples / pixels : 0.0);
+    }
+
+
+
+    bool write_json(const std::string& path) const {
+        std::ofstream out(path);
+        if (!out) {
+            std::cerr << "ERROR: Could not write report '" << path << "'\n";
+            return false;
+        }
+        write_json(out);
+        return true;
+    }
+
+    void write_json(std::ostream& out) const {
+        double total = std::chrono::duration<double>(clock::now() - start).count();
+
+        out << "{\n  \"total_seconds\": " << number(total)
+            << ",\n  \"peak_rss_bytes\": " << peak_rss_bytes();
+
+        for (const auto& m : metrics)
+            out << ",\n  \"" << escape(m.first) << "\": " << m.second;
+
+        out << ",\n  \"phases\": [";
+        for (size_t i = 0; i < phases.size(); i++) {
+            out << (i ? ",\n" : "\n") << "    {\"name\": \"" << escape(phases[i].first)
+                << "\", \"seconds\": " << number(phases[i].second) << "}";
+        }
+        out << "\n  ],\n  \"threads\": [";
+        for (size_t i = 0; i < threads.size(); i++) {
+            out << (i ? ",\n" : "\n") << "    {\"busy_seconds\": " << number(threads[i].first)
+                << ", \"idle_seconds\": " << number(threads[i].second) << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+
+
+private:
+    clock::time_point start;
+    std::vector<std::pair<std::string, double>> phases;       // In the order first seen
+    std::vector<std::pair<std::string, std::string>> metrics; // Values already JSON encoded
+    std::vector<std::pair<double, double>> threads;           // busy, idle seconds
+
+    void put(const std::string& key, const std::string& encoded) {
+        for (auto& m : metrics) {
+            if (m.first == key) {
+                m.second = encoded;
+                return;
+            }
+        }
+        metrics.emplace_back(key, encoded);
+    }
+
+    static std::string number(double x) {
+        if (!(x == x) || x == infinity || x == -infinity)
+            return "null";
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%.6g", x);
+        return buffer;
+    }
+
+    static std::string escape(const std::string& s) {
+        std::string out;
+        for (char c : s) {
+            if (c == '"' || c == '\\') out += '\\';
+            out += c;
+        }
+        return out;
+    }
+};
+
+#endif
@@ -0,0 +1,696 @@
+#ifndef SCENE_PARSER_H
+#define SCENE_PARSER_H
+
+#include "wicked.h"
+#include "arena.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include "quad.h"
+#include "plane.h"
+#include "box.h"
+#include "triangle.h"
+#include "triangle_mesh.h"
+#include "indexed_mesh.h"
+#include "bvh.h"
+#include "material.h"
+#include "texture.h"
+#include "report.h"
+
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+// Text scene description, one statement per line, '#' starts a comment:
+//
+//   camera  <key> <value> ...          aspect_ratio 16/9, image_width 800, samples_per_pixel 200,
+//                                      max_depth 50, background r g b, vfov 40, lookfrom x y z,
+//                                      lookat x y z, vup x y z, defocus_angle 0.3, focus_dist 5.9
+//   texture <name> solid r g b
+//   texture <name> image <file>
+//   texture <name> checker <scale> <even> <odd>
+//   texture <name> noise <scale>
+//   material <name> lambertian <albedo>
+//   material <name> metal r g b <fuzz>
+//   material <name> dielectric <refraction_index>
+//   material <name> light <emit>
+//   material <name> isotropic <albedo>
+//
+//   sphere <mat> cx cy cz <radius>
+//   moving_sphere <mat> x1 y1 z1 x2 y2 z2 <radius>
+//   quad <mat> Qx Qy Qz ux uy uz vx vy vz
+//   plane <mat> Qx Qy Qz nx ny nz                infinite, tested outside the BVH
+//   disk <mat> cx cy cz nx ny nz <radius>
+//   triangle <mat> v0 v1 v2 [n0 n1 n2]          (each a 3-vector)
+//   box <mat> ax ay az bx by bz                 axis-aligned, one slab-tested primitive
+//   oriented_box <mat> cx cy cz sx sy sz <deg>  center, size, rotation about +y
+//   medium <density> <albedo> <boundary primitive...>
+//
+//   group <name> ... end                        primitives collected into a named BVH
+//   sphere_set <name> ... end                   only sphere/moving_sphere lines, packed into
+//                                               one sphere_set (particles, sparkles, dust)
+//   triangle_mesh <name> ... end                only triangle lines, packed into one
+//                                               watertight triangle_mesh (fans, meshes)
+//   indexed_mesh <name> ... end                 vertex x y z [nx ny nz [u v]] and
+//                                               face <mat> a b c lines (0-based vertex
+//                                               indices), stored compressed (scanned assets)
+//   instance <group> [rotate_y <deg>] [translate x y z] ...   transforms applied left to right
+//
+// <albedo>, <emit>, <even> and <odd> are either "r g b" or the name of a texture.
+// Parsing is a single pass over the file: statements build the hittable graph as they are
+// read, and load_scene() wraps the result in a BVH just like wicked_scene() does.
+class scene_parser {
+public:
+    scene_parser(hittable_list& world, camera& cam, scene_arena& arena,
+                 const bvh_build_options& bvh_options = bvh_build_options())
+        : world(world), cam(cam), arena(arena), images(arena), bvh_options(bvh_options) {}
+
+
+
+    bool parse_file(const std::string& path) {
+        std::string text;
+        if (!read_file(path, text)) {
+            std::cerr << "ERROR: Could not read scene file '" << path << "'.\n";
+            return false;
+        }
+
+        return parse(text.data(), text.data() + text.size(), path);
+    }
+
+
+
+    bool parse(const char* begin, const char* end, const std::string& source_name) {
+        source = source_name;
+        line_number = 0;
+        groups.clear();
+
+        for (const char* line = begin; line < end; ) {
+            auto newline = static_cast<const char*>(std::memchr(line, '\n', end - line));
+            line_end = newline ? newline : end;
+            cursor = line;
+            line_number++;
+
+            if (!parse_statement())
+                return false;
+
+            line = line_end + 1;
+        }
+
+        if (!groups.empty())
+            return error("group '" + groups.back().name + "' is missing 'end'");
+
+        return true;
+    }
+
+    size_t primitive_count() const { return primitives; }
+
+    // Waits for the image textures the file loaded, which decode while parsing and
+    // building go on; call before rendering. False if any image failed to load.
+    bool wait_for_textures() { return images.wait(); }
+
+
+
+private:
+    struct open_group {
+        std::string name;
+        hittable_list objects;
+        shared_ptr<sphere_set> spheres;       // Set for sphere_set blocks
+        shared_ptr<triangle_mesh> triangles;  // Set for triangle_mesh blocks
+        shared_ptr<indexed_mesh> indexed;     // Set for indexed_mesh blocks
+    };
+
+    hittable_list& world;
+    camera& cam;
+    scene_arena& arena;             // Everything the file declares is allocated here
+    texture_loader images;          // Image textures decode in the background
+    bvh_build_options bvh_options;  // Used for group BVHs
+
+    std::map<std::string, shared_ptr<texture>, std::less<>> textures;
+    std::map<std::string, shared_ptr<material>, std::less<>> materials;
+    std::map<std::string, shared_ptr<hittable>, std::less<>> named_groups;
+    std::vector<open_group> groups;  // Currently open group statements, innermost last
+    size_t primitives = 0;
+
+    std::string source;
+    int line_number = 0;
+    const char* cursor = nullptr;
+    const char* line_end = nullptr;
+
+
+
+
+
+    // Tokenizing
+    std::string_view next_token() {
+        while (cursor < line_end && (*cursor == ' ' || *cursor == '\t' || *cursor == '\r'))
+            cursor++;
+        if (cursor == line_end || *cursor == '#')
+            return {};
+
+        const char* start = cursor;
+        while (cursor < line_end && *cursor != ' ' && *cursor != '\t' && *cursor != '\r' && *cursor != '#')
+            cursor++;
+        return std::string_view(start, cursor - start);
+    }
+
+    std::string_view peek_token() {
+        const char* saved = cursor;
+        auto token = next_token();
+        cursor = saved;
+        return token;
+    }
+
+    bool error(const std::string& message) const {
+        std::cerr << "ERROR: " << source << ":" << line_number << ": " << message << "\n";
+        return false;
+    }
+
+    static bool is_number(std::string_view token) {
+        if (token.empty()) return false;
+        char c = token[0];
+        return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.';
+    }
+
+    bool number(double& x) {
+        auto token = next_token();
+        auto result = std::from_chars(token.data(), token.data() + token.size(), x);
+        if (token.empty() || result.ec != std::errc() || result.ptr != token.data() + token.size())
+            return error("expected a number, found '" + std::string(token) + "'");
+        return true;
+    }
+
+    bool integer(int& x) {
+        auto token = next_token();
+        auto result = std::from_chars(token.data(), token.data() + token.size(), x);
+        if (token.empty() || result.ec != std::errc() || result.ptr != token.data() + token.size())
+            return error("expected an integer, found '" + std::string(token) + "'");
+        return true;
+    }
+
+    bool vector(vec3& v) {
+        return number(v[0]) && number(v[1]) && number(v[2]);
+    }
+
+    bool end_of_line() {
+        auto token = next_token();
+        if (!token.empty())
+            return error("unexpected '" + std::string(token) + "'");
+        return true;
+    }
+
+
+
+
+
+    bool parse_statement() {
+        auto keyword = next_token();
+        if (keyword.empty()) return true;
+
+        if (keyword == "camera")        return parse_camera();
+        if (keyword == "texture")       return parse_texture();
+        if (keyword == "material")      return parse_material();
+        if (keyword == "group")         return parse_group(keyword);
+        if (keyword == "sphere_set")    return parse_group(keyword);
+        if (keyword == "triangle_mesh") return parse_group(keyword);
+        if (keyword == "indexed_mesh")  return parse_group(keyword);
+        if (keyword == "end")           return parse_group_end();
+        if (!groups.empty() && groups.back().spheres)
+            return parse_set_sphere(keyword, *groups.back().spheres);
+        if (!groups.empty() && groups.back().triangles)
+            return parse_mesh_triangle(keyword, *groups.back().triangles);
+        if (!groups.empty() && groups.back().indexed)
+            return parse_indexed_mesh_line(keyword, *groups.back().indexed);
+
+        shared_ptr<hittable> object;
+        if (!parse_object(keyword, object) || !end_of_line())
+            return false;
+
+        add(object);
+        return true;
+    }
+
+    void add(const shared_ptr<hittable>& object) {
+        if (groups.empty())
+            world.add(object);
+        else
+            groups.back().objects.add(object);
+    }
+
+
+
+    // Primitives, media and instances (also used for a medium's boundary)
+    bool parse_object(std::string_view keyword, shared_ptr<hittable>& object) {
+        if (keyword == "sphere") {
+            shared_ptr<material> mat;
+            point3 center;
+            double radius;
+            if (!material_ref(mat) || !vector(center) || !number(radius)) return false;
+            object = arena.make<sphere>(center, radius, mat);
+        }
+        else if (keyword == "moving_sphere") {
+            shared_ptr<material> mat;
+            point3 center1, center2;
+            double radius;
+            if (!material_ref(mat) || !vector(center1) || !vector(center2) || !number(radius))
+                return false;
+            object = arena.make<sphere>(center1, center2, radius, mat);
+        }
+        else if (keyword == "quad") {
+            shared_ptr<material> mat;
+            point3 Q;
+            vec3 u, v;
+            if (!material_ref(mat) || !vector(Q) || !vector(u) || !vector(v)) return false;
+            object = arena.make<quad>(Q, u, v, mat);
+        }
+        else if (keyword == "plane") {
+            shared_ptr<material> mat;
+            point3 Q;
+            vec3 normal;
+            if (!material_ref(mat) || !vector(Q) || !vector(normal)) return false;
+            if (normal.near_zero()) return error("plane normal must not be zero");
+            object = arena.make<plane>(Q, normal, mat);
+        }
+        else if (keyword == "disk") {
+            shared_ptr<material> mat;
+            point3 center;
+            vec3 normal;
+            double radius;
+            if (!material_ref(mat) || !vector(center) || !vector(normal) || !number(radius)) return false;
+            if (normal.near_zero()) return error("disk normal must not be zero");
+            object = arena.make<disk>(center, normal, radius, mat);
+        }
+        else if (keyword == "triangle") {
+            shared_ptr<material> mat;
+            point3 v0, v1, v2;
+            if (!material_ref(mat) || !vector(v0) || !vector(v1) || !vector(v2)) return false;
+
+            if (peek_token().empty()) {
+                object = arena.make<triangle>(v0, v1, v2, mat);
+            } else {
+                vec3 n0, n1, n2;
+                if (!vector(n0) || !vector(n1) || !vector(n2)) return false;
+                object = arena.make<triangle>(v0, v1, v2, n0, n1, n2, mat);
+            }
+        }
+        else if (keyword == "box") {
+            shared_ptr<material> mat;
+            point3 a, b;
+            if (!material_ref(mat) || !vector(a) || !vector(b)) return false;
+            object = box(arena, a, b, mat);
+        }
+        else if (keyword == "oriented_box") {
+            shared_ptr<material> mat;
+            point3 center;
+            vec3 size;
+            double angle;
+            if (!material_ref(mat) || !vector(center) || !vector(size) || !number(angle)) return false;
+            object = arena.make<oriented_box>(center, size / 2, angle, mat);
+        }
+        else if (keyword == "medium") {
+            double density;
+            shared_ptr<texture> tex;
+            color albedo;
+            shared_ptr<hittable> boundary;
+            if (!number(density) || !texture_or_color(tex, albedo)) return false;
+
+            auto boundary_keyword = next_token();
+            if (boundary_keyword.empty())
+                return error("medium needs a boundary primitive");
+            if (!parse_object(boundary_keyword, boundary)) return false;
+
+            object = tex ? arena.make<constant_medium>(boundary, density, tex)
+                         : arena.make<constant_medium>(boundary, density, albedo);
+        }
+        else if (keyword == "instance") {
+            return parse_instance(object);
+        }
+        else {
+            return error("unknown statement '" + std::string(keyword) + "'");
+        }
+
+        primitives++;
+        return true;
+    }
+
+
+
+    bool parse_instance(shared_ptr<hittable>& object) {
+        auto name = next_token();
+        auto found = named_groups.find(name);
+        if (found == named_groups.end())
+            return error("unknown group '" + std::string(name) + "'");
+
+        object = found->second;
+        for (auto op = next_token(); !op.empty(); op = next_token()) {
+            if (op == "translate") {
+                vec3 offset;
+                if (!vector(offset)) return false;
+                object = arena.make<translate>(object, offset);
+            } else if (op == "rotate_y") {
+                double angle;
+                if (!number(angle)) return false;
+                object = arena.make<rotate_y>(object, angle);
+            } else {
+                return error("unknown instance transform '" + std::string(op) + "'");
+            }
+        }
+        return true;
+    }
+
+
+
+    bool parse_group(std::string_view kind) {
+        auto name = next_token();
+        if (name.empty())
+            return error(std::string(kind) + " needs a name");
+
+        open_group group{std::string(name), hittable_list(), nullptr, nullptr, nullptr};
+        if (kind == "sphere_set")    group.spheres = arena.make<sphere_set>();
+        if (kind == "triangle_mesh") group.triangles = arena.make<triangle_mesh>();
+        if (kind == "indexed_mesh")  group.indexed = arena.make<indexed_mesh>();
+        groups.push_back(std::move(group));
+        return end_of_line();
+    }
+
+    bool parse_set_sphere(std::string_view keyword, sphere_set& set) {
+        shared_ptr<material> mat;
+        point3 center1, center2;
+        double radius;
+        if (keyword == "sphere") {
+            if (!material_ref(mat) || !vector(center1) || !number(radius)) return false;
+            center2 = center1;
+        } else if (keyword == "moving_sphere") {
+            if (!material_ref(mat) || !vector(center1) || !vector(center2) || !number(radius))
+                return false;
+        } else {
+            return error("only sphere and moving_sphere are allowed in a sphere_set");
+        }
+
+        set.add(center1, center2, radius, mat);
+        primitives++;
+        return end_of_line();
+    }
+
+    bool parse_mesh_triangle(std::string_view keyword, triangle_mesh& mesh) {
+        if (keyword != "triangle")
+            return error("only triangle is allowed in a triangle_mesh");
+
+        shared_ptr<material> mat;
+        point3 v0, v1, v2;
+        if (!material_ref(mat) || !vector(v0) || !vector(v1) || !vector(v2)) return false;
+
+        if (peek_token().empty()) {
+            mesh.add(v0, v1, v2, mat);
+        } else {
+            vec3 n0, n1, n2;
+            if (!vector(n0) || !vector(n1) || !vector(n2)) return false;
+            mesh.add(v0, v1, v2, n0, n1, n2, mat);
+        }
+        primitives++;
+        return end_of_line();
+    }
+
+    bool parse_indexed_mesh_line(std::string_view keyword, indexed_mesh& mesh) {
+        if (keyword == "vertex") {
+            point3 p;
+            if (!vector(p)) return false;
+            if (peek_token().empty()) {
+                mesh.add_vertex(p);
+            } else {
+                vec3 normal;
+                if (!vector(normal)) return false;
+                if (peek_token().empty()) {
+                    mesh.add_vertex(p, normal);
+                } else {
+                    double u, v;
+                    if (!number(u) || !number(v)) return false;
+                    mesh.add_vertex(p, normal, u, v);
+                }
+            }
+            return end_of_line();
+        }
+        if (keyword != "face")
+            return error("only vertex and face are allowed in an indexed_mesh");
+
+        shared_ptr<material> mat;
+        int corners[3];
+        if (!material_ref(mat) || !integer(corners[0]) || !integer(corners[1]) || !integer(corners[2]))
+            return false;
+        for (int corner : corners)
+            if (corner < 0 || size_t(corner) >= mesh.vertex_count())
+                return error("face refers to vertex " + std::to_string(corner) + ", the mesh has "
+                             + std::to_string(mesh.vertex_count()));
+        mesh.add_triangle(corners[0], corners[1], corners[2], mat);
+        primitives++;
+        return end_of_line();
+    }
+
+    bool parse_group_end() {
+        if (groups.empty())
+            return error("'end' without 'group'");
+
+        auto group = std::move(groups.back());
+        groups.pop_back();
+
+        shared_ptr<hittable> object;
+        if (group.spheres) {
+            group.spheres->build(bvh_options);
+            object = group.spheres;
+        }
+        else if (group.triangles) {
+            group.triangles->build(bvh_options);
+            object = group.triangles;
+        }
+        else if (group.indexed) {
+            group.indexed->build(bvh_options);
+            object = group.indexed;
+        }
+        else if (group.objects.objects.empty())
+            object = arena.make<hittable_list>();
+        else
+            object = arena.make<bvh_node>(group.objects, bvh_options);
+
+        named_groups[group.name] = object;
+        return end_of_line();
+    }
+
+
+
+    bool parse_camera() {
+        for (auto key = next_token(); !key.empty(); key = next_token()) {
+            bool ok;
+            if (key == "aspect_ratio")           ok = aspect_ratio(cam.aspect_ratio);
+            else if (key == "image_width")       ok = integer(cam.image_width);
+            else if (key == "samples_per_pixel") ok = integer(cam.samples_per_pixel);
+            else if (key == "max_depth")         ok = integer(cam.max_depth);
+            else if (key == "background")        ok = vector(cam.background);
+            else if (key == "vfov")              ok = number(cam.vfov);
+            else if (key == "lookfrom")          ok = vector(cam.lookfrom);
+            else if (key == "lookat")            ok = vector(cam.lookat);
+            else if (key == "vup")               ok = vector(cam.vup);
+            else if (key == "defocus_angle")     ok = number(cam.defocus_angle);
+            else if (key == "focus_dist")        ok = number(cam.focus_dist);
+            else return error("unknown camera field '" + std::string(key) + "'");
+
+            if (!ok) return false;
+        }
+        return true;
+    }
+
+    // Either a plain number or "width/height"
+    bool aspect_ratio(double& ratio) {
+        auto token = next_token();
+        auto slash = token.find('/');
+        if (slash == std::string_view::npos) {
+            auto result = std::from_chars(token.data(), token.data() + token.size(), ratio);
+            if (token.empty() || result.ec != std::errc())
+                return error("expected an aspect ratio, found '" + std::string(token) + "'");
+            return true;
+        }
+
+        double w = 0, h = 0;
+        auto r1 = std::from_chars(token.data(), token.data() + slash, w);
+        auto r2 = std::from_chars(token.data() + slash + 1, token.data() + token.size(), h);
+        if (r1.ec != std::errc() || r2.ec != std::errc() || h == 0)
+            return error("expected an aspect ratio, found '" + std::string(token) + "'");
+        ratio = w / h;
+        return true;
+    }
+
+
+
+
+
+    bool parse_texture() {
+        auto name = next_token();
+        auto type = next_token();
+        shared_ptr<texture> tex;
+
+        if (type == "solid") {
+            color albedo;
+            if (!vector(albedo)) return false;
+            tex = arena.intern<solid_color>(albedo);
+        }
+        else if (type == "image") {
+            auto filename = std::string(next_token());
+            if (filename.empty())
+                return error("image texture needs a file name");
+            tex = images.load(filename);
+        }
+        else if (type == "checker") {
+            double scale;
+            shared_ptr<texture> even, odd;
+            if (!number(scale) || !texture_ref(even) || !texture_ref(odd)) return false;
+            tex = arena.intern<checker_texture>(scale, even, odd);
+        }
+        else if (type == "noise") {
+            double scale;
+            if (!number(scale)) return false;
+            tex = arena.make<noise_texture>(scale);
+        }
+        else {
+            return error("unknown texture type '" + std::string(type) + "'");
+        }
+
+        textures[std::string(name)] = tex;
+        return end_of_line();
+    }
+
+
+
+    bool parse_material() {
+        auto name = next_token();
+        auto type = next_token();
+        shared_ptr<material> mat;
+        shared_ptr<texture> tex;
+        color c;
+
+        if (type == "lambertian") {
+            if (!texture_or_color(tex, c)) return false;
+            mat = tex ? arena.intern<lambertian>(tex) : arena.intern<lambertian>(c);
+        }
+        else if (type == "metal") {
+            double fuzz;
+            if (!vector(c) || !number(fuzz)) return false;
+            mat = arena.intern<metal>(c, fuzz);
+        }
+        else if (type == "dielectric") {
+            double refraction_index;
+            if (!number(refraction_index)) return false;
+            mat = arena.intern<dielectric>(refraction_index);
+        }
+        else if (type == "light") {
+            if (!texture_or_color(tex, c)) return false;
+            mat = tex ? arena.intern<diffuse_light>(tex) : arena.intern<diffuse_light>(c);
+        }
+        else if (type == "isotropic") {
+            if (!texture_or_color(tex, c)) return false;
+            mat = tex ? arena.intern<isotropic>(tex) : arena.intern<isotropic>(c);
+        }
+        else {
+            return error("unknown material type '" + std::string(type) + "'");
+        }
+
+        materials[std::string(name)] = mat;
+        return end_of_line();
+    }
+
+
+
+
+
+    // Name lookups
+    bool material_ref(shared_ptr<material>& mat) {
+        auto name = next_token();
+        auto found = materials.find(name);
+        if (found == materials.end())
+            return error("unknown material '" + std::string(name) + "'");
+        mat = found->second;
+        return true;
+    }
+
+    // Texture name, or an inline "r g b" turned into a solid_color
+    bool texture_ref(shared_ptr<texture>& tex) {
+        color c;
+        if (!texture_or_color(tex, c)) return false;
+        if (!tex) tex = arena.intern<solid_color>(c);
+        return true;
+    }
+
+    // Texture name (sets tex) or an inline "r g b" (sets c, leaves tex empty)
+    bool texture_or_color(shared_ptr<texture>& tex, color& c) {
+        if (is_number(peek_token()))
+            return vector(c);
+
+        auto name = next_token();
+        auto found = textures.find(name);
+        if (found == textures.end())
+            return error("unknown texture '" + std::string(name) + "'");
+        tex = found->second;
+        return true;
+    }
+
+
+
+    static bool read_file(const std::string& path, std::string& text) {
+        std::FILE* file = std::fopen(path.c_str(), "rb");
+        if (!file) return false;
+
+        std::fseek(file, 0, SEEK_END);
+        long size = std::ftell(file);
+        std::fseek(file, 0, SEEK_SET);
+        if (size < 0) {
+            std::fclose(file);
+            return false;
+        }
+
+        text.resize(size_t(size));
+        bool ok = std::fread(text.data(), 1, text.size(), file) == text.size();
+        std::fclose(file);
+        return ok;
+    }
+};
+
+
+
+
+
+// Loads a scene file into world (wrapped in a BVH) and configures the camera.
+// Parse, BVH build and the wait for texture decodes are timed into report when given.
+inline bool load_scene(const std::string& path, hittable_list& world, camera& cam,
+                       scene_arena& arena, run_report* report = nullptr,
+                       const bvh_build_options& bvh_options = bvh_build_options()) {
+    scene_memory().reset();  // As in wicked_scene(), tallies count this scene only
+    bvh_memory().reset();
+
+    hittable_list objects;
+    scene_parser parser(objects, cam, arena, bvh_options);
+
+    {
+        run_report::phase_timer parse_timer(report, "scene_parse");
+        if (!parser.parse_file(path))
+            return false;
+    }
+
+    if (objects.objects.empty()) {
+        std::cerr << "ERROR: Scene file '" << path << "' has no objects.\n";
+        return false;
+    }
+
+    run_report::phase_timer bvh_timer(report, "bvh_build");
+    world = hittable_list(arena.make<bvh_node>(objects, bvh_options));
+    bvh_timer.end();
+
+    // A missing image renders cyan, as before, rather than failing the load
+    run_report::phase_timer decode_timer(report, "texture_decode");
+    parser.wait_for_textures();
+    return true;
+}
+
+#endif
@@ -0,0 +1,401 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "wicked.h"
+#include "arena.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include "quad.h"
+#include "box.h"
+#include "triangle.h"
+#include "triangle_mesh.h"
+#include "bvh.h"
+#include "material.h"
+#include "texture.h"
+#include "report.h"
+#include <vector>
+
+
+
+// REQUIREMENT: Visible features shown in Glinda's pink bubble scene
+// Builds the Wicked scene into world and sets up the camera (shared by main and bench)
+// Scene construction, BVH build and the wait for texture decodes are timed into report
+// when given
+// Objects are allocated from arena
+inline void wicked_scene(hittable_list& world, camera& cam, scene_arena& arena,
+                         run_report* report = nullptr,
+                         const bvh_build_options& bvh_options = bvh_build_options()) {
+    // Memory tallies count this scene only, not earlier loads (preview reloads, benches)
+    scene_memory().reset();
+    bvh_memory().reset();
+
+
+
+
+    // REQUIREMENT: Texture loading: Load image textures from files
+    // Decoded on the task pool during construction and BVH build, waited for at the end
+    texture_loader images(arena);
+    auto pink_gradient = images.load("textures/pink_gradient.jpg");
+    auto sparkle_texture = images.load("textures/sparkle.png");
+
+    run_report::phase_timer construction_timer(report, "scene_construction");
+    
+
+
+
+
+    // REQUIREMENT: Dielectric material: outter glass-like bubble (small sphere in the front)
+    auto bubble_material = arena.intern<dielectric>(1.3);
+    
+
+
+
+
+    // REQUIREMENT: Diffuse material with texture: inner bubble in the center uses pink gradient
+    auto textured_pink = arena.intern<lambertian>(pink_gradient);
+    
+
+
+
+
+    // Main bubble sphere, REQUIREMENT: Ray/sphere intersections & textured spheres
+    auto bubble_center = point3(0, 1.0, 0);
+    auto bubble_radius = 1.0;
+    
+
+
+
+    // Outer glass layer on main bubble, REQUIREMENT: Dielectric material
+    world.add(arena.make<sphere>(bubble_center, bubble_radius, bubble_material));
+    
+
+
+
+    // Inner textured layer, REQUIREMENT: Textured spheres with pink gradient
+    world.add(arena.make<sphere>(bubble_center, bubble_radius - 0.02, textured_pink));
+    
+
+
+
+    // REQUIREMENT: Textured sphere with sparkle texture (the far right shpere)
+    auto sparkle_material = arena.intern<lambertian>(sparkle_texture);
+    world.add(arena.make<sphere>(point3(2.2, 0.9, -0.8), 0.9, sparkle_material));
+    
+
+
+
+    // REQUIREMENT: Specular material, reflective metal (seen on small sphere in the front)
+    auto shiny_pink = arena.intern<metal>(color(1.0, 0.7, 0.9), 0.1);
+    
+
+
+
+    // REQUIREMENT: Motion blur, floating sparkles around the main sphere (cause it needs to be magical and stuff!)
+    auto sparkles = arena.make<sphere_set>();
+    for (int i = 0; i < 30; i++) {
+        double theta = random_double(0, 2*pi);
+        double phi = random_double(0, pi);
+        double r = bubble_radius + random_double(0.1, 0.5);
+        
+        auto x = r * std::sin(phi) * std::cos(theta);
+        auto y = 1.0 + r * std::cos(phi);
+        auto z = r * std::sin(phi) * std::sin(theta);
+        
+        point3 center1(x, y, z);
+        point3 center2 = center1 + vec3(random_double(-0.1, 0.1), 
+                                        random_double(-0.05, 0.05), 
+                                        random_double(-0.1, 0.1));
+        
+
+        // REQUIREMENT: Emissive materials (lights), glowing pink sparkles around main sphere
+        auto sparkle_mat = arena.intern<diffuse_light>(color(1.0, 0.5, 0.95) * random_double(4, 8));
+        sparkles->add(center1, center2, 0.025, sparkle_mat);
+    }
+    sparkles->build(bvh_options);
+    world.add(sparkles);
+    
+
+
+
+
+    // Ground with checker pattern, REQUIREMENT: Diffuse material
+    auto checker = arena.intern<checker_texture>(0.8, color(0.1, 0.3, 0.2), color(0.15, 0.4, 0.3));
+    auto ground_mat = arena.intern<lambertian>(checker);
+    world.add(arena.make<sphere>(point3(0, -1000, 0), 1000, ground_mat));
+    
+
+
+
+
+    // REQUIREMENT: Quads, dark gold platform beneath main bubble with gradient texture
+    auto platform_mat = arena.intern<lambertian>(color(0.4, 0.3, 0.05));
+    world.add(arena.make<quad>(point3(-2, 0, -2), vec3(4, 0, 0), vec3(0, 0, 4), platform_mat));
+    
+
+
+
+
+    // REQUIREMENT: Ray/triangle intersections with normal interpolation (smooth shading)
+    // REQUIREMENT: Textured triangles using gradient texture, star shape with connected edges (this took forever, was playing with fire here honestly)
+    auto textured_triangle_mat = arena.intern<lambertian>(pink_gradient);
+    
+
+
+
+    // 5-pointed star (made of triangles) with all triangles connected
+    point3 star_center(-2.8, 1.8, -0.5);
+    double star_outer_radius = 1.1;
+    double star_inner_radius = 0.45;
+    
+    
+
+
+    // Generate all 10 points
+    std::vector<point3> star_points;
+    for (int i = 0; i < 10; i++) {
+        double angle = i * pi / 5 - pi/2;  
+        double radius = (i % 2 == 0) ? star_outer_radius : star_inner_radius;
+        star_points.push_back(point3(
+            star_center.x() + radius * std::cos(angle),
+            star_center.y() + radius * std::sin(angle),
+            star_center.z()
+        ));
+    }
+    
+
+
+
+
+    // Create triangles connecting center to each edge of the star, as one watertight mesh
+    vec3 normal = vec3(0, 0, 1);
+    auto star = arena.make<triangle_mesh>();
+    for (int i = 0; i < 10; i++) {
+        int next = (i + 1) % 10;
+        // REQUIREMENT: Textured triangles with loaded pink gradient texture
+        // REQUIREMENT: Normal interpolation
+        star->add(star_center, star_points[i], star_points[next], 
+                  normal, normal, normal, textured_triangle_mat);
+    }
+    star->build(bvh_options);
+    world.add(star);
+    
+
+
+
+
+    // Additional small, lit triangles seen around the main bubble for more glow
+    for (int i = 0; i < 5; i++) {
+        double angle = i * 2 * pi / 5 + pi/5;
+        double r = bubble_radius + 0.8;
+        auto x = r * std::cos(angle);
+        auto z = r * std::sin(angle);
+        
+        point3 v0(x, 0.9, z);
+        point3 v1(x + 0.1*std::cos(angle + 0.6), 1.1, z + 0.1*std::sin(angle + 0.6));
+        point3 v2(x + 0.1*std::cos(angle - 0.6), 1.1, z + 0.1*std::sin(angle - 0.6));
+        
+        vec3 n0 = unit_vector(v0 - bubble_center);
+        vec3 n1 = unit_vector(v1 - bubble_center);
+        vec3 n2 = unit_vector(v2 - bubble_center);
+        
+        auto light_triangle_mat = arena.intern<diffuse_light>(color(1.0, 0.6, 0.95) * 2.5);
+        world.add(arena.make<triangle>(v0, v1, v2, n0, n1, n2, light_triangle_mat));
+    }
+    
+
+
+
+    // REQUIREMENT: Volume rendering, mist in main bubble
+    auto boundary = arena.make<sphere>(bubble_center, bubble_radius + 0.3, 
+                                       arena.intern<dielectric>(1.5));
+    world.add(arena.make<constant_medium>(boundary, 0.5, color(1.0, 0.8, 1.0)));
+    
+
+
+
+
+    // REQUIREMENT: Perlin noise, marble-textured sphere (far left sphere) 
+    // I know, very out of place for the scene, but I wanted to implement it
+    auto perlin_texture = arena.make<noise_texture>(3.0);
+    auto perlin_mat = arena.intern<lambertian>(perlin_texture);
+    world.add(arena.make<sphere>(point3(-3.0, 0.7, 0.5), 0.7, perlin_mat));
+    
+
+
+
+    // Small sphere, REQUIREMENT: Specular material
+    world.add(arena.make<sphere>(point3(1.5, 0.3, 1), 0.3, shiny_pink));
+    
+
+
+
+    // REQUIREMENT: Emissive materials
+    auto light_mat = arena.intern<diffuse_light>(color(1, 1, 1) * 4);
+    world.add(arena.make<sphere>(point3(4, 6, 3), 1.5, light_mat));
+    
+
+    
+    // Making lights pink and bright
+    auto fill_light = arena.intern<diffuse_light>(color(1.0, 0.5, 0.9) * 3.5);
+    world.add(arena.make<quad>(point3(-3, 5, -3), vec3(2, 0, 0), vec3(0, 0, 2), fill_light));
+    
+    
+
+
+    construction_timer.end();
+
+
+
+    // REQUIREMENT: Spatial subdivision acceleration structure (BVH)
+    run_report::phase_timer bvh_timer(report, "bvh_build");
+    world = hittable_list(arena.make<bvh_node>(world, bvh_options));
+    bvh_timer.end();
+
+    run_report::phase_timer decode_timer(report, "texture_decode");
+    images.wait();
+    decode_timer.end();
+
+
+
+    // REQUIREMENT: Camera with configurable position, orientation, and field of view
+    
+
+
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.image_width = 800;
+    cam.samples_per_pixel = 200;  // REQUIREMENT: Anti-aliasing
+    cam.max_depth = 50;
+    cam.background = color(0.4, 0.18, 0.32);  // Dark pink sky
+    
+
+    cam.vfov = 40;  // REQUIREMENT: Field of view
+    cam.lookfrom = point3(3, 2, 5);  // REQUIREMENT: Configurable position
+    cam.lookat = point3(0, 1, 0);    // REQUIREMENT: Configurable orientation
+    cam.vup = vec3(0, 1, 0);         // REQUIREMENT: Configurable orientation
+    
+
+
+
+    // REQUIREMENT: Defocus blur/depth of field
+    cam.defocus_angle = 0.3;
+    cam.focus_dist = (cam.lookfrom - cam.lookat).length();
+}
+
+
+
+// Synthetic scenes for benchmarking (primitives only, BVH is left to the caller)
+
+// Random spheres scattered in a cube of the given half extent
+inline hittable_list random_spheres_scene(int count, double extent = 50) {
+    hittable_list objects;
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    double radius = extent / std::cbrt(double(count)) * 0.3;
+
+    for (int i = 0; i < count; i++) {
+        auto center = vec3::random(-extent, extent);
+        objects.add(make_shared<sphere>(center, radius * random_double(0.5, 1.0), mat));
+    }
+    return objects;
+}
+
+
+
+
+// The same distribution as random_spheres_scene, stored as a single sphere_set
+inline shared_ptr<sphere_set> particle_scene(int count, double extent = 50,
+                                             const bvh_build_options& options = bvh_build_options()) {
+    auto particles = make_shared<sphere_set>();
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    double radius = extent / std::cbrt(double(count)) * 0.3;
+
+    for (int i = 0; i < count; i++) {
+        auto center = vec3::random(-extent, extent);
+        particles->add(center, radius * random_double(0.5, 1.0), mat);
+    }
+    particles->build(options);
+    return particles;
+}
+
+
+
+
+// Large soup of small, randomly oriented triangles
+inline hittable_list triangle_soup_scene(int count, double extent = 50) {
+    hittable_list objects;
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    double size = extent / std::cbrt(double(count)) * 0.8;
+
+    for (int i = 0; i < count; i++) {
+        auto v0 = vec3::random(-extent, extent);
+        auto v1 = v0 + size * vec3::random(-1, 1);
+        auto v2 = v0 + size * vec3::random(-1, 1);
+        objects.add(make_shared<triangle>(v0, v1, v2, mat));
+    }
+    return objects;
+}
+
+
+// The same distribution as triangle_soup_scene, stored as a single triangle_mesh
+inline shared_ptr<triangle_mesh> triangle_mesh_scene(int count, double extent = 50,
+                                                     const bvh_build_options& options = bvh_build_options()) {
+    auto mesh = make_shared<triangle_mesh>();
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    double size = extent / std::cbrt(double(count)) * 0.8;
+
+    for (int i = 0; i < count; i++) {
+        auto v0 = vec3::random(-extent, extent);
+        auto v1 = v0 + size * vec3::random(-1, 1);
+        auto v2 = v0 + size * vec3::random(-1, 1);
+        mesh->add(v0, v1, v2, mat);
+    }
+    mesh->build(options);
+    return mesh;
+}
+
+
+
+
+// One tree: a triangle-fan trunk cone plus a few canopy spheres, built into its own BVH
+inline shared_ptr<hittable> forest_tree(int trunk_segments = 16) {
+    hittable_list parts;
+    auto bark = make_shared<lambertian>(color(0.35, 0.2, 0.1));
+    auto leaves = make_shared<lambertian>(color(0.1, 0.5, 0.15));
+
+    point3 apex(0, 3, 0);
+    auto trunk = make_shared<triangle_mesh>();
+    for (int i = 0; i < trunk_segments; i++) {
+        double a0 = 2*pi * i / trunk_segments;
+        double a1 = 2*pi * (i+1) / trunk_segments;
+        point3 p0(0.3*std::cos(a0), 0, 0.3*std::sin(a0));
+        point3 p1(0.3*std::cos(a1), 0, 0.3*std::sin(a1));
+        trunk->add(p0, p1, apex, bark);
+    }
+    trunk->build();
+    parts.add(trunk);
+
+    for (int i = 0; i < 8; i++) {
+        auto offset = vec3(random_double(-0.6, 0.6), random_double(2.0, 3.2), random_double(-0.6, 0.6));
+        parts.add(make_shared<sphere>(offset, random_double(0.4, 0.7), leaves));
+    }
+
+    return make_shared<bvh_node>(parts);
+}
+
+
+
+// REQUIREMENT: Object instancing, many rotated/translated copies of one tree
+inline hittable_list forest_scene(int instances, double extent = 50) {
+    hittable_list objects;
+    auto tree = forest_tree();
+
+    for (int i = 0; i < instances; i++) {
+        auto rotated = make_shared<rotate_y>(tree, random_double(0, 360));
+        auto offset = vec3(random_double(-extent, extent), 0, random_double(-extent, extent));
+        objects.add(make_shared<translate>(rotated, offset));
+    }
+    return objects;
+}
+
+#endif
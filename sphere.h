@@ -2,12 +2,15 @@
 #define SPHERE_H
 
 #include "hittable.h"
+#include "material.h"
+#include "fast_math.h"
 
 // REQUIREMENT: Ray/sphere intersections with UV mapping for textured spheres
 class sphere : public hittable {
 public:
     sphere(const point3& center, double radius, shared_ptr<material> mat)
-        : center1(center), radius(std::fmax(0,radius)), mat(mat), is_moving(false) {
+        : center1(center), radius(std::fmax(0,radius)), mat(mat), is_moving(false),
+          needs_uv(mat && mat->needs_uv()) {
         auto rvec = vec3(radius, radius, radius);
         bbox = aabb(center1 - rvec, center1 + rvec);
     }
@@ -17,7 +20,8 @@ public:
 
     // REQUIREMENT: Motion blur, "moving" sphere
     sphere(const point3& center1, const point3& center2, double radius, shared_ptr<material> mat)
-        : center1(center1), radius(std::fmax(0,radius)), mat(mat), is_moving(true) {
+        : center1(center1), radius(std::fmax(0,radius)), mat(mat), is_moving(true),
+          needs_uv(mat && mat->needs_uv()) {
         auto rvec = vec3(radius, radius, radius);
         aabb box1(center1 - rvec, center1 + rvec);
         aabb box2(center2 - rvec, center2 + rvec);
@@ -29,38 +33,39 @@ public:
 
 
     // Test ray-sphere intersection with quadratic fromula
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        point3 center = is_moving ? sphere_center(r.time()) : center1;
-        vec3 oc = center - r.origin();
-        auto a = r.direction().length_squared();
-        auto h = dot(r.direction(), oc);
-        auto c = oc.length_squared() - radius*radius;
-        auto discriminant = h*h - a*c;
-
-        if (discriminant < 0)
+    bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
+        double root;
+        if (!nearest_root(r, ray_t, root))
             return false;
 
-        auto sqrtd = std::sqrt(discriminant);
-        auto root = (h - sqrtd) / a;
-
-        if (!ray_t.surrounds(root)) {
-            root = (h + sqrtd) / a;
-            if (!ray_t.surrounds(root))
-                return false;
-        }
+        rec.record(root, this);
+        return true;
+    }
 
-        rec.t = root;
+    // UVs need acos/atan2, so they are only computed for materials that sample textures
+    void finalize_hit(const ray& r, hit_record& rec) const override {
+        point3 center = sphere_center(r.time());
         rec.p = r.at(rec.t);
         vec3 outward_normal = (rec.p - center) / radius;
         rec.set_face_normal(r, outward_normal);
-        get_sphere_uv(outward_normal, rec.u, rec.v);
-        rec.mat = mat;
+        if (needs_uv)
+            get_sphere_uv(outward_normal, rec.u, rec.v);
+        rec.mat = mat.get();
+    }
 
-        return true;
+    bool occluded(const ray& r, interval ray_t) const override {
+        double root;
+        return nearest_root(r, ray_t, root);
     }
 
     aabb bounding_box() const override { return bbox; }
 
+    scene_features features() const override {
+        scene_features features = material_features(mat);
+        features.motion_blur = is_moving;
+        return features;
+    }
+
 
 
 private:
@@ -68,19 +73,45 @@ private:
     double radius;
     shared_ptr<material> mat;
     bool is_moving;
+    bool needs_uv;
     vec3 center_vec;
     aabb bbox;
 
+    // No branch on is_moving: center_vec is zero for a static sphere
     point3 sphere_center(double time) const {
         return center1 + time*center_vec;
     }
 
+    // Nearest root inside ray_t, shared by intersect() and occluded()
+    bool nearest_root(const ray& r, const interval& ray_t, double& root) const {
+        WICKED_STAT(primitives_tested);
+        point3 center = sphere_center(r.time());
+        vec3 oc = center - r.origin();
+        auto a = r.direction().length_squared();
+        auto h = dot(r.direction(), oc);
+        auto c = oc.length_squared() - radius*radius;
+        auto discriminant = h*h - a*c;
+
+        if (discriminant < 0)
+            return false;
+
+        auto sqrtd = std::sqrt(discriminant);
+        root = (h - sqrtd) / a;
+
+        if (!ray_t.surrounds(root)) {
+            root = (h + sqrtd) / a;
+            if (!ray_t.surrounds(root))
+                return false;
+        }
+        return true;
+    }
+
 
 
     // UV mapping for textured spheres
     static void get_sphere_uv(const point3& p, double& u, double& v) {
-        auto theta = std::acos(-p.y());
-        auto phi = std::atan2(-p.z(), p.x()) + pi;
+        auto theta = math_acos(-p.y());
+        auto phi = math_atan2(-p.z(), p.x()) + pi;
         u = phi / (2*pi);
         v = theta / pi;
     }
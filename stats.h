@@ -0,0 +1,146 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "wicked.h"
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+
+// Optional traversal statistics, compiled in with -DWICKED_STATS (make stats).
+// Each thread bumps its own thread_local counters, the camera merges them once per
+// thread after rendering. Without WICKED_STATS the counters compile away entirely.
+#ifdef WICKED_STATS
+constexpr bool stats_enabled = true;
+#define WICKED_STAT(counter) (++thread_stats().counter)
+#else
+constexpr bool stats_enabled = false;
+#define WICKED_STAT(counter) ((void)0)
+#endif
+
+
+
+struct traversal_stats {
+    std::uint64_t nodes_visited = 0;      // bvh_node::hit calls
+    std::uint64_t primitives_tested = 0;  // sphere/quad/triangle/medium hit calls
+    std::uint64_t paths = 0;              // camera rays
+    std::uint64_t bounces = 0;            // ray_color calls that traced a segment
+
+    traversal_stats& operator+=(const traversal_stats& s) {
+        nodes_visited += s.nodes_visited;
+        primitives_tested += s.primitives_tested;
+        paths += s.paths;
+        bounces += s.bounces;
+        return *this;
+    }
+
+    traversal_stats operator-(const traversal_stats& s) const {
+        traversal_stats d;
+        d.nodes_visited = nodes_visited - s.nodes_visited;
+        d.primitives_tested = primitives_tested - s.primitives_tested;
+        d.paths = paths - s.paths;
+        d.bounces = bounces - s.bounces;
+        return d;
+    }
+};
+
+inline traversal_stats& thread_stats() {
+    static thread_local traversal_stats stats;
+    return stats;
+}
+
+
+
+
+// Per-pixel statistics, filled only when stats are enabled
+struct pixel_stats {
+    int width = 0, height = 0;
+    std::vector<std::uint32_t> nodes;        // BVH nodes visited per pixel
+    std::vector<std::uint32_t> primitives;   // Primitive tests per pixel
+    std::vector<float> path_length;          // Average bounces per path
+
+    void resize(int w, int h) {
+        width = w;
+        height = h;
+        nodes.assign(size_t(w) * h, 0);
+        primitives.assign(size_t(w) * h, 0);
+        path_length.assign(size_t(w) * h, 0);
+    }
+
+    void record(int i, int j, const traversal_stats& s) {
+        auto index = size_t(j) * width + i;
+        nodes[index] = std::uint32_t(s.nodes_visited);
+        primitives[index] = std::uint32_t(s.primitives_tested);
+        path_length[index] = s.paths ? float(double(s.bounces) / s.paths) : 0.0f;
+    }
+};
+
+
+
+
+
+// False colour ramp: black -> blue -> green -> yellow -> red -> white for t in [0,1]
+inline color heatmap_color(double t) {
+    static const color stops[] = {
+        color(0, 0, 0), color(0, 0, 1), color(0, 1, 0),
+        color(1, 1, 0), color(1, 0, 0), color(1, 1, 1)
+    };
+    const int last = 5;
+
+    t = interval(0, 1).clamp(t) * last;
+    int k = std::min(int(t), last - 1);
+    double f = t - k;
+    return (1 - f) * stops[k] + f * stops[k+1];
+}
+
+
+
+// Writes values as a false colour PPM, scaled so the 99th percentile maps to the hottest colour
+template <typename T>
+bool write_heatmap(const std::string& filename, const std::vector<T>& values, int width, int height) {
+    std::ofstream out(filename);
+    if (!out) {
+        std::cerr << "ERROR: Could not write heatmap '" << filename << "'\n";
+        return false;
+    }
+
+    std::vector<T> sorted(values);
+    auto p99 = sorted.begin() + (sorted.size() * 99) / 100;
+    if (p99 == sorted.end() && !sorted.empty()) --p99;
+    double scale = 0;
+    if (p99 != sorted.end()) {
+        std::nth_element(sorted.begin(), p99, sorted.end());
+        scale = (*p99 > 0) ? 1.0 / double(*p99) : 0;
+    }
+
+    out << "P3\n" << width << ' ' << height << "\n255\n";
+    for (const auto& value : values) {
+        auto c = heatmap_color(double(value) * scale);
+        out << int(255.999 * c.x()) << ' ' << int(255.999 * c.y()) << ' '
+            << int(255.999 * c.z()) << '\n';
+    }
+    return true;
+}
+
+
+
+// Writes the three heatmaps as <prefix>_nodes.ppm, <prefix>_primitives.ppm, <prefix>_path_length.ppm
+inline void write_heatmaps(const std::string& prefix, const pixel_stats& stats) {
+    write_heatmap(prefix + "_nodes.ppm", stats.nodes, stats.width, stats.height);
+    write_heatmap(prefix + "_primitives.ppm", stats.primitives, stats.width, stats.height);
+    write_heatmap(prefix + "_path_length.ppm", stats.path_length, stats.width, stats.height);
+}
+
+inline void print_stats(std::ostream& out, const traversal_stats& s) {
+    auto per_path = [&](std::uint64_t n) { return s.paths ? double(n) / s.paths : 0.0; };
+    out << "Paths: " << s.paths << ", bounces: " << s.bounces
+        << " (" << per_path(s.bounces) << " per path)\n"
+        << "BVH nodes visited: " << s.nodes_visited
+        << " (" << per_path(s.nodes_visited) << " per path)\n"
+        << "Primitives tested: " << s.primitives_tested
+        << " (" << per_path(s.primitives_tested) << " per path)\n";
+}
+
+#endif
@@ -3,17 +3,65 @@
 
 #include "wicked.h"
 #include "perlin.h"
+#include "fast_math.h"
+#include "arena.h"
+#include "parallel.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "external/stb_image.h"
 
 #include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+class texture;
+
+// A texture lowered to what shading evaluates, kept inline in the material: a constant
+// color, a checker of two constant colors, or one virtual call into any other texture.
+// Constant and checker textures thus cost no indirect call, and constant colors need
+// no texture object at all.
+struct flat_texture {
+    enum class op : unsigned char { constant, checker, call };
+
+    op code = op::constant;
+    bool uses_uv = false;
+    color even, odd;          // The constant is in even
+    double inv_scale = 0;     // Checker cell frequency
+    const texture* tex = nullptr;  // For call
+
+    static flat_texture constant(const color& c) {
+        flat_texture flat;
+        flat.even = c;
+        return flat;
+    }
+
+    bool is_constant() const { return code == op::constant; }
+
+    inline color value(double u, double v, const point3& p) const;
+};
+
+
+
+
 
 // Base class for all texture types
 class texture {
 public:
     virtual ~texture() = default;
     virtual color value(double u, double v, const point3& p) const = 0;
+
+    // False for textures that ignore (u,v), so hits skip computing UVs for them
+    virtual bool needs_uv() const { return true; }
+
+    // This texture in flat form; textures that cannot fold are called through
+    virtual flat_texture flatten() const {
+        flat_texture flat;
+        flat.code = flat_texture::op::call;
+        flat.uses_uv = needs_uv();
+        flat.tex = this;
+        return flat;
+    }
 };
 
 class solid_color : public texture {
@@ -25,6 +73,10 @@ public:
         return albedo;
     }
 
+    bool needs_uv() const override { return false; }
+
+    flat_texture flatten() const override { return flat_texture::constant(albedo); }
+
 private:
     color albedo;
 };
@@ -35,30 +87,48 @@ private:
 // REQUIREMENT: Texture loading from files
 class image_texture : public texture {
 public:
-    image_texture(const char* filename) : data(nullptr), width(0), height(0) {
-        auto components_per_pixel = 3;
-        
-        // Load the image
-        data = stbi_load(filename, &width, &height, &components_per_pixel, components_per_pixel);
+    // Decodes filename right away
+    image_texture(const char* filename) {
+        decode(filename);
+        print_result(filename);
+    }
 
+    // No pixels until decode() runs, which texture_loader does on the task pool
+    image_texture() = default;
+
+    // Loads the file and converts it to float texels in [0, 1] once, so lookups only
+    // index. Safe to run on any thread; the outcome is kept for print_result().
+    bool decode(const char* filename) {
+        int components_per_pixel = 3;
+        unsigned char* data = stbi_load(filename, &width, &height, &components_per_pixel, components_per_pixel);
         if (!data) {
-            std::cerr << "ERROR: Could not load texture image file '" << filename << "'.\n";
-            std::cerr << "Error: " << stbi_failure_reason() << "\n";
+            failure = stbi_failure_reason();
             width = height = 0;
-            return;
+            return false;
         }
 
-        bytes_per_scanline = width * 3;
-        std::cerr << "SUCCESS: Loaded texture '" << filename << "' (" 
-                  << width << "x" << height << ")\n";
+        auto color_scale = 1.0 / 255.0;
+        texels.resize(size_t(width) * height * 3);
+        for (size_t k = 0; k < texels.size(); k++)
+            texels[k] = float(color_scale * data[k]);
+        stbi_image_free(data);
+
+        scene_memory().add(memory_category::textures, texels.size() * sizeof(float));
+        return true;
     }
 
-    ~image_texture() {
-        if (data) {
-            stbi_image_free(data);
+    void print_result(const char* filename) const {
+        if (texels.empty()) {
+            std::cerr << "ERROR: Could not load texture image file '" << filename << "'.\n";
+            std::cerr << "Error: " << (failure ? failure : "not decoded") << "\n";
+            return;
         }
+        std::cerr << "SUCCESS: Loaded texture '" << filename << "' (" 
+                  << width << "x" << height << ")\n";
     }
 
+    bool loaded() const { return !texels.empty(); }
+
 
 
 
@@ -66,7 +136,7 @@ public:
     // Sample color from image at texture coridantes (u,v)
     color value(double u, double v, const point3& p) const override {
         // If no texture data, return solid cyan (debug color)
-        if (data == nullptr || height <= 0) 
+        if (texels.empty()) 
             return color(0, 1, 1);
 
         u = interval(0, 1).clamp(u);
@@ -79,17 +149,59 @@ public:
         if (i >= width)  i = width - 1;
         if (j >= height) j = height - 1;
 
-        auto pixel = data + j * bytes_per_scanline + i * 3;
+        const float* pixel = texels.data() + (size_t(j) * width + i) * 3;
+        return color(pixel[0], pixel[1], pixel[2]);
+    }
+
 
-        auto color_scale = 1.0 / 255.0;
-        return color(color_scale * pixel[0], color_scale * pixel[1], color_scale * pixel[2]);
+private:
+    std::vector<float> texels;  // RGB rows, top to bottom
+    int width = 0, height = 0;
+    const char* failure = nullptr;
+};
+
+
+
+
+
+// Decodes image textures on the task pool while the rest of the scene is built.
+// load() returns the texture at once and queues its decode; wait() must be called
+// before rendering, and prints each file's outcome in load order. A file loaded more
+// than once is decoded once and shared.
+class texture_loader {
+public:
+    explicit texture_loader(scene_arena& arena, task_pool& pool = task_pool::instance())
+        : arena(arena), group(pool) {}
+
+    shared_ptr<image_texture> load(const std::string& filename) {
+        auto found = textures.find(filename);
+        if (found != textures.end())
+            return found->second;
+
+        auto tex = arena.make<image_texture>();
+        textures.emplace(filename, tex);
+        queued.emplace_back(filename, tex);
+        group.run([tex, filename] { tex->decode(filename.c_str()); });
+        return tex;
     }
 
+    // Blocks until every queued decode is done; false if any file failed to load
+    bool wait(bool print = true) {
+        group.wait();
+        bool ok = true;
+        for (const auto& [filename, tex] : queued) {
+            if (print) tex->print_result(filename.c_str());
+            ok = ok && tex->loaded();
+        }
+        queued.clear();
+        return ok;
+    }
 
 private:
-    unsigned char* data;
-    int width, height;
-    int bytes_per_scanline;
+    scene_arena& arena;
+    task_pool::task_group group;
+    std::map<std::string, shared_ptr<image_texture>> textures;
+    std::vector<std::pair<std::string, shared_ptr<image_texture>>> queued;  // Not yet waited for
 };
 
 
@@ -106,13 +218,35 @@ public:
         : checker_texture(scale, make_shared<solid_color>(c1), make_shared<solid_color>(c2)) {}
 
     color value(double u, double v, const point3& p) const override {
+        return is_even(inv_scale, p) ? even->value(u, v, p) : odd->value(u, v, p);
+    }
+
+    bool needs_uv() const override { return even->needs_uv() || odd->needs_uv(); }
+
+    // Folds to a constant when both halves are the same color, inline when both are constant
+    flat_texture flatten() const override {
+        flat_texture flat_even = even->flatten(), flat_odd = odd->flatten();
+        if (!flat_even.is_constant() || !flat_odd.is_constant())
+            return texture::flatten();
+        const color& a = flat_even.even;
+        const color& b = flat_odd.even;
+        if (a.x() == b.x() && a.y() == b.y() && a.z() == b.z())
+            return flat_even;
+
+        flat_texture flat;
+        flat.code = flat_texture::op::checker;
+        flat.even = flat_even.even;
+        flat.odd = flat_odd.even;
+        flat.inv_scale = inv_scale;
+        return flat;
+    }
+
+    static bool is_even(double inv_scale, const point3& p) {
         auto xInteger = int(std::floor(inv_scale * p.x()));
         auto yInteger = int(std::floor(inv_scale * p.y()));
         auto zInteger = int(std::floor(inv_scale * p.z()));
 
-        bool isEven = (xInteger + yInteger + zInteger) % 2 == 0;
-
-        return isEven ? even->value(u, v, p) : odd->value(u, v, p);
+        return (xInteger + yInteger + zInteger) % 2 == 0;
     }
 
 
@@ -133,12 +267,26 @@ public:
 
     // Marble pattern
     color value(double u, double v, const point3& p) const override {
-        return color(0.5, 0.5, 0.5) * (1 + std::sin(scale * p.z() + 10 * noise.turb(p, 7)));
+        return color(0.5, 0.5, 0.5) * (1 + math_sin(scale * p.z() + 10 * noise.turb(p, 7)));
     }
 
+    bool needs_uv() const override { return false; }
+
 private:
     perlin noise;
     double scale;
 };
 
+
+
+
+
+inline color flat_texture::value(double u, double v, const point3& p) const {
+    switch (code) {
+        case op::constant: return even;
+        case op::checker:  return checker_texture::is_even(inv_scale, p) ? even : odd;
+        default:           return tex->value(u, v, p);
+    }
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,165 @@
+#ifndef TILE_WRITER_H
+#define TILE_WRITER_H
+
+#include "color.h"
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+// Image file written tile by tile, in place, for renders too large to keep in memory.
+// The file is created at its final size up front, then each finished tile's rows are
+// written straight to their offsets, so only the tiles being rendered are ever in memory.
+// The format follows the extension:
+//   .pfm  Portable Float Map: linear HDR floats, rows bottom to top, little-endian
+//   .ppm  binary P6, tone mapped like the normal output
+// Both are plain single-image files any viewer reads, nothing needs reassembling.
+// open_existing() reopens such a file to read and rewrite regions of it in place.
+class tile_writer {
+public:
+    ~tile_writer() { close(); }
+
+    bool open(const std::string& filename, int image_width, int image_height) {
+        path = filename;
+        width = image_width;
+        height = image_height;
+        float_pixels = path.size() >= 4 && path.compare(path.size() - 4, 4, ".pfm") == 0;
+
+        file.open(path, std::ios::binary | std::ios::out | std::ios::trunc);
+        if (!file) {
+            std::cerr << "ERROR: Could not write image '" << path << "'\n";
+            return false;
+        }
+
+        std::string header = float_pixels
+            ? "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n"
+            : "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+        file.write(header.data(), std::streamsize(header.size()));
+        header_bytes = std::uint64_t(header.size());
+
+        // Extend to the final size now; untouched parts stay sparse until tiles land
+        std::uint64_t total = header_bytes + std::uint64_t(width) * height * pixel_bytes();
+        file.seekp(std::streamoff(total - 1));
+        file.put('\0');
+        if (!file) {
+            std::cerr << "ERROR: Could not size image '" << path << "' to " << total << " bytes\n";
+            return false;
+        }
+        return true;
+    }
+
+    // Opens an image written by open() (any binary P6 or little-endian PFM works) for
+    // reading and rewriting tiles in place. Its size must be image_width x image_height.
+    bool open_existing(const std::string& filename, int image_width, int image_height) {
+        path = filename;
+        file.open(path, std::ios::binary | std::ios::in | std::ios::out);
+        if (!file) {
+            std::cerr << "ERROR: Could not open image '" << path << "'\n";
+            return false;
+        }
+
+        std::string magic;
+        double max_value = 0;
+        file >> magic >> width >> height >> max_value;
+        file.get();  // The single whitespace before the pixels
+        if (!file || (magic != "PF" && magic != "P6")
+                  || (magic == "PF" && max_value >= 0) || (magic == "P6" && max_value != 255)) {
+            std::cerr << "ERROR: '" << path << "' is not a binary .ppm (P6) or little-endian .pfm\n";
+            return false;
+        }
+        if (width != image_width || height != image_height) {
+            std::cerr << "ERROR: '" << path << "' is " << width << "x" << height
+                      << ", expected " << image_width << "x" << image_height << "\n";
+            return false;
+        }
+        float_pixels = magic == "PF";
+        header_bytes = std::uint64_t(file.tellg());
+        return true;
+    }
+
+    // Writes a tile_w x tile_h block of linear colours (row-major) with its top-left
+    // pixel at (x, y). Safe to call from several threads.
+    bool write_tile(int x, int y, int tile_w, int tile_h, const color* pixels) {
+        // Encode outside the lock, so threads only queue up for the file itself
+        thread_local std::vector<unsigned char> encoded;
+        const size_t row_bytes = size_t(tile_w) * pixel_bytes();
+        encoded.resize(row_bytes * tile_h);
+        for (int r = 0; r < tile_h; r++)
+            encode_row(pixels + size_t(r) * tile_w, tile_w, encoded.data() + r * row_bytes);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int r = 0; r < tile_h; r++) {
+            // PFM stores the bottom row first
+            std::uint64_t file_row = float_pixels ? std::uint64_t(height - 1 - (y + r)) : std::uint64_t(y + r);
+            std::uint64_t offset = header_bytes + (file_row * width + x) * pixel_bytes();
+            file.seekp(std::streamoff(offset));
+            file.write(reinterpret_cast<const char*>(encoded.data() + r * row_bytes), std::streamsize(row_bytes));
+        }
+        if (!file) {
+            std::cerr << "ERROR: Could not write tile at " << x << "," << y << " of '" << path << "'\n";
+            return false;
+        }
+        return true;
+    }
+
+    // Reads a tile_w x tile_h block of linear colours with its top-left pixel at (x, y).
+    // Only .pfm files hold linear colours; the bytes of a .ppm cannot be read back exactly.
+    bool read_tile(int x, int y, int tile_w, int tile_h, color* pixels) {
+        if (!float_pixels) {
+            std::cerr << "ERROR: '" << path << "' holds tone mapped bytes, linear pixels need a .pfm\n";
+            return false;
+        }
+        std::vector<float> row(size_t(tile_w) * 3);
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int r = 0; r < tile_h; r++) {
+            std::uint64_t file_row = std::uint64_t(height - 1 - (y + r));
+            file.seekg(std::streamoff(header_bytes + (file_row * width + x) * pixel_bytes()));
+            file.read(reinterpret_cast<char*>(row.data()), std::streamsize(row.size() * sizeof(float)));
+            for (int i = 0; i < tile_w; i++)
+                pixels[size_t(r) * tile_w + i] = color(row[3*i], row[3*i + 1], row[3*i + 2]);
+        }
+        if (!file) {
+            std::cerr << "ERROR: Could not read tile at " << x << "," << y << " of '" << path << "'\n";
+            return false;
+        }
+        return true;
+    }
+
+    bool close() {
+        if (!file.is_open())
+            return true;
+        file.close();
+        return !file.fail();
+    }
+
+    // Bytes per pixel in the file
+    std::uint64_t pixel_bytes() const { return float_pixels ? 3 * sizeof(float) : 3; }
+
+
+
+private:
+    std::string path;
+    std::fstream file;
+    std::mutex mutex;
+    int width = 0;
+    int height = 0;
+    bool float_pixels = false;
+    std::uint64_t header_bytes = 0;
+
+    void encode_row(const color* pixels, int count, unsigned char* out) const {
+        for (int i = 0; i < count; i++) {
+            if (float_pixels) {
+                float rgb[3] = { float(pixels[i].x()), float(pixels[i].y()), float(pixels[i].z()) };
+                std::memcpy(out + i * sizeof(rgb), rgb, sizeof(rgb));  // x86/ARM are little-endian
+            } else {
+                tone_map(pixels[i], out + i * 3);
+            }
+        }
+    }
+};
+
+#endif
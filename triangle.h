@@ -2,6 +2,64 @@
 #define TRIANGLE_H
 
 #include "hittable.h"
+#include "material.h"
+#include <cmath>
+#include <utility>
+
+
+// Ray prepared for the watertight triangle test (Woop, Benthin and Wald 2013).
+// Axes are permuted so z is the ray direction's largest component, and the shear
+// (sx, sy, sz) maps the direction onto +z. Computed once per ray, shared by every triangle.
+struct watertight_ray {
+    int kx, ky, kz;
+    double sx, sy, sz;
+
+    explicit watertight_ray(const vec3& dir) {
+        double ax = std::fabs(dir.x()), ay = std::fabs(dir.y()), az = std::fabs(dir.z());
+        kz = (ax > ay) ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        if (dir[kz] < 0) std::swap(kx, ky);  // Keeps the winding, so edge signs stay meaningful
+
+        sx = dir[kx] / dir[kz];
+        sy = dir[ky] / dir[kz];
+        sz = 1.0 / dir[kz];
+    }
+};
+
+// Watertight ray/triangle test. The vertices are moved into the sheared ray space, where
+// the ray is the +z axis through the origin, and 2D edge functions decide inside/outside.
+// Two triangles sharing an edge compute the same edge function with opposite sign, so a
+// ray can never slip between them, and there is no determinant epsilon to tune.
+// On a hit t is the plane distance, b1 and b2 the barycentrics of v1 and v2.
+inline bool watertight_hit(const ray& r, const watertight_ray& w,
+                           const point3& v0, const point3& v1, const point3& v2,
+                           double& t, double& b1, double& b2) {
+    const point3& o = r.origin();
+    vec3 a = v0 - o, b = v1 - o, c = v2 - o;
+
+    double ax = a[w.kx] - w.sx * a[w.kz], ay = a[w.ky] - w.sy * a[w.kz];
+    double bx = b[w.kx] - w.sx * b[w.kz], by = b[w.ky] - w.sy * b[w.kz];
+    double cx = c[w.kx] - w.sx * c[w.kz], cy = c[w.ky] - w.sy * c[w.kz];
+
+    double e0 = cx * by - cy * bx;  // Edge v1-v2, weight of v0
+    double e1 = ax * cy - ay * cx;  // Edge v2-v0, weight of v1
+    double e2 = bx * ay - by * ax;  // Edge v0-v1, weight of v2
+
+    // Hits on either side (no backface culling); an edge value of exactly 0 counts as inside
+    if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0))
+        return false;
+
+    double det = e0 + e1 + e2;
+    if (det == 0)
+        return false;
+
+    double z = w.sz * (e0 * a[w.kz] + e1 * b[w.kz] + e2 * c[w.kz]);
+    t = z / det;
+    b1 = e1 / det;
+    b2 = e2 / det;
+    return true;
+}
 
 // REQUIREMENT: Ray/triangle intersections with normal interpolation (smooth shading)
 class triangle : public hittable {
@@ -9,10 +67,7 @@ public:
     triangle(const point3& v0, const point3& v1, const point3& v2, 
              shared_ptr<material> mat)
         : v0(v0), v1(v1), v2(v2), mat(mat), smooth_shading(false) {
-        edge1 = v1 - v0;
-        edge2 = v2 - v0;
-        auto n = cross(edge1, edge2);
-        normal = unit_vector(n);
+        normal = unit_vector(cross(v1 - v0, v2 - v0));
         
         set_bounding_box();
     }
@@ -25,10 +80,7 @@ public:
              shared_ptr<material> mat)
         : v0(v0), v1(v1), v2(v2), n0(n0), n1(n1), n2(n2), 
           mat(mat), smooth_shading(true) {
-        edge1 = v1 - v0;
-        edge2 = v2 - v0;
-        auto n = cross(edge1, edge2);
-        normal = unit_vector(n);
+        normal = unit_vector(cross(v1 - v0, v2 - v0));
         
         set_bounding_box();
     }
@@ -53,39 +105,25 @@ public:
     }
 
     aabb bounding_box() const override { return bbox; }
+    scene_features features() const override { return material_features(mat); }
 
 
 
 
 
     // Ray-triangle test
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        vec3 h = cross(r.direction(), edge2);
-        double a = dot(edge1, h);
-
-        if (a > -1e-8 && a < 1e-8)
-            return false;
-
-        double f = 1.0 / a;
-        vec3 s = r.origin() - v0;
-        double u = f * dot(s, h); // first barycentric corrdinate
-
-        if (u < 0.0 || u > 1.0)
-            return false;
-
-        vec3 q = cross(s, edge1);
-        double v = f * dot(r.direction(), q); // second barycentric coordinate
-
-        if (v < 0.0 || u + v > 1.0)
+    bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
+        double t, u, v;
+        if (!barycentric_hit(r, ray_t, t, u, v))
             return false;
 
-        double t = f * dot(edge2, q);
-
-        if (!ray_t.surrounds(t))
-            return false;
+        rec.record(t, this, u, v);
+        return true;
+    }
 
-        rec.t = t;
-        rec.p = r.at(t);
+    void finalize_hit(const ray& r, hit_record& rec) const override {
+        double u = rec.b1, v = rec.b2;
+        rec.p = r.at(rec.t);
         
 
 
@@ -101,9 +139,12 @@ public:
         
         rec.u = u; // Stores barycentric coordinates as texture coordinates
         rec.v = v;
-        rec.mat = mat;
+        rec.mat = mat.get();
+    }
 
-        return true;
+    bool occluded(const ray& r, interval ray_t) const override {
+        double t, u, v;
+        return barycentric_hit(r, ray_t, t, u, v);
     }
 
 
@@ -111,11 +152,17 @@ public:
 private:
     point3 v0, v1, v2;
     vec3 n0, n1, n2;
-    vec3 edge1, edge2;
     vec3 normal;
     shared_ptr<material> mat;
     aabb bbox;
     bool smooth_shading;
+
+    // Watertight test (see watertight_hit), shared by intersect() and occluded()
+    bool barycentric_hit(const ray& r, const interval& ray_t, double& t, double& u, double& v) const {
+        WICKED_STAT(primitives_tested);
+        return watertight_hit(r, watertight_ray(r.direction()), v0, v1, v2, t, u, v)
+            && ray_t.surrounds(t);
+    }
 };
 
 #endif
@@ -0,0 +1,340 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "hittable.h"
+#include "material.h"
+#include "triangle.h"
+#include "bvh_build.h"
+#include "lbvh_build.h"
+#include "bvh_wide.h"
+#include "arena.h"
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+// Triangles tested together in one BVH leaf: 8 fills two SSE or one AVX register of
+// floats, 4 suits narrower targets (build with -DWICKED_TRIANGLE_GROUP=4)
+#ifndef WICKED_TRIANGLE_GROUP
+#define WICKED_TRIANGLE_GROUP 8
+#endif
+
+
+// Many triangles (fans, meshes, soups) as one primitive.
+// The internal BVH is built with leaves of up to group_width triangles, and every leaf is
+// stored as one group: vertex positions as float structure-of-arrays, laid out once at
+// build time. A leaf is intersected with the watertight test of triangle.h for all of its
+// triangles at once, in a branch-free loop the compiler vectorizes.
+// Call add() for every triangle, then build() once before rendering.
+class triangle_mesh : public hittable {
+public:
+    static constexpr int group_width = WICKED_TRIANGLE_GROUP;
+    static_assert(group_width == 4 || group_width == 8, "WICKED_TRIANGLE_GROUP must be 4 or 8");
+
+    // v[vertex][axis][lane]: each coordinate of each vertex is one contiguous lane array
+    struct alignas(32) triangle_group {
+        float v[3][3][group_width];
+    };
+
+    // The ray's shear in double (exact fallback) and float (group test), computed once per query
+    struct group_ray {
+        const ray& r;
+        watertight_ray w;
+        float sx, sy, sz;
+        float ox, oy, oz;  // Origin, permuted like the axes
+
+        explicit group_ray(const ray& r)
+            : r(r), w(r.direction()),
+              sx(float(w.sx)), sy(float(w.sy)), sz(float(w.sz)),
+              ox(float(r.origin()[w.kx])), oy(float(r.origin()[w.ky])), oz(float(r.origin()[w.kz])) {}
+    };
+
+
+
+    void add(const point3& v0, const point3& v1, const point3& v2, shared_ptr<material> mat) {
+        vec3 n = unit_vector(cross(v1 - v0, v2 - v0));
+        add(v0, v1, v2, n, n, n, mat);
+    }
+
+    // REQUIREMENT: Normal interpolation for smooth shading
+    void add(const point3& v0, const point3& v1, const point3& v2,
+             const vec3& n0, const vec3& n1, const vec3& n2, shared_ptr<material> mat) {
+        auto found = material_lookup.find(mat.get());
+        std::uint32_t index;
+        if (found != material_lookup.end()) {
+            index = found->second;
+        } else {
+            index = std::uint32_t(materials.size());
+            material_lookup.emplace(mat.get(), index);
+            materials.push_back(mat);
+        }
+        pending.push_back(pending_triangle{{v0, v1, v2}, {n0, n1, n2}, index});
+    }
+
+
+
+    // Builds the BVH and packs each leaf's triangles into one group
+    void build(const bvh_build_options& options = bvh_build_options()) {
+        size_t n = pending.size();
+        triangle_count = n;
+        groups.clear();
+        normals.clear();
+        slot_materials.clear();
+        tree.clear();
+        bbox = aabb::empty;
+        if (n == 0) return;
+
+        std::vector<aabb> bounds(n);
+        for (size_t i = 0; i < n; i++) {
+            const auto& v = pending[i].v;
+            bounds[i] = aabb(aabb(v[0], v[1]), aabb(v[2], v[2])).pad();
+        }
+
+        bvh_build_options leaf_options = options;
+        leaf_options.max_leaf_size = group_width;
+        leaf_options.leaf_group = group_width;
+        std::vector<bvh_flat_node> nodes;
+        std::vector<int> order;
+        if (options.method == bvh_method::lbvh)
+            lbvh_builder(bounds, leaf_options).build(nodes, order);
+        else
+            bvh_builder(bounds, leaf_options).build(nodes, order);
+
+        // Leaves become groups, unused lanes are NaN and never hit
+        const float nan = std::numeric_limits<float>::quiet_NaN();
+        for (auto& node : nodes) {
+            if (!node.is_leaf()) continue;
+
+            int group = int(groups.size());
+            groups.emplace_back();
+            normals.resize(normals.size() + group_width);
+            slot_materials.resize(slot_materials.size() + group_width, 0);
+            auto& g = groups.back();
+
+            for (int k = 0; k < group_width; k++) {
+                size_t slot = size_t(group) * group_width + k;
+                for (int vertex = 0; vertex < 3; vertex++) {
+                    for (int axis = 0; axis < 3; axis++) {
+                        g.v[vertex][axis][k] = k < node.count
+                            ? float(pending[order[node.start + k]].v[vertex][axis]) : nan;
+                    }
+                }
+                if (k < node.count) {
+                    const auto& tri = pending[order[node.start + k]];
+                    normals[slot] = corner_normals{tri.n[0], tri.n[1], tri.n[2]};
+                    slot_materials[slot] = tri.material;
+                }
+            }
+
+            node.start = group;
+            node.count = 1;
+        }
+
+        bbox = nodes[0].bbox;
+        tree.assign(std::move(nodes), options);
+        pending.clear();
+        pending.shrink_to_fit();
+        material_lookup.clear();
+        scene_memory().add(memory_category::geometry, memory_bytes() - tree.memory_bytes());
+    }
+
+
+
+    size_t size() const { return triangle_count; }
+
+    // Fraction of group lanes holding a triangle
+    double occupancy() const {
+        return groups.empty() ? 0.0 : double(triangle_count) / (groups.size() * group_width);
+    }
+
+    // Bytes held after build(): triangle groups, normals, material indices and BVH nodes
+    size_t memory_bytes() const {
+        return groups.size() * sizeof(triangle_group)
+             + normals.size() * sizeof(corner_normals)
+             + slot_materials.size() * sizeof(std::uint32_t)
+             + tree.memory_bytes()
+             + materials.size() * sizeof(shared_ptr<material>);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    scene_features features() const override {
+        scene_features features;
+        for (const auto& mat : materials)
+            features |= material_features(mat);
+        return features;
+    }
+
+
+
+
+
+    bool intersect(const ray& r, interval ray_t, hit_record& rec) const override {
+        group_ray gr(r);
+        bool hit_anything = false;
+
+        tree.traverse(r, ray_t, [&](int group) {
+            float t;
+            int lane = nearest_in_group(group, gr, ray_t, t);
+            if (lane < 0)
+                return false;
+            rec.record(t, this, double(group * group_width + lane));
+            rec.t_min = ray_t.min;
+            ray_t.max = t;
+            hit_anything = true;
+            return false;
+        });
+
+        return hit_anything;
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override {
+        group_ray gr(r);
+        return tree.traverse(r, ray_t, [&](int group) {
+            float t;
+            return nearest_in_group(group, gr, ray_t, t) >= 0;
+        });
+    }
+
+    // Redoes the winning triangle's test in double for t and the barycentrics, then fills
+    // the usual attributes. UVs are the barycentrics, like triangle. The float t is kept
+    // if the double t falls at or below the query's t_min, behind the offset origin.
+    void finalize_hit(const ray& r, hit_record& rec) const override {
+        int slot = int(rec.b1);
+        point3 v0 = vertex(slot, 0), v1 = vertex(slot, 1), v2 = vertex(slot, 2);
+
+        double t, u = 1.0 / 3, v = 1.0 / 3;
+        if (watertight_hit(r, watertight_ray(r.direction()), v0, v1, v2, t, u, v) && t > rec.t_min)
+            rec.t = t;
+
+        rec.p = r.at(rec.t);
+        const auto& n = normals[slot];
+        double w = 1.0 - u - v;
+        vec3 interpolated = w * vec3(n.n[0][0], n.n[0][1], n.n[0][2])
+                          + u * vec3(n.n[1][0], n.n[1][1], n.n[1][2])
+                          + v * vec3(n.n[2][0], n.n[2][1], n.n[2][2]);
+        rec.set_face_normal(r, unit_vector(interpolated));
+
+        rec.u = u;
+        rec.v = v;
+        rec.mat = materials[slot_materials[slot]].get();
+    }
+
+
+
+private:
+    struct pending_triangle {
+        point3 v[3];
+        vec3 n[3];
+        std::uint32_t material;
+    };
+
+    struct corner_normals {
+        float n[3][3];
+
+        corner_normals() = default;
+        corner_normals(const vec3& a, const vec3& b, const vec3& c)
+            : n{{float(a.x()), float(a.y()), float(a.z())},
+                {float(b.x()), float(b.y()), float(b.z())},
+                {float(c.x()), float(c.y()), float(c.z())}} {}
+    };
+
+    std::vector<pending_triangle> pending;  // Until build()
+    std::unordered_map<const material*, std::uint32_t> material_lookup;
+
+    std::vector<triangle_group> groups;           // One per BVH leaf
+    std::vector<corner_normals> normals;          // Per group lane
+    std::vector<std::uint32_t> slot_materials;    // Material index per group lane
+    std::vector<shared_ptr<material>> materials;  // Distinct materials
+    bvh_tree tree;                                // Leaves reference one group each
+    size_t triangle_count = 0;
+    aabb bbox;
+
+
+
+    point3 vertex(int slot, int index) const {
+        const auto& g = groups[slot / group_width];
+        int k = slot % group_width;
+        return point3(g.v[index][0][k], g.v[index][1][k], g.v[index][2][k]);
+    }
+
+    // Vertices of one lane moved into the ray's sheared space, in float
+    struct sheared_triangle {
+        float ax, ay, az, bx, by, bz, cx, cy, cz;
+    };
+
+    static sheared_triangle shear(const triangle_group& g, int k, const group_ray& gr) {
+        const int kx = gr.w.kx, ky = gr.w.ky, kz = gr.w.kz;
+        sheared_triangle s;
+        s.az = g.v[0][kz][k] - gr.oz;
+        s.bz = g.v[1][kz][k] - gr.oz;
+        s.cz = g.v[2][kz][k] - gr.oz;
+        s.ax = g.v[0][kx][k] - gr.ox - gr.sx * s.az;
+        s.ay = g.v[0][ky][k] - gr.oy - gr.sy * s.az;
+        s.bx = g.v[1][kx][k] - gr.ox - gr.sx * s.bz;
+        s.by = g.v[1][ky][k] - gr.oy - gr.sy * s.bz;
+        s.cx = g.v[2][kx][k] - gr.ox - gr.sx * s.cz;
+        s.cy = g.v[2][ky][k] - gr.oy - gr.sy * s.cz;
+        return s;
+    }
+
+    // Same test as watertight_hit, on the sheared float vertices with edge functions of type E
+    template <typename E>
+    static float lane_hit(const sheared_triangle& s, float sz, float t_min, float t_max, bool& redo) {
+        E e0 = E(s.cx) * s.by - E(s.cy) * s.bx;
+        E e1 = E(s.ax) * s.cy - E(s.ay) * s.cx;
+        E e2 = E(s.bx) * s.ay - E(s.by) * s.ax;
+        redo = (e0 == 0) | (e1 == 0) | (e2 == 0);
+
+        E det = e0 + e1 + e2;
+        E t = sz * (e0 * s.az + e1 * s.bz + e2 * s.cz) / det;
+        // Bitwise & and | keep the lane free of branches, so the group loop vectorizes
+        bool inside = ((e0 >= 0) & (e1 >= 0) & (e2 >= 0)) | ((e0 <= 0) & (e1 <= 0) & (e2 <= 0));
+        bool valid = inside & (det != 0) & (t > t_min) & (t < t_max);
+        return valid ? float(t) : std::numeric_limits<float>::infinity();
+    }
+
+    int nearest_in_group(int group, const group_ray& gr, const interval& ray_t, float& t_hit) const {
+        return nearest_in_group(groups[group], gr, ray_t, t_hit);
+    }
+
+
+
+public:
+    // Lane of the nearest triangle hit strictly inside ray_t, or -1.
+    // The float version of watertight_hit, on all lanes without branches. Shared edges
+    // stay watertight in float because both triangles shear the same float vertices;
+    // only an edge function of exactly 0 can have the wrong sign after rounding, and
+    // those rare lanes redo the edge functions from the same sheared vertices in double,
+    // as Woop et al. do. (Assumes no FMA contraction, which the default flags never emit.)
+    // Public for indexed_mesh, which decodes its leaves into a triangle_group first.
+    static int nearest_in_group(const triangle_group& g, const group_ray& gr, const interval& ray_t, float& t_hit) {
+        WICKED_STAT(primitives_tested);
+        const float t_min = float(ray_t.min), t_max = float(ray_t.max);
+        float t[group_width];
+        bool redo[group_width];
+
+        for (int k = 0; k < group_width; k++)
+            t[k] = lane_hit<float>(shear(g, k, gr), gr.sz, t_min, t_max, redo[k]);
+
+        for (int k = 0; k < group_width; k++) {
+            bool exact_zero;
+            if (redo[k])
+                t[k] = lane_hit<double>(shear(g, k, gr), gr.sz, t_min, t_max, exact_zero);
+        }
+
+        int best = -1;
+        float best_t = t_max;
+        for (int k = 0; k < group_width; k++) {
+            if (t[k] < best_t) {
+                best_t = t[k];
+                best = k;
+            }
+        }
+        t_hit = best_t;
+        return best;
+    }
+};
+
+#endif